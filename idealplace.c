@@ -3,6 +3,7 @@
  *
  * version 0.1  2024-11-21
  * version 0.2  2025-07-27	added per-month capability
+ * version 0.3  2026-10-18	row-by-row png i/o, streaming score mode
  *
  * copyright 2024,5  Mark J. Stock  markjstock@gmail.com
  *
@@ -24,10 +25,71 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <setjmp.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#include <zlib.h>
+#include <limits.h>
+#endif
+
+// state for decoding a grey png one row at a time
+typedef struct png_rows {
+   FILE *fp;
+   png_structp png_ptr;
+   png_infop info_ptr;
+   int nx, ny;
+   int high_depth;
+   int nextrow;		// south-up index of the next row to be decoded
+   float min, range;	// value = min + range * sample / maxsample, as in read_png
+   png_byte *buf;
+} png_rows;
 
+// state for encoding a 16-bit grey png one row at a time
+typedef struct png_out {
+   FILE *fp;
+   png_structp png_ptr;
+   png_infop info_ptr;
+   int nx;
+   png_byte *buf;
+} png_out;
+
+// a png being decoded on its own thread into a ring of rows
+typedef struct row_queue {
+   png_rows pr;
+   int nslots;
+   float **slot;
+   int produced, consumed;	// row counts, guarded by lock
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t thread;
+} row_queue;
+
+// a caller that can recover from a bad input sets this, otherwise any
+// error ends the program
+static _Thread_local jmp_buf *fail_jmp = NULL;
+
+_Noreturn void fail (const int status) {
+   fflush(stderr);
+   if (fail_jmp) longjmp(*fail_jmp, 1);
+   exit(status);
+}
 
 /*
  * allocate memory for a two-dimensional array of float
+ *
+ * the first index is the slow one, and all of our grids are
+ * allocated as [row][col] so that each row is contiguous
  */
 float** allocate_2d_array_f(int nx,int ny) {
 
@@ -41,56 +103,28 @@ float** allocate_2d_array_f(int nx,int ny) {
    return(array);
 }
 
-int free_2d_array_f(float** array){
-   free(array[0]);
-   free(array);
-   return(0);
-}
-
-/*
- * allocate memory for a two-dimensional array of png_byte
- */
-png_byte** allocate_2d_array_pb(int nx, int ny, int depth) {
-
-   int i,bytesperpixel;
-   png_byte **array;
-
-   if (depth <= 8) bytesperpixel = 1;
-   else bytesperpixel = 2;
-   array = (png_byte **)malloc(ny * sizeof(png_byte *));
-   array[0] = (png_byte *)malloc(bytesperpixel * nx * ny * sizeof(png_byte));
-
-   for (i=1; i<ny; i++)
-      array[i] = array[0] + i * bytesperpixel * nx;
-
-   return(array);
-}
-
-png_byte** allocate_2d_rgb_array_pb(int nx, int ny, int depth) {
-
-   int i,bytesperpixel;
-   png_byte **array;
-
-   if (depth <= 8) bytesperpixel = 3;
-   else bytesperpixel = 6;
-   array = (png_byte **)malloc(ny * sizeof(png_byte *));
-   array[0] = (png_byte *)malloc(bytesperpixel * nx * ny * sizeof(png_byte));
+// only rows lo to hi of a yres-row grid, the others are left NULL
+float** allocate_band_f(int yres,int xres,int lo,int hi) {
 
-   for (i=1; i<ny; i++)
-      array[i] = array[0] + i * bytesperpixel * nx;
+   float **array = (float **)calloc(yres, sizeof(float *));
+   float *band = (float *)malloc((long)(hi-lo) * xres * sizeof(float));
+   for (int row=lo; row<hi; row++)
+      array[row] = band + (long)(row-lo) * xres;
 
    return(array);
 }
 
-int free_2d_array_pb(png_byte** array){
+int free_2d_array_f(float** array){
    free(array[0]);
    free(array);
    return(0);
 }
 
-
 /*
  * print a frame using 1 or 3 channels to png - 2D
+ *
+ * arrays are [row][col] with row 0 at the bottom (south) of the image;
+ * rows are converted and written one at a time
  */
 int write_png (char *outfile, int nx, int ny,
    int three_channel, int high_depth,
@@ -109,23 +143,17 @@ int write_png (char *outfile, int nx, int ny,
    png_uint_32 height,width;
    png_structp png_ptr;
    png_infop info_ptr;
-   png_byte **img;
-   int is_allocated = FALSE;
-   png_byte **imgrgb;
-   int rgb_is_allocated = FALSE;
+   png_byte *img;
 
    // set specific bit depth
    if (high_depth) bit_depth = 16;
    else bit_depth = 8;
 
-   // allocate the space for the special array
-   if (!is_allocated && !three_channel) {
-      img = allocate_2d_array_pb(nx,ny,bit_depth);
-      is_allocated = TRUE;
-   }
-   if (!rgb_is_allocated && three_channel) {
-      imgrgb = allocate_2d_rgb_array_pb(nx,ny,bit_depth);
-      rgb_is_allocated = TRUE;
+   // allocate the space for a single row
+   if (three_channel) {
+      img = (png_byte *)malloc(3 * (bit_depth/8) * nx * sizeof(png_byte));
+   } else {
+      img = (png_byte *)malloc((bit_depth/8) * nx * sizeof(png_byte));
    }
 
    // set the sizes in png-understandable format
@@ -138,10 +166,10 @@ int write_png (char *outfile, int nx, int ny,
       // first red
       newminrange = 9.9e+9;
       newmaxrange = -9.9e+9;
-      for (i=0; i<nx; i++) {
-         for (j=ny-1; j>=0; j--) {
-            if (red[i][j]<newminrange) newminrange=red[i][j];
-            if (red[i][j]>newmaxrange) newmaxrange=red[i][j];
+      for (j=ny-1; j>=0; j--) {
+         for (i=0; i<nx; i++) {
+            if (red[j][i]<newminrange) newminrange=red[j][i];
+            if (red[j][i]>newmaxrange) newmaxrange=red[j][i];
          }
       }
       //printf("range %g %g\n",newminrange,newmaxrange);
@@ -154,10 +182,10 @@ int write_png (char *outfile, int nx, int ny,
          // then green
          newminrange = 9.9e+9;
          newmaxrange = -9.9e+9;
-         for (i=0; i<nx; i++) {
-            for (j=ny-1; j>=0; j--) {
-               if (grn[i][j]<newminrange) newminrange=grn[i][j];
-               if (grn[i][j]>newmaxrange) newmaxrange=grn[i][j];
+         for (j=ny-1; j>=0; j--) {
+            for (i=0; i<nx; i++) {
+               if (grn[j][i]<newminrange) newminrange=grn[j][i];
+               if (grn[j][i]>newmaxrange) newmaxrange=grn[j][i];
             }
          }
          grnmin = newminrange;
@@ -166,10 +194,10 @@ int write_png (char *outfile, int nx, int ny,
          // then blue
          newminrange = 9.9e+9;
          newmaxrange = -9.9e+9;
-         for (i=0; i<nx; i++) {
-            for (j=ny-1; j>=0; j--) {
-               if (blu[i][j]<newminrange) newminrange=blu[i][j];
-               if (blu[i][j]>newmaxrange) newmaxrange=blu[i][j];
+         for (j=ny-1; j>=0; j--) {
+            for (i=0; i<nx; i++) {
+               if (blu[j][i]<newminrange) newminrange=blu[j][i];
+               if (blu[j][i]>newmaxrange) newmaxrange=blu[j][i];
             }
          }
          blumin = newminrange;
@@ -179,10 +207,10 @@ int write_png (char *outfile, int nx, int ny,
        // report the range
       newminrange = 9.9e+9;
       newmaxrange = -9.9e+9;
-      for (i=0; i<nx; i++) {
-         for (j=ny-1; j>=0; j--) {
-            if (red[i][j]<newminrange) newminrange=red[i][j];
-            if (red[i][j]>newmaxrange) newmaxrange=red[i][j];
+      for (j=ny-1; j>=0; j--) {
+         for (i=0; i<nx; i++) {
+            if (red[j][i]<newminrange) newminrange=red[j][i];
+            if (red[j][i]>newmaxrange) newmaxrange=red[j][i];
          }
       }
       printf("  output range %g %g\n",newminrange,newmaxrange);
@@ -196,90 +224,6 @@ int write_png (char *outfile, int nx, int ny,
       exit(0);
    }
 
-   // now do the other two channels
-   if (three_channel) {
-
-     // no scaling, 16-bit per channel, RGB
-     if (high_depth) {
-       // am I looping these coordinates in the right memory order?
-       for (j=ny-1; j>=0; j--) {
-         for (i=0; i<nx; i++) {
-           // red
-           printval = (int)(0.5 + 65535*(red[i][j]-redmin)/redrange);
-           if (printval<0) printval = 0;
-           else if (printval>65535) printval = 65535;
-           imgrgb[ny-1-j][6*i] = (png_byte)(printval/256);
-           imgrgb[ny-1-j][6*i+1] = (png_byte)(printval%256);
-           // green
-           printval = (int)(0.5 + 65535*(grn[i][j]-grnmin)/grnrange);
-           if (printval<0) printval = 0;
-           else if (printval>65535) printval = 65535;
-           imgrgb[ny-1-j][6*i+2] = (png_byte)(printval/256);
-           imgrgb[ny-1-j][6*i+3] = (png_byte)(printval%256);
-           // blue
-           printval = (int)(0.5 + 65535*(blu[i][j]-blumin)/blurange);
-           if (printval<0) printval = 0;
-           else if (printval>65535) printval = 65535;
-           imgrgb[ny-1-j][6*i+4] = (png_byte)(printval/256);
-           imgrgb[ny-1-j][6*i+5] = (png_byte)(printval%256);
-         }
-       }
-
-     // no scaling, 8-bit per channel, RGB
-     } else {
-       // am I looping these coordinates in the right memory order?
-       for (j=ny-1; j>=0; j--) {
-         for (i=0; i<nx; i++) {
-           // red
-           printval = (int)(0.5 + 256*(red[i][j]-redmin)/redrange);
-           if (printval<0) printval = 0;
-           else if (printval>255) printval = 255;
-           imgrgb[ny-1-j][3*i] = (png_byte)printval;
-           // green
-           printval = (int)(0.5 + 256*(grn[i][j]-grnmin)/grnrange);
-           if (printval<0) printval = 0;
-           else if (printval>255) printval = 255;
-           imgrgb[ny-1-j][3*i+1] = (png_byte)printval;
-           // blue
-           printval = (int)(0.5 + 256*(blu[i][j]-blumin)/blurange);
-           if (printval<0) printval = 0;
-           else if (printval>255) printval = 255;
-           imgrgb[ny-1-j][3*i+2] = (png_byte)printval;
-         }
-       }
-     }
-
-   // monochrome image, read data from red array
-   } else {
-
-     // no scaling, 16-bit per channel
-     if (high_depth) {
-       // am I looping these coordinates in the right memory order?
-       for (j=ny-1; j>=0; j--) {
-         for (i=0; i<nx; i++) {
-           printval = (int)(0.5 + 65534*(red[i][j]-redmin)/redrange);
-           if (printval<0) printval = 0;
-           else if (printval>65535) printval = 65535;
-           img[ny-1-j][2*i] = (png_byte)(printval/256);
-           img[ny-1-j][2*i+1] = (png_byte)(printval%256);
-         }
-       }
-
-     // no scaling, 8-bit per channel
-     } else {
-       // am I looping these coordinates in the right memory order?
-       for (j=ny-1; j>=0; j--) {
-         for (i=0; i<nx; i++) {
-           printval = (int)(0.5 + 254*(red[i][j]-redmin)/redrange);
-           if (printval<0) printval = 0;
-           else if (printval>255) printval = 255;
-           img[ny-1-j][i] = (png_byte)printval;
-         }
-       }
-     }
-
-   }
-
    /* Create and initialize the png_struct with the desired error handler
     * functions.  If you want to use the default stderr and longjump method,
     * you can supply NULL for the last three parameters.  We also check that
@@ -345,12 +289,81 @@ int write_png (char *outfile, int nx, int ny,
    /* Write the file header information.  REQUIRED */
    png_write_info(png_ptr, info_ptr);
 
-   /* One of the following output methods is REQUIRED */
-   // png_write_image(png_ptr, row_pointers);
-   if (three_channel) {
-      png_write_image(png_ptr, imgrgb);
-   } else {
-      png_write_image(png_ptr, img);
+   // convert and write one row at a time, top (north) row first
+   for (j=ny-1; j>=0; j--) {
+
+     // now do the other two channels
+     if (three_channel) {
+
+       // no scaling, 16-bit per channel, RGB
+       if (high_depth) {
+         for (i=0; i<nx; i++) {
+           // red
+           printval = (int)(0.5 + 65535*(red[j][i]-redmin)/redrange);
+           if (printval<0) printval = 0;
+           else if (printval>65535) printval = 65535;
+           img[6*i] = (png_byte)(printval/256);
+           img[6*i+1] = (png_byte)(printval%256);
+           // green
+           printval = (int)(0.5 + 65535*(grn[j][i]-grnmin)/grnrange);
+           if (printval<0) printval = 0;
+           else if (printval>65535) printval = 65535;
+           img[6*i+2] = (png_byte)(printval/256);
+           img[6*i+3] = (png_byte)(printval%256);
+           // blue
+           printval = (int)(0.5 + 65535*(blu[j][i]-blumin)/blurange);
+           if (printval<0) printval = 0;
+           else if (printval>65535) printval = 65535;
+           img[6*i+4] = (png_byte)(printval/256);
+           img[6*i+5] = (png_byte)(printval%256);
+         }
+
+       // no scaling, 8-bit per channel, RGB
+       } else {
+         for (i=0; i<nx; i++) {
+           // red
+           printval = (int)(0.5 + 256*(red[j][i]-redmin)/redrange);
+           if (printval<0) printval = 0;
+           else if (printval>255) printval = 255;
+           img[3*i] = (png_byte)printval;
+           // green
+           printval = (int)(0.5 + 256*(grn[j][i]-grnmin)/grnrange);
+           if (printval<0) printval = 0;
+           else if (printval>255) printval = 255;
+           img[3*i+1] = (png_byte)printval;
+           // blue
+           printval = (int)(0.5 + 256*(blu[j][i]-blumin)/blurange);
+           if (printval<0) printval = 0;
+           else if (printval>255) printval = 255;
+           img[3*i+2] = (png_byte)printval;
+         }
+       }
+
+     // monochrome image, read data from red array
+     } else {
+
+       // no scaling, 16-bit per channel
+       if (high_depth) {
+         for (i=0; i<nx; i++) {
+           printval = (int)(0.5 + 65534*(red[j][i]-redmin)/redrange);
+           if (printval<0) printval = 0;
+           else if (printval>65535) printval = 65535;
+           img[2*i] = (png_byte)(printval/256);
+           img[2*i+1] = (png_byte)(printval%256);
+         }
+
+       // no scaling, 8-bit per channel
+       } else {
+         for (i=0; i<nx; i++) {
+           printval = (int)(0.5 + 254*(red[j][i]-redmin)/redrange);
+           if (printval<0) printval = 0;
+           else if (printval>255) printval = 255;
+           img[i] = (png_byte)printval;
+         }
+       }
+     }
+
+     png_write_row(png_ptr, img);
    }
 
    /* It is REQUIRED to call this to finish writing the rest of the file */
@@ -362,9 +375,8 @@ int write_png (char *outfile, int nx, int ny,
    // close file
    fclose(fp);
 
-   // free the data array
-   if (is_allocated) free_2d_array_pb(img);
-   if (rgb_is_allocated) free_2d_array_pb(imgrgb);
+   // free the row
+   free(img);
 
    return(0);
 }
@@ -388,7 +400,7 @@ int read_png_res (char *infile, int *hgt, int *wdt) {
    if (fp==NULL) {
       fprintf(stderr,"Could not open input file %s\n",infile);
       fflush(stderr);
-      exit(0);
+      fail(0);
    }
 
    // check to see that it's a PNG
@@ -396,7 +408,8 @@ int read_png_res (char *infile, int *hgt, int *wdt) {
    if (png_sig_cmp(header, 0, 8)) {
       fprintf(stderr,"File %s is not a PNG\n",infile);
       fflush(stderr);
-      exit(0);
+      fclose(fp);
+      fail(0);
    }
 
    /* Create and initialize the png_struct with the desired error handler
@@ -413,7 +426,7 @@ int read_png_res (char *infile, int *hgt, int *wdt) {
    if (info_ptr == NULL) {
       fclose(fp);
       png_destroy_read_struct(&png_ptr, png_infopp_NULL, png_infopp_NULL);
-      exit(0);
+      fail(0);
    }
 
    /* Set error handling if you are using the setjmp/longjmp method (this is
@@ -424,7 +437,7 @@ int read_png_res (char *infile, int *hgt, int *wdt) {
       png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
       fclose(fp);
       /* If we get here, we had a problem reading the file */
-      exit(0);
+      fail(0);
    }
 
    /* One of the following I/O initialization methods is REQUIRED */
@@ -455,6 +468,13 @@ int read_png_res (char *infile, int *hgt, int *wdt) {
 }
 
 
+// give up on a png that is being read, and let go of it first
+static _Noreturn void png_read_fail (png_structp *png_ptr, png_infop *info_ptr, FILE *fp) {
+   png_destroy_read_struct(png_ptr, info_ptr, png_infopp_NULL);
+   fclose(fp);
+   fail(0);
+}
+
 /*
  * read a PNG, write it to 1 or 3 channels
  */
@@ -465,19 +485,17 @@ int read_png (char *infile, int nx, int ny,
    float **grn, float grnmin, float grnrange,
    float **blu, float blumin, float blurange) {
 
-   int autorange = FALSE;
    int high_depth;
    int three_channel;
-   int i,j,printval; //,bit_depth,color_type,interlace_type;
-   float newminrange,newmaxrange;
-   float overlay_divisor;
+   int i,j;
+   float overlay_divisor = 1.0;
    FILE *fp;
    unsigned char header[8];
    png_uint_32 height,width;
    int bit_depth,color_type,interlace_type;
    png_structp png_ptr;
    png_infop info_ptr;
-   png_byte **img;
+   png_byte *volatile img = NULL;	// freed if libpng jumps back below
 
 
    // set up overlay divisor
@@ -494,7 +512,7 @@ int read_png (char *infile, int nx, int ny,
    if (fp==NULL) {
       fprintf(stderr,"Could not open input file %s\n",infile);
       fflush(stderr);
-      exit(0);
+      fail(0);
    }
 
    // check to see that it's a PNG
@@ -502,7 +520,8 @@ int read_png (char *infile, int nx, int ny,
    if (png_sig_cmp(header, 0, 8)) {
       fprintf(stderr,"File %s is not a PNG\n",infile);
       fflush(stderr);
-      exit(0);
+      fclose(fp);
+      fail(0);
    }
 
    /* Create and initialize the png_struct with the desired error handler
@@ -519,7 +538,7 @@ int read_png (char *infile, int nx, int ny,
    if (info_ptr == NULL) {
       fclose(fp);
       png_destroy_read_struct(&png_ptr, png_infopp_NULL, png_infopp_NULL);
-      exit(0);
+      fail(0);
    }
 
    /* Set error handling if you are using the setjmp/longjmp method (this is
@@ -529,8 +548,9 @@ int read_png (char *infile, int nx, int ny,
       /* Free all of the memory associated with the png_ptr and info_ptr */
       png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
       fclose(fp);
+      free(img);
       /* If we get here, we had a problem reading the file */
-      exit(0);
+      fail(0);
    }
 
    /* One of the following I/O initialization methods is REQUIRED */
@@ -578,13 +598,13 @@ int read_png (char *infile, int nx, int ny,
      fprintf(stderr,"INCOMPLETE: read_png expect 8-bit or 16-bit images\n");
      fprintf(stderr,"   bit_depth: %d\n",bit_depth);
      fprintf(stderr,"   file: %s\n",infile);
-     exit(0);
+     png_read_fail(&png_ptr, &info_ptr, fp);
    }
    if (color_type != PNG_COLOR_TYPE_GRAY && color_type != PNG_COLOR_TYPE_RGB) {
      fprintf(stderr,"INCOMPLETE: read_png expect grayscale (%d) or RGB (%d) images\n",PNG_COLOR_TYPE_GRAY,PNG_COLOR_TYPE_RGB);
      fprintf(stderr,"   color_type: %d\n",color_type);
      fprintf(stderr,"   file: %s\n",infile);
-     exit(0);
+     png_read_fail(&png_ptr, &info_ptr, fp);
    }
 
    // set channels
@@ -595,14 +615,14 @@ int read_png (char *infile, int nx, int ny,
      fprintf(stderr,"ERROR: expecting 3-channel PNG, but input is 1-channel\n");
      fprintf(stderr,"  file (%s)",infile);
      fprintf(stderr,"  Convert file to color and try again.\n");
-     exit(0);
+     png_read_fail(&png_ptr, &info_ptr, fp);
    }
 
    if (!expect_three_channel && three_channel) {
      fprintf(stderr,"ERROR: not expecting 3-channel PNG, but input is 3-channel\n");
      fprintf(stderr,"  file (%s)",infile);
      fprintf(stderr,"  Convert file to grayscale and try again.\n");
-     exit(0);
+     png_read_fail(&png_ptr, &info_ptr, fp);
    }
 
    // set specific bit depth
@@ -616,302 +636,6477 @@ int read_png (char *infile, int nx, int ny,
      fprintf(stderr,"  simulation %d x %d",nx,ny);
      fprintf(stderr,"  image %d x %d",width,height);
      fprintf(stderr,"  file (%s)",infile);
-     exit(0);
+     png_read_fail(&png_ptr, &info_ptr, fp);
    }
 
    // set the sizes so that we can understand them
    ny = height;
    nx = width;
 
-   // allocate the space for the image array
+   // allocate the space for a single image row
    if (three_channel) {
-      img = allocate_2d_rgb_array_pb(nx,ny,bit_depth);
+      img = (png_byte *)malloc(3 * (bit_depth/8) * nx * sizeof(png_byte));
    } else {
-      img = allocate_2d_array_pb(nx,ny,bit_depth);
+      img = (png_byte *)malloc((bit_depth/8) * nx * sizeof(png_byte));
    }
 
-   /* Now it's time to read the image.  One of these methods is REQUIRED */
-   png_read_image(png_ptr, img);
-
-   /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
-   png_read_end(png_ptr, info_ptr);
-
-   /* At this point you have read the entire image */
-
-   /* clean up after the read, and free any memory allocated - REQUIRED */
-   png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
-
-   /* close the file */
-   fclose(fp);
+   /* Now it's time to read the image, one row at a time, top row first,
+    * converting each to floats as we go */
+   for (j=ny-1; j>=0; j--) {
 
+     png_read_row(png_ptr, img, NULL);
 
-   // now convert the data to stuff we can use
-   if (three_channel) {
+     // now convert the data to stuff we can use
+     if (three_channel) {
 
-     // no scaling, 16-bit per channel, RGB
-     if (high_depth) {
-       if (overlay && !darkenonly) {
-         for (j=ny-1; j>=0; j--) {
+       // no scaling, 16-bit per channel, RGB
+       if (high_depth) {
+         if (overlay && !darkenonly) {
            for (i=0; i<nx; i++) {
-             red[i][j] = (red[i][j] + overlay_frac*(redmin+redrange*(img[ny-1-j][6*i]*256+img[ny-1-j][6*i+1])/65535.)) / overlay_divisor;
-             grn[i][j] = (grn[i][j] + overlay_frac*(grnmin+grnrange*(img[ny-1-j][6*i+2]*256+img[ny-1-j][6*i+3])/65535.)) / overlay_divisor;
-             blu[i][j] = (blu[i][j] + overlay_frac*(blumin+blurange*(img[ny-1-j][6*i+4]*256+img[ny-1-j][6*i+5])/65535.)) / overlay_divisor;
+             red[j][i] = (red[j][i] + overlay_frac*(redmin+redrange*(img[6*i]*256+img[6*i+1])/65535.)) / overlay_divisor;
+             grn[j][i] = (grn[j][i] + overlay_frac*(grnmin+grnrange*(img[6*i+2]*256+img[6*i+3])/65535.)) / overlay_divisor;
+             blu[j][i] = (blu[j][i] + overlay_frac*(blumin+blurange*(img[6*i+4]*256+img[6*i+5])/65535.)) / overlay_divisor;
            }
-         }
-       } else if (overlay && darkenonly) {
-         for (j=ny-1; j>=0; j--) {
+         } else if (overlay && darkenonly) {
            for (i=0; i<nx; i++) {
-             red[i][j] -= overlay_frac*(redmin+redrange*(1.-img[ny-1-j][3*i]/255.));
-             red[i][j] -= overlay_frac*(redmin+redrange*(1.-(img[ny-1-j][6*i]*256+img[ny-1-j][6*i+1])/65535.));
-             grn[i][j] -= overlay_frac*(grnmin+grnrange*(1.-(img[ny-1-j][6*i+2]*256+img[ny-1-j][6*i+3])/65535.));
-             blu[i][j] -= overlay_frac*(blumin+blurange*(1.-(img[ny-1-j][6*i+4]*256+img[ny-1-j][6*i+5])/65535.));
+             red[j][i] -= overlay_frac*(redmin+redrange*(1.-img[3*i]/255.));
+             red[j][i] -= overlay_frac*(redmin+redrange*(1.-(img[6*i]*256+img[6*i+1])/65535.));
+             grn[j][i] -= overlay_frac*(grnmin+grnrange*(1.-(img[6*i+2]*256+img[6*i+3])/65535.));
+             blu[j][i] -= overlay_frac*(blumin+blurange*(1.-(img[6*i+4]*256+img[6*i+5])/65535.));
            }
-         }
-       } else {
-         for (j=ny-1; j>=0; j--) {
+         } else {
            for (i=0; i<nx; i++) {
-             red[i][j] = redmin+redrange*(img[ny-1-j][6*i]*256+img[ny-1-j][6*i+1])/65535.;
-             grn[i][j] = grnmin+grnrange*(img[ny-1-j][6*i+2]*256+img[ny-1-j][6*i+3])/65535.;
-             blu[i][j] = blumin+blurange*(img[ny-1-j][6*i+4]*256+img[ny-1-j][6*i+5])/65535.;
+             red[j][i] = redmin+redrange*(img[6*i]*256+img[6*i+1])/65535.;
+             grn[j][i] = grnmin+grnrange*(img[6*i+2]*256+img[6*i+3])/65535.;
+             blu[j][i] = blumin+blurange*(img[6*i+4]*256+img[6*i+5])/65535.;
            }
          }
-       }
 
-     // no scaling, 8-bit per channel, RGB
-     } else {
-       if (overlay && !darkenonly) {
-         for (j=ny-1; j>=0; j--) {
+       // no scaling, 8-bit per channel, RGB
+       } else {
+         if (overlay && !darkenonly) {
            for (i=0; i<nx; i++) {
-             red[i][j] = (red[i][j] + overlay_frac*(redmin+redrange*img[ny-1-j][3*i]/255.)) / overlay_divisor;
-             grn[i][j] = (grn[i][j] + overlay_frac*(grnmin+grnrange*img[ny-1-j][3*i+1]/255.)) / overlay_divisor;
-             blu[i][j] = (blu[i][j] + overlay_frac*(blumin+blurange*img[ny-1-j][3*i+2]/255.)) / overlay_divisor;
+             red[j][i] = (red[j][i] + overlay_frac*(redmin+redrange*img[3*i]/255.)) / overlay_divisor;
+             grn[j][i] = (grn[j][i] + overlay_frac*(grnmin+grnrange*img[3*i+1]/255.)) / overlay_divisor;
+             blu[j][i] = (blu[j][i] + overlay_frac*(blumin+blurange*img[3*i+2]/255.)) / overlay_divisor;
            }
-         }
-       } else if (overlay && darkenonly) {
-         for (j=ny-1; j>=0; j--) {
+         } else if (overlay && darkenonly) {
            for (i=0; i<nx; i++) {
-             red[i][j] -= overlay_frac*(redmin+redrange*(1.-img[ny-1-j][3*i]/255.));
-             grn[i][j] -= overlay_frac*(grnmin+grnrange*(1.-img[ny-1-j][3*i+1]/255.));
-             blu[i][j] -= overlay_frac*(blumin+blurange*(1.-img[ny-1-j][3*i+2]/255.));
+             red[j][i] -= overlay_frac*(redmin+redrange*(1.-img[3*i]/255.));
+             grn[j][i] -= overlay_frac*(grnmin+grnrange*(1.-img[3*i+1]/255.));
+             blu[j][i] -= overlay_frac*(blumin+blurange*(1.-img[3*i+2]/255.));
            }
-         }
-       } else {
-         for (j=ny-1; j>=0; j--) {
+         } else {
            for (i=0; i<nx; i++) {
-             red[i][j] = redmin+redrange*img[ny-1-j][3*i]/255.;
-             grn[i][j] = grnmin+grnrange*img[ny-1-j][3*i+1]/255.;
-             blu[i][j] = blumin+blurange*img[ny-1-j][3*i+2]/255.;
+             red[j][i] = redmin+redrange*img[3*i]/255.;
+             grn[j][i] = grnmin+grnrange*img[3*i+1]/255.;
+             blu[j][i] = blumin+blurange*img[3*i+2]/255.;
            }
          }
        }
-     }
 
-   // monochrome image, read data from red array
-   } else {
+     // monochrome image, read data from red array
+     } else {
 
-     // no scaling, 16-bit per channel
-     if (high_depth) {
-       if (overlay) {
-         for (j=ny-1; j>=0; j--) {
+       // no scaling, 16-bit per channel
+       if (high_depth) {
+         if (overlay) {
            for (i=0; i<nx; i++) {
-             red[i][j] = (red[i][j] + overlay_frac*(redmin+redrange*(img[ny-1-j][2*i]*256+img[ny-1-j][2*i+1])/65534.)) / overlay_divisor;
+             red[j][i] = (red[j][i] + overlay_frac*(redmin+redrange*(img[2*i]*256+img[2*i+1])/65534.)) / overlay_divisor;
            }
-         }
-       } else {
-         for (j=ny-1; j>=0; j--) {
+         } else {
            for (i=0; i<nx; i++) {
-             red[i][j] = redmin+redrange*(img[ny-1-j][2*i]*256+img[ny-1-j][2*i+1])/65534.;
+             red[j][i] = redmin+redrange*(img[2*i]*256+img[2*i+1])/65534.;
            }
          }
-       }
 
-     // no scaling, 8-bit per channel
-     } else {
-       if (overlay) {
-         for (j=ny-1; j>=0; j--) {
+       // no scaling, 8-bit per channel
+       } else {
+         if (overlay) {
            for (i=0; i<nx; i++) {
-             red[i][j] = (red[i][j] + overlay_frac*(redmin+redrange*img[ny-1-j][i]/254.)) / overlay_divisor;
+             red[j][i] = (red[j][i] + overlay_frac*(redmin+redrange*img[i]/254.)) / overlay_divisor;
            }
-         }
-       } else {
-         for (j=ny-1; j>=0; j--) {
+         } else {
            for (i=0; i<nx; i++) {
-             red[i][j] = redmin+redrange*img[ny-1-j][i]/254.;
+             red[j][i] = redmin+redrange*img[i]/254.;
            }
          }
        }
      }
-
    }
 
-   // free the data array
-   free_2d_array_pb(img);
+   /* read rest of file, and get additional chunks in info_ptr - REQUIRED */
+   png_read_end(png_ptr, info_ptr);
+
+   /* At this point you have read the entire image */
+
+   /* clean up after the read, and free any memory allocated - REQUIRED */
+   png_destroy_read_struct(&png_ptr, &info_ptr, png_infopp_NULL);
+
+   /* close the file */
+   fclose(fp);
+
+   // free the row
+   free(img);
 
    return(0);
 }
 
 
 /*
- * This function writes basic usage information to stderr,
- * and then quits. Too bad.
+ * open a grey png for reading one row at a time
+ *
+ * this lets us score directly from the decoded samples without ever
+ * holding the whole image, see read_png_row
  */
-int Usage(char progname[255],int status) {
+int open_png_rows (char *infile, int nx, int ny, float min, float range,
+   png_rows *pr) {
 
-   static char **cpp, *help_message[] = {
-   "where [-options] are zero or more of the following:                        ",
-   "                                                                           ",
-   "   [-tf jan-low jan-high jul-low jul-high]    temperatures in deg F        ",
-   "                                                                           ",
-   "   [-tc jan-low jan-high jul-low jul-high]    temperatures in deg C        ",
-   "                                                                           ",
-   "   [-wtf jan-low jan-high]    winter temperatures in deg F                 ",
-   "                                                                           ",
-   "   [-wtc jan-low jan-high]    winter temperatures in deg C                 ",
-   "                                                                           ",
-   "   [-stf jul-low jul-high]    summer temperatures in deg F                 ",
-   "                                                                           ",
-   "   [-stc jul-low jul-high]    summer temperatures in deg C                 ",
-   "                                                                           ",
-   "   [-m month]  limit to a specific month (1-12)                            ",
-   "                                                                           ",
-   "   [-mtf low high]    temperatures in deg F for given month                ",
-   "                                                                           ",
-   "   [-mtc low high]    temperatures in deg C for given month                ",
-   "                                                                           ",
-   "   [-mr num]   average monthly precipitation, in mm/month                  ",
-   "                                                                           ",
-   "   [-ac num]   average cloudiness, in fraction (0..1, 1=always cloudy)     ",
-   "                                                                           ",
-   "   [-hdi num]  Human Development Index, local (0..1)                       ",
-   "                                                                           ",
-   "   [-mtn num]  proximity to and magnitude of mountains (0==1)              ",
-   "                                                                           ",
-   "   [-wmph num]   average wind speed in miles-per-hour                      ",
-   "                                                                           ",
-   "   [-wmps num]   average wind speed in meters-per-second                   ",
-   "                                                                           ",
-   "   [-ct lat lon]   prefer locations close to given lat-lon location (N, E) ",
-   "                                                                           ",
-   "   [-ff lat lon]   prefer locations far from given lat-lon location (N, E) ",
-   "                                                                           ",
-   "   [-boston]   set all preferences to that of Boston, Massachusetts, USA   ",
-   "                                                                           ",
-   "   [-new]      begin defining preferences for a second person (up to 8)    ",
-   "                                                                           ",
-   "   [-nobdry]   do not draw national boundaries on output image             ",
-   "                                                                           ",
-   "   [-o file]   output file name                                            ",
-   "                                                                           ",
-   "   [-help]     returns this help information                               ",
-   " ",
-   "Options may be abbreviated to an unambiguous length.",
-   "Output is to a series of PNM files.",
-   NULL
-   };
+   unsigned char header[8];
+   png_uint_32 height,width;
+   int bit_depth,color_type,interlace_type;
+
+   // check the file
+   pr->fp = fopen(infile,"rb");
+   if (pr->fp==NULL) {
+      fprintf(stderr,"Could not open input file %s\n",infile);
+      fflush(stderr);
+      fail(0);
+   }
+
+   // check to see that it's a PNG
+   fread (&header, 1, 8, pr->fp);
+   if (png_sig_cmp(header, 0, 8)) {
+      fprintf(stderr,"File %s is not a PNG\n",infile);
+      fflush(stderr);
+      fclose(pr->fp);
+      fail(0);
+   }
+
+   pr->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+      NULL, NULL, NULL);
+   pr->info_ptr = png_create_info_struct(pr->png_ptr);
+   if (pr->info_ptr == NULL) {
+      fclose(pr->fp);
+      png_destroy_read_struct(&pr->png_ptr, png_infopp_NULL, png_infopp_NULL);
+      fail(0);
+   }
+
+   if (setjmp(png_jmpbuf(pr->png_ptr))) {
+      png_destroy_read_struct(&pr->png_ptr, &pr->info_ptr, png_infopp_NULL);
+      fclose(pr->fp);
+      fail(0);
+   }
+
+   png_init_io(pr->png_ptr, pr->fp);
+   png_set_sig_bytes(pr->png_ptr, 8);
+   png_read_info(pr->png_ptr, pr->info_ptr);
+   png_get_IHDR(pr->png_ptr, pr->info_ptr, &width, &height, &bit_depth,
+       &color_type, &interlace_type, int_p_NULL, int_p_NULL);
+
+   // only grey, non-interlaced images can be streamed
+   if ((bit_depth != 8 && bit_depth != 16) || color_type != PNG_COLOR_TYPE_GRAY) {
+     fprintf(stderr,"INCOMPLETE: open_png_rows expects 8- or 16-bit grayscale images\n");
+     fprintf(stderr,"   file: %s\n",infile);
+     png_read_fail(&pr->png_ptr, &pr->info_ptr, pr->fp);
+   }
+   if (interlace_type != PNG_INTERLACE_NONE) {
+     fprintf(stderr,"INCOMPLETE: open_png_rows cannot stream interlaced images\n");
+     fprintf(stderr,"   file: %s\n",infile);
+     png_read_fail(&pr->png_ptr, &pr->info_ptr, pr->fp);
+   }
+   if (ny != height || nx != width) {
+     fprintf(stderr,"INCOMPLETE: open_png_rows expects image resolution to match\n");
+     fprintf(stderr,"  the simulation resolution.");
+     fprintf(stderr,"  simulation %d x %d",nx,ny);
+     fprintf(stderr,"  image %d x %d",width,height);
+     fprintf(stderr,"  file (%s)",infile);
+     png_read_fail(&pr->png_ptr, &pr->info_ptr, pr->fp);
+   }
+
+   pr->nx = nx;
+   pr->ny = ny;
+   pr->high_depth = (bit_depth == 16);
+   pr->nextrow = ny-1;
+   // samples scale as min + range*sample/65534 (or /254), as in read_png
+   pr->min = min;
+   pr->range = range;
+   pr->buf = (png_byte *)malloc((bit_depth/8) * nx * sizeof(png_byte));
 
-   fprintf(stderr, "usage:\n  %s [options]\n\n", progname);
-   for (cpp = help_message; *cpp; cpp++) fprintf(stderr, "%s\n", *cpp);
-   fflush(stderr);
-   exit(status);
    return(0);
 }
 
+/*
+ * decode the next row (from the top/north) of an open png into vals,
+ * and return that row's index in our south-up storage
+ */
+int read_png_row (png_rows *pr, float *vals) {
 
-float ftoc (const float tempf) {
-  return (tempf-32.f)/1.8f;
+   if (pr->nextrow < 0) {
+      fprintf(stderr,"ERROR: read past the end of a png\n");
+      fail(0);
+   }
+
+   // libpng longjmps here on errors, so this must live in this frame
+   if (setjmp(png_jmpbuf(pr->png_ptr))) {
+      fprintf(stderr,"ERROR: could not decode png row %d\n",pr->ny-1-pr->nextrow);
+      fail(0);
+   }
+
+   png_read_row(pr->png_ptr, pr->buf, NULL);
+
+   const png_byte *img = pr->buf;
+   if (pr->high_depth) {
+      for (int i=0; i<pr->nx; i++) {
+         vals[i] = pr->min + pr->range*(img[2*i]*256+img[2*i+1])/65534.;
+      }
+   } else {
+      for (int i=0; i<pr->nx; i++) {
+         vals[i] = pr->min + pr->range*img[i]/254.;
+      }
+   }
+
+   return(pr->nextrow--);
 }
 
-// return great circle route distance in radians (0..pi) given lat-lon
-float gcr_dist (const float lat1, const float lon1, const float lat2, const float lon2) {
+int close_png_rows (png_rows *pr) {
+   // we may not have read every row, so skip png_read_end
+   png_destroy_read_struct(&pr->png_ptr, &pr->info_ptr, png_infopp_NULL);
+   fclose(pr->fp);
+   free(pr->buf);
+   return(0);
+}
+
+/*
+ * return the value of a single pixel, decoding only as far as its row
+ */
+float sample_png (char *infile, int nx, int ny, float min, float range,
+   int col, int row) {
+
+   png_rows pr;
+   float *vals = (float *)malloc(nx * sizeof(float));
+   (void)open_png_rows(infile, nx, ny, min, range, &pr);
+   while (read_png_row(&pr, vals) > row) ;
+   const float val = vals[col];
+   (void)close_png_rows(&pr);
+   free(vals);
+   return val;
+}
+
+
+/*
+ * return the values at many pixels, in one pass that decodes only
+ * as far as the southernmost of them
+ */
+int sample_png_many (char *infile, int nx, int ny, float min, float range,
+   int n, const int *cols, const int *rows, float *out) {
+
+   if (n < 1) return(0);
+   int lowest = ny-1;
+   for (int i=0; i<n; ++i) if (rows[i] < lowest) lowest = rows[i];
+
+   png_rows pr;
+   float *vals = (float *)malloc(nx * sizeof(float));
+   (void)open_png_rows(infile, nx, ny, min, range, &pr);
+   int row;
+   do {
+      row = read_png_row(&pr, vals);
+      for (int i=0; i<n; ++i) if (rows[i] == row) out[i] = vals[cols[i]];
+   } while (row > lowest);
+   (void)close_png_rows(&pr);
+   free(vals);
+   return(0);
+}
+
+
+/*
+ * open a 16-bit grey png for writing one row at a time
+ */
+int open_png_out (char *outfile, int nx, int ny, png_out *po) {
+
+   // must do 5/9 for stuff to look right on Macs, see write_png
+   float gamma = .55555;
+
+   po->fp = fopen(outfile,"wb");
+   if (po->fp==NULL) {
+      fprintf(stderr,"Could not open output file %s\n",outfile);
+      fflush(stderr);
+      fail(0);
+   }
+
+   po->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+      NULL, NULL, NULL);
+   if (po->png_ptr == NULL) {
+      fclose(po->fp);
+      fprintf(stderr,"Could not create png struct\n");
+      fflush(stderr);
+      fail(0);
+   }
+   po->info_ptr = png_create_info_struct(po->png_ptr);
+   if (po->info_ptr == NULL) {
+      fclose(po->fp);
+      png_destroy_write_struct(&po->png_ptr,(png_infopp)NULL);
+      fail(0);
+   }
+   if (setjmp(png_jmpbuf(po->png_ptr))) {
+      fclose(po->fp);
+      png_destroy_write_struct(&po->png_ptr, &po->info_ptr);
+      fail(0);
+   }
+
+   png_init_io(po->png_ptr, po->fp);
+   png_set_IHDR(po->png_ptr, po->info_ptr, nx, ny, 16,
+      PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+      PNG_FILTER_TYPE_BASE);
+   png_set_gAMA(po->png_ptr, po->info_ptr, gamma);
+   png_write_info(po->png_ptr, po->info_ptr);
+
+   po->nx = nx;
+   po->buf = (png_byte *)malloc(2 * nx * sizeof(png_byte));
+   return(0);
+}
+
+/*
+ * scale one row of values (top row first) and write it, same as write_png
+ */
+int write_png_row (png_out *po, const float *vals, float min, float range) {
+
+   if (setjmp(png_jmpbuf(po->png_ptr))) {
+      fprintf(stderr,"ERROR: could not encode png row\n");
+      exit(0);
+   }
+
+   png_byte *img = po->buf;
+   for (int i=0; i<po->nx; i++) {
+      int printval = (int)(0.5 + 65534*(vals[i]-min)/range);
+      if (printval<0) printval = 0;
+      else if (printval>65535) printval = 65535;
+      img[2*i] = (png_byte)(printval/256);
+      img[2*i+1] = (png_byte)(printval%256);
+   }
+   png_write_row(po->png_ptr, img);
+   return(0);
+}
+
+int close_png_out (png_out *po) {
+   if (setjmp(png_jmpbuf(po->png_ptr))) {
+      fprintf(stderr,"ERROR: could not finish png\n");
+      exit(0);
+   }
+   png_write_end(po->png_ptr, po->info_ptr);
+   png_destroy_write_struct(&po->png_ptr, &po->info_ptr);
+   fclose(po->fp);
+   free(po->buf);
+   return(0);
+}
+
+
+/*
+ * background decoding: one thread per png fills a small ring of rows
+ * that the scoring loop drains in order
+ */
+static void* row_queue_worker (void *arg) {
+   row_queue *q = (row_queue *)arg;
+   for (int n=0; n<q->pr.ny; ++n) {
+      // wait for a free slot
+      pthread_mutex_lock(&q->lock);
+      while (q->produced - q->consumed >= q->nslots) pthread_cond_wait(&q->cond, &q->lock);
+      pthread_mutex_unlock(&q->lock);
+
+      // decode outside of the lock, only this thread touches this slot now
+      (void)read_png_row(&q->pr, q->slot[q->produced % q->nslots]);
+
+      pthread_mutex_lock(&q->lock);
+      q->produced++;
+      pthread_cond_broadcast(&q->cond);
+      pthread_mutex_unlock(&q->lock);
+   }
+   return NULL;
+}
+
+int start_row_queue (char *infile, int nx, int ny, float min, float range,
+   int nslots, row_queue *q) {
+   (void)open_png_rows(infile, nx, ny, min, range, &q->pr);
+   q->nslots = nslots;
+   q->slot = allocate_2d_array_f(nslots, nx);
+   q->produced = 0;
+   q->consumed = 0;
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->cond, NULL);
+   if (pthread_create(&q->thread, NULL, row_queue_worker, q)) {
+      fprintf(stderr,"ERROR: could not start decoding thread for %s\n",infile);
+      exit(1);
+   }
+   return(0);
+}
+
+// wait for and return the next row, in the same top-down order as read_png_row
+float* next_queued_row (row_queue *q) {
+   pthread_mutex_lock(&q->lock);
+   while (q->produced <= q->consumed) pthread_cond_wait(&q->cond, &q->lock);
+   pthread_mutex_unlock(&q->lock);
+   return q->slot[q->consumed % q->nslots];
+}
+
+// hand the row from next_queued_row back to the decoder
+void release_queued_row (row_queue *q) {
+   pthread_mutex_lock(&q->lock);
+   q->consumed++;
+   pthread_cond_broadcast(&q->cond);
+   pthread_mutex_unlock(&q->lock);
+}
+
+int finish_row_queue (row_queue *q) {
+   pthread_join(q->thread, NULL);
+   (void)close_png_rows(&q->pr);
+   free_2d_array_f(q->slot);
+   pthread_mutex_destroy(&q->lock);
+   pthread_cond_destroy(&q->cond);
+   return(0);
+}
+
+
+/*
+ * layers at their own resolution
+ *
+ * every layer is a global lat-lon grid, so its size is all of its
+ * georeferencing; one that doesn't match the scoring grid (that of the
+ * temperature layer) stays at its native size, and each scoring row
+ * samples it through per-row and per-column index tables
+ */
+typedef struct resampler {
+   int nx, ny;		// native size of the layer
+   int linear;		// bilinear, or else nearest
+   int *c0, *c1;	// native columns of each scoring column
+   float *cw;		// and the weight of c1
+   int *r0, *r1;	// native rows of each scoring row
+   float *rw;		// and the weight of r1
+   // when streaming, native rows r0 and r1 of the current scoring row
+   float *nrow[2];
+   int next;		// the next native row to decode, north first
+} resampler;
+
+// sample layers bilinearly, instead of at the nearest native pixel
+int linear_sampling = FALSE;
+
+resampler* make_resampler (const int nx, const int ny, const int xres, const int yres,
+                           const int linear) {
+   resampler *rs = (resampler *)calloc(1, sizeof(resampler));
+   rs->nx = nx;
+   rs->ny = ny;
+   rs->linear = linear;
+   rs->c0 = (int *)malloc(xres*sizeof(int));
+   rs->c1 = (int *)malloc(xres*sizeof(int));
+   rs->cw = (float *)malloc(xres*sizeof(float));
+   rs->r0 = (int *)malloc(yres*sizeof(int));
+   rs->r1 = (int *)malloc(yres*sizeof(int));
+   rs->rw = (float *)malloc(yres*sizeof(float));
+
+   // pixel centers line up, so scoring column i is at native (i+0.5)*nx/xres - 0.5
+   for (int i=0; i<xres; ++i) {
+      const double x = (i+0.5)*nx/(double)xres - 0.5;
+      if (linear) {
+         const int x0 = (int)floor(x);
+         // longitude wraps around
+         rs->c0[i] = (x0+nx) % nx;
+         rs->c1[i] = (x0+1) % nx;
+         rs->cw[i] = (float)(x-x0);
+      } else {
+         rs->c0[i] = rs->c1[i] = (int)floor(x+0.5);
+         rs->cw[i] = 0.f;
+      }
+   }
+   for (int j=0; j<yres; ++j) {
+      const double y = (j+0.5)*ny/(double)yres - 0.5;
+      int y0 = linear ? (int)floor(y) : (int)floor(y+0.5);
+      float w = linear ? (float)(y-y0) : 0.f;
+      // but latitude doesn't, so hold the polar rows
+      if (y0 < 0) { y0 = 0; w = 0.f; }
+      if (y0 >= ny-1) { y0 = ny-1; w = 0.f; }
+      rs->r0[j] = y0;
+      rs->r1[j] = (w > 0.f) ? y0+1 : y0;
+      rs->rw[j] = w;
+   }
+
+   rs->nrow[0] = (float *)malloc(nx*sizeof(float));
+   rs->nrow[1] = (float *)malloc(nx*sizeof(float));
+   rs->next = ny-1;
+   return rs;
+}
+
+void free_resampler (resampler *rs) {
+   free(rs->c0);
+   free(rs->c1);
+   free(rs->cw);
+   free(rs->r0);
+   free(rs->r1);
+   free(rs->rw);
+   free(rs->nrow[0]);
+   free(rs->nrow[1]);
+   free(rs);
+}
+
+// a resampler for a layer's png, or NULL if it's already on the scoring grid
+resampler* layer_resampler (char *infile, const int xres, const int yres) {
+   int nx, ny;
+   (void)read_png_res(infile, &ny, &nx);
+   if (nx == xres && ny == yres) return NULL;
+   printf("  sampling %s from %d x %d %s\n", infile, nx, ny,
+          linear_sampling ? "bilinearly" : "at the nearest pixel");
+   return make_resampler(nx, ny, xres, yres, linear_sampling);
+}
+
+/*
+ * fill the listed columns of a scoring row from native rows r0 (s0)
+ * and r1 (s1) of that row
+ */
+void resample_row (const resampler *rs, const int row, const float *s0, const float *s1,
+                   const int *cand, const int ncand, float *out) {
+   const int *c0 = rs->c0;
+   if (!rs->linear) {
+      for (int i=0; i<ncand; ++i) out[cand[i]] = s0[c0[cand[i]]];
+      return;
+   }
+   const int *c1 = rs->c1;
+   const float *cw = rs->cw;
+   const float rw = rs->rw[row];
+   for (int i=0; i<ncand; ++i) {
+      const int col = cand[i];
+      const float a = s0[c0[col]] + cw[col]*(s0[c1[col]]-s0[c0[col]]);
+      const float b = s1[c0[col]] + cw[col]*(s1[c1[col]]-s1[c0[col]]);
+      out[col] = a + rw*(b-a);
+   }
+}
+
+/*
+ * the same, decoding native rows from a png (or a queue, if q is set)
+ * as the scoring rows go north to south
+ */
+void resample_stream_row (resampler *rs, const int row, png_rows *pr, row_queue *q,
+                          const int *cand, const int ncand, float *out) {
+   while (rs->next >= rs->r0[row]) {
+      // the newest row is always the southern one
+      float *t = rs->nrow[1];
+      rs->nrow[1] = rs->nrow[0];
+      rs->nrow[0] = t;
+      if (q) {
+         memcpy(rs->nrow[0], next_queued_row(q), rs->nx*sizeof(float));
+         release_queued_row(q);
+      } else {
+         (void)read_png_row(pr, rs->nrow[0]);
+      }
+      rs->next--;
+   }
+   const float *s1 = (rs->r1[row] > rs->r0[row]) ? rs->nrow[1] : rs->nrow[0];
+   resample_row(rs, row, rs->nrow[0], s1, cand, ncand, out);
+}
+
+// a whole native grid, on the scoring grid
+float** resample_grid (const resampler *rs, float **grid, const int xres, const int yres) {
+   float** out = allocate_2d_array_f(yres,xres);
+   int* all = (int*)malloc(xres*sizeof(int));
+   for (int col=0; col<xres; ++col) all[col] = col;
+   for (int row=0; row<yres; ++row) {
+      resample_row(rs, row, grid[rs->r0[row]], grid[rs->r1[row]], all, xres, out[row]);
+   }
+   free(all);
+   return out;
+}
+
+// read a whole layer onto the scoring grid, whatever its own size
+float** read_layer_grid (char *infile, const int xres, const int yres,
+                         const float min, const float range) {
+   resampler *rs = layer_resampler(infile, xres, yres);
+   const int nx = rs ? rs->nx : xres;
+   const int ny = rs ? rs->ny : yres;
+   float** grid = allocate_2d_array_f(ny,nx);
+   (void)read_png(infile,nx,ny,FALSE,FALSE,1.0,FALSE,grid,min,range,NULL,0.0,1.0,NULL,0.0,1.0);
+   if (rs == NULL) return grid;
+
+   float** out = resample_grid(rs, grid, xres, yres);
+   free_2d_array_f(grid);
+   free_resampler(rs);
+   return out;
+}
+
+
+/*
+ * a reduced grid: like a reduced Gaussian grid, each row keeps only
+ * about xres*cos(latitude) pixels, so they all cover about the same
+ * area and a third fewer are stored and scored
+ *
+ * reduced pixel k of a row spans full columns s(k) to s(k+1)-1, where
+ * s(k) = k*xres/w, and it holds the value of the middle one; scoring
+ * lists only those middle columns, then copies each one's cost across
+ * its span, so the output is exactly the full-grid cost of the middle
+ * column everywhere
+ */
+typedef struct reduced_grid {
+   int xres, yres;
+   int *w;		// pixels in each row
+   long npix;		// in the whole grid
+   // the spans and middle columns of one row, see reduced_row
+   int row;
+   int *start, *mid;
+} reduced_grid;
+
+reduced_grid* make_reduced_grid (const int xres, const int yres) {
+   reduced_grid *rg = (reduced_grid *)malloc(sizeof(reduced_grid));
+   rg->xres = xres;
+   rg->yres = yres;
+   rg->w = (int *)malloc(yres*sizeof(int));
+   rg->npix = 0;
+   const double degtorad = asin(1.0) / 90.0;
+   for (int row=0; row<yres; ++row) {
+      const double lat = -90.0 + 180.0 * (0.5+row) / yres;
+      int w = (int)ceil(xres*cos(degtorad*lat));
+      if (w < 1) w = 1;
+      if (w > xres) w = xres;
+      rg->w[row] = w;
+      rg->npix += w;
+   }
+   rg->row = -1;
+   rg->start = (int *)malloc((xres+1)*sizeof(int));
+   rg->mid = (int *)malloc(xres*sizeof(int));
+   return rg;
+}
+
+static inline int reduced_start (const reduced_grid *rg, const int row, const int k) {
+   return (int)((long)k*rg->xres/rg->w[row]);
+}
+
+// the full column that a reduced pixel takes its value from
+static inline int reduced_middle (const reduced_grid *rg, const int row, const int k) {
+   return (reduced_start(rg,row,k) + reduced_start(rg,row,k+1)) / 2;
+}
+
+// and the reduced pixel that a full column falls in
+static inline int reduced_col (const reduced_grid *rg, const int row, const int col) {
+   const long w = rg->w[row];
+   return (int)(((col+1)*w + rg->xres-1) / rg->xres) - 1;
+}
+
+/*
+ * set the spans and middle columns of a row, without dividing per
+ * pixel, as every row's loops go over them
+ */
+void reduced_row (reduced_grid *rg, const int row) {
+   if (row == rg->row) return;
+   const int w = rg->w[row];
+   const int step = rg->xres / w;
+   const int rem = rg->xres % w;
+   int start = 0;
+   int acc = 0;
+   for (int k=0; k<w; ++k) {
+      int end = start + step;
+      acc += rem;
+      if (acc >= w) { acc -= w; ++end; }
+      rg->start[k] = start;
+      rg->mid[k] = (start+end) / 2;
+      start = end;
+   }
+   rg->start[w] = rg->xres;
+   rg->row = row;
+}
+
+// rows of varying width, packed, and freed with free_2d_array_f
+float** allocate_reduced_f (const reduced_grid *rg) {
+   float **array = (float **)malloc(rg->yres * sizeof(float *));
+   array[0] = (float *)malloc(rg->npix * sizeof(float));
+   for (int row=1; row<rg->yres; ++row) array[row] = array[row-1] + rg->w[row-1];
+   return(array);
+}
+
+// read a png of the full grid straight into reduced storage
+int read_png_reduced (char *infile, reduced_grid *rg, float min, float range,
+   float **grid) {
+   png_rows pr;
+   float *vals = (float *)malloc(rg->xres * sizeof(float));
+   (void)open_png_rows(infile, rg->xres, rg->yres, min, range, &pr);
+   for (int n=0; n<rg->yres; ++n) {
+      const int row = read_png_row(&pr, vals);
+      reduced_row(rg, row);
+      for (int k=0; k<rg->w[row]; ++k) grid[row][k] = vals[rg->mid[k]];
+   }
+   (void)close_png_rows(&pr);
+   free(vals);
+   return(0);
+}
+
+// put a reduced row's values in the middle columns of a full row
+void reduced_scatter (reduced_grid *rg, const int row, const float *src, float *full) {
+   reduced_row(rg, row);
+   const int *mid = rg->mid;
+   for (int k=0; k<rg->w[row]; ++k) full[mid[k]] = src[k];
+}
+
+// like land_row, but only list the middle columns
+int reduced_land_row (reduced_grid *rg, const int row, const float *tempw,
+                      float *out, int *cand) {
+   reduced_row(rg, row);
+   int ncand = 0;
+   for (int k=0; k<rg->w[row]; ++k) {
+      const int col = rg->mid[k];
+      if (tempw[col] > -29.9f) {
+         out[col] = 0.f;
+         cand[ncand++] = col;
+      } else {
+         out[col] = -1.f;
+      }
+   }
+   return ncand;
+}
+
+// copy each middle column's cost across its span
+void reduced_fill_row (reduced_grid *rg, const int row, float *out) {
+   reduced_row(rg, row);
+   for (int k=0; k<rg->w[row]; ++k) {
+      const float v = out[rg->mid[k]];
+      for (int col=rg->start[k]; col<rg->start[k+1]; ++col) out[col] = v;
+   }
+}
+
+
+/*
+ * This function writes basic usage information to stderr,
+ * and then quits. Too bad.
+ */
+int Usage(char progname[255],int status) {
+
+   static char **cpp, *help_message[] = {
+   "where [-options] are zero or more of the following:                        ",
+   "                                                                           ",
+   "   [-tf jan-low jan-high jul-low jul-high]    temperatures in deg F        ",
+   "                                                                           ",
+   "   [-tc jan-low jan-high jul-low jul-high]    temperatures in deg C        ",
+   "                                                                           ",
+   "   [-wtf jan-low jan-high]    winter temperatures in deg F                 ",
+   "                                                                           ",
+   "   [-wtc jan-low jan-high]    winter temperatures in deg C                 ",
+   "                                                                           ",
+   "   [-stf jul-low jul-high]    summer temperatures in deg F                 ",
+   "                                                                           ",
+   "   [-stc jul-low jul-high]    summer temperatures in deg C                 ",
+   "                                                                           ",
+   "   [-m month]  limit to a specific month (1-12)                            ",
+   "                                                                           ",
+   "   [-allmonths]  score every month, and write file_m1.png to               ",
+   "               file_m12.png, all on one scale                              ",
+   "                                                                           ",
+   "   [-scenario name,...]  [-period name,...]  read the temperature and      ",
+   "               rain from the name/ (or name/period/) directory, and with   ",
+   "               more than one of either, compare every scenario and         ",
+   "               period: write file_name.png for each on one scale, the      ",
+   "               worst of them in file_robust.png, and the change from the   ",
+   "               first to the last in file_delta.png                         ",
+   "                                                                           ",
+   "   [-stackstore dir]  keep every month of each scenario and period in      ",
+   "               dir as one file that later runs map instead of reading      ",
+   "               the pngs                                                    ",
+   "                                                                           ",
+   "   [-mtf low high]    temperatures in deg F for given month                ",
+   "                                                                           ",
+   "   [-mtc low high]    temperatures in deg C for given month                ",
+   "                                                                           ",
+   "   [-mr num]   average monthly precipitation, in mm/month                  ",
+   "                                                                           ",
+   "   [-ac num]   average cloudiness, in fraction (0..1, 1=always cloudy)     ",
+   "                                                                           ",
+   "   [-hdi num]  Human Development Index, local (0..1)                       ",
+   "                                                                           ",
+   "   [-mtn num]  proximity to and magnitude of mountains (0==1)              ",
+   "                                                                           ",
+   "   [-wmph num]   average wind speed in miles-per-hour                      ",
+   "                                                                           ",
+   "   [-wmps num]   average wind speed in meters-per-second                   ",
+   "                                                                           ",
+   "   [-ct lat lon]   prefer locations close to given lat-lon location (N, E) ",
+   "                                                                           ",
+   "   [-ff lat lon]   prefer locations far from given lat-lon location (N, E) ",
+   "                                                                           ",
+   "               any lat lon can instead be a place name, like Boston or     ",
+   "               Portland,US (the most populous match is used)               ",
+   "                                                                           ",
+   "   [-route file]   prefer locations close to a route, the great-circle arcs",
+   "               between the lat lon lines in file (a blank line starts      ",
+   "               another piece of the route)                                 ",
+   "                                                                           ",
+   "   [-manifest file]  read more layers, one per line as name file min       ",
+   "               range [units [linear|log|over|under [penalty]]], where a    ",
+   "               file with %m is per month, and a built-in name replaces     ",
+   "               that layer                                                  ",
+   "                                                                           ",
+   "   [-layer name num]  prefer places where a layer from the manifest, or    ",
+   "               any 0..1 png, is near num, up to 8 extra layers             ",
+   "                                                                           ",
+   "   [-min layer num]  never consider places where layer is below num        ",
+   "   [-max layer num]  never consider places where layer is above num,       ",
+   "               layer is jan (or temp with -m), jul, rain, cloud, wind,     ",
+   "               hdi, or mtn, in the same units as above                     ",
+   "                                                                           ",
+   "   [-like file]  prefer places like any of the locations in a file of      ",
+   "                 lat lon lines, and list the best matches                  ",
+   "                                                                           ",
+   "   [-topk num]   number of best -like matches to list (default 10)         ",
+   "                                                                           ",
+   "   [-boston]   set all preferences to that of Boston, Massachusetts, USA   ",
+   "                                                                           ",
+   "   [-new]      begin defining preferences for another person,              ",
+   "               each with their own +/- weights                             ",
+   "                                                                           ",
+   "   [-weight num]  weight of the current person, for -agg weighted/norm     ",
+   "                                                                           ",
+   "   [-agg mode]  combine persons by sum (default), max (nobody is           ",
+   "               miserable), weighted (mean), or norm (weighted mean of      ",
+   "               each cost as a fraction of that person's worst case)        ",
+   "                                                                           ",
+   "   [-smooth km]  also rank places by the average cost of the land within   ",
+   "               km, and draw that                                           ",
+   "                                                                           ",
+   "   [-gsmooth km]  like -smooth, but a near-Gaussian with std dev of km     ",
+   "                                                                           ",
+   "   [-robust num pct]  re-weigh every criterion between half and double,    ",
+   "               num random ways, and draw how often each place is in the    ",
+   "               best pct percent                                            ",
+   "                                                                           ",
+   "   [-spreadmap file]  with -robust, also draw the std dev of each place's  ",
+   "               percentile rank to file                                     ",
+   "                                                                           ",
+   "   [-pareto file]  draw the places that no other place beats in one        ",
+   "               criterion while matching it in the rest, and list them      ",
+   "               with their costs to file                                    ",
+   "                                                                           ",
+   "   [-resample nearest|linear]  how to sample layers that are not the size  ",
+   "               of the temperature layer (default nearest)                  ",
+   "                                                                           ",
+   "   [-reduced]  store and score only ~cos(latitude) of each row, so every   ",
+   "               pixel has about the same area and a third fewer are used    ",
+   "                                                                           ",
+   "   [-nobdry]   do not draw national boundaries on output image             ",
+   "                                                                           ",
+   "   [-stream]   decode inputs row by row and score them as they arrive,     ",
+   "               using much less memory                                      ",
+   "                                                                           ",
+   "   [-pipeline] like -stream, but decode each input on its own thread and   ",
+   "               encode the output while the boundaries are still decoding   ",
+   "                                                                           ",
+   "   [-preview dir]  first score the query on 1 and 0.25 degree grids        ",
+   "               from small stores of every layer kept in dir (made on the   ",
+   "               first run), and write file_1deg.png and file_0.25deg.png    ",
+   "               with each one's best place before the full run              ",
+   "                                                                           ",
+   "   [-tiles port]  instead of writing the image, serve it as 256x256        ",
+   "               web mercator tiles at http://localhost:port/z/x/y.png       ",
+   "                                                                           ",
+   "   [-mkfilter max|mean km in.png out.png]  write the max or mean of a      ",
+   "               layer within km of every pixel, then stop                   ",
+   "                                                                           ",
+   "   [-mkplaces dump.txt file]  index the populated places in a GeoNames     ",
+   "               dump into file, then stop                                   ",
+   "                                                                           ",
+   "   [-places file]  place index for names (default places.idx), give it     ",
+   "               before any place names                                      ",
+   "                                                                           ",
+   "   [-mkwater mask out.png]  write the great-circle distance from every     ",
+   "               pixel to water (where mask > 0.5, or the word ocean) as a   ",
+   "               16-bit image of 0 to 5000 km, then stop                     ",
+   "                                                                           ",
+   "   [-mkzones num file]  cluster the land into num climate zones (up to     ",
+   "               a few thousand) and write them to file, then stop           ",
+   "                                                                           ",
+   "   [-zones file]   skip the zones in file that cannot hold a good place    ",
+   "                                                                           ",
+   "   [-zonecut frac]  score every zone that could be in the best frac of     ",
+   "               the cost range (default 0.1, 0 keeps only the best place)   ",
+   "                                                                           ",
+   "   [-zonemap file]  write a color map of the climate zones                 ",
+   "                                                                           ",
+   "   [-threads num]  threads to use (default all cores): for each month or   ",
+   "               stack, -robust, -pareto, -contour, the -mk tools, the       ",
+   "               stores, and the tile server's workers                       ",
+   "                                                                           ",
+   "   [-o file]   output file name; a .npy, .f32, or .raw name writes the     ",
+   "               values as float32 instead, ocean -1, north row first        ",
+   "                                                                           ",
+   "   [-sparse file cut]  also write float32 lat, lon, value for every        ",
+   "               place whose value is above cut (0 to 1)                     ",
+   "                                                                           ",
+   "   [-contour pct file]  also outline the best pct percent of the land      ",
+   "               as geojson polygons in file                                 ",
+   "                                                                           ",
+   "   [-help]     returns this help information                               ",
+   " ",
+   "Options may be abbreviated to an unambiguous length.",
+   "Built with make idealplace-mpi and run under mpirun -np N, each of N",
+   "processes reads and scores only its own band of latitudes.",
+   "Output is to a series of PNM files.",
+   NULL
+   };
+
+   fprintf(stderr, "usage:\n  %s [options]\n\n", progname);
+   for (cpp = help_message; *cpp; cpp++) fprintf(stderr, "%s\n", *cpp);
+   fflush(stderr);
+   exit(status);
+   return(0);
+}
+
+
+float ftoc (const float tempf) {
+  return (tempf-32.f)/1.8f;
+}
+
+// return great circle route distance in radians (0..pi) given lat-lon
+float gcr_dist (const float lat1, const float lon1, const float lat2, const float lon2) {
+
+  // first convert to xyz vectors
+  float v1[3];
+  float v2[3];
+
+  v1[0] = cosf(lon1)*cosf(lat1);
+  v1[1] = sinf(lon1)*cosf(lat1);
+  v1[2] = sinf(lat1);
+  v2[0] = cosf(lon2)*cosf(lat2);
+  v2[1] = sinf(lon2)*cosf(lat2);
+  v2[2] = sinf(lat2);
+
+  const float dp = v1[0]*v2[0] + v1[1]*v2[1] + v1[2]*v2[2];
+  const float theta = asinf(1.f) - asinf(dp);
+
+  return theta;
+}
+
+// return great circle route distance in radians (0..pi) given pixel coords
+float gcr_dist_px (const int x1, const int y1, const int x2, const int y2, const int px, const int py) {
+
+  const float lat1 = 90.f - 180.f * (0.5f+y1) / (float)py;
+  const float lon1 = -180.f + 360.f * (0.5f+x1) / (float)px;
+  const float lat2 = 90.f - 180.f * (0.5f+y2) / (float)py;
+  const float lon2 = -180.f + 360.f * (0.5f+x2) / (float)px;
+  //printf("\npixel %d,%d is %gN %gE\n", x1, y1, lat1, lon1);
+  //printf("pixel %d,%d is %gN %gE\n", x2, y2, lat2, lon2);
+  //printf("distance is %g\n", gcr_dist (lat1, lon1, lat2, lon2));
+  const float degtorad = asinf(1.f) / 90.f;
+
+  return gcr_dist (degtorad*lat1, degtorad*lon1, degtorad*lat2, degtorad*lon2);
+}
+
+// say what's wrong with a location, if anything
+int bad_lat_lon (const float degN, const float degE) {
+  int bad = FALSE;
+  if (fabs(degN) > 90.f) {
+    fprintf(stderr,"ERROR: input latitude (%g) is not usable, try -90..90\n", degN); 
+    bad = TRUE;
+  }
+  if (fabs(degE) > 180.f) {
+    fprintf(stderr,"ERROR: input longitude (%g) is not usable, try -180..180\n", degN); 
+    bad = TRUE;
+  }
+  return bad;
+}
+
+void check_lat_lon( const float degN, const float degE) {
+  if (bad_lat_lon(degN, degE)) fail(1);
+}
+
+/*
+ * GeoNames places, to put names to results and to look up names
+ *
+ * -mkplaces reads a GeoNames dump (cities500.txt, allCountries.txt, ...)
+ * and writes an index that is used straight from mmap, with no parsing:
+ * the places as unit vectors in an implicit k-d tree (each range's
+ * middle element is its node, splitting on x, y, z in turn), then the
+ * place numbers sorted by name, then the names themselves
+ */
+#define PLACE_MAGIC "IPPLACE1"
+
+typedef struct place {
+  float v[3];		// unit vector
+  unsigned int pop;
+  unsigned int name;	// offsets into the name table
+  unsigned int ascii;
+  char cc[4];		// country code
+} place;
+
+typedef struct placeindex {
+  unsigned int n;
+  const place *p;		// in k-d tree order
+  const unsigned int *byname;	// sorted by ascii name, then most populous first
+  const char *names;
+  void *map;
+  size_t maplen;
+} placeindex;
+
+// the index file, and the index once it's opened
+char placefile[255] = "places.idx";
+placeindex *places = NULL;
+
+static void latlon_to_vec (const float degN, const float degE, float *v) {
+  const float degtorad = asinf(1.f) / 90.f;
+  v[0] = cosf(degtorad*degN) * cosf(degtorad*degE);
+  v[1] = cosf(degtorad*degN) * sinf(degtorad*degE);
+  v[2] = sinf(degtorad*degN);
+}
+
+static void vec_to_latlon (const float *v, float *degN, float *degE) {
+  const float radtodeg = 90.f / asinf(1.f);
+  *degN = radtodeg * asinf(fminf(1.f, fmaxf(-1.f, v[2])));
+  *degE = radtodeg * atan2f(v[1], v[0]);
+}
+
+// put the median (on one axis) of p[lo..hi) at the middle, smaller before
+static void place_select (place *p, int lo, int hi, const int axis) {
+  const int mid = (lo+hi)/2;
+  --hi;
+  while (lo < hi) {
+    const float pivot = p[(lo+hi)/2].v[axis];
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (p[i].v[axis] < pivot) ++i;
+      while (p[j].v[axis] > pivot) --j;
+      if (i <= j) {
+        const place t = p[i]; p[i] = p[j]; p[j] = t;
+        ++i; --j;
+      }
+    }
+    if (mid <= j) hi = j;
+    else if (mid >= i) lo = i;
+    else break;
+  }
+}
+
+static void place_tree (place *p, const int lo, const int hi, const int depth) {
+  if (hi-lo < 2) return;
+  place_select(p, lo, hi, depth%3);
+  place_tree(p, lo, (lo+hi)/2, depth+1);
+  place_tree(p, (lo+hi)/2+1, hi, depth+1);
+}
+
+static const place *sort_places;
+static const char *sort_names;
+static int place_name_compare (const void *a, const void *b) {
+  const place *pa = &sort_places[*(const unsigned int *)a];
+  const place *pb = &sort_places[*(const unsigned int *)b];
+  const int c = strcasecmp(sort_names+pa->ascii, sort_names+pb->ascii);
+  if (c) return c;
+  return (pa->pop < pb->pop) - (pa->pop > pb->pop);
+}
+
+/*
+ * read a GeoNames dump and write the place index, keeping only the
+ * populated places (feature class P)
+ */
+int build_places (char *infile, char *outfile) {
+  FILE *fp = fopen(infile,"r");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open GeoNames file %s\n",infile);
+    fflush(stderr);
+    exit(0);
+  }
+  unsigned int n = 0, nalloc = 65536;
+  place *p = malloc(nalloc*sizeof(place));
+  size_t nbytes = 0, balloc = 1<<20;
+  char *names = malloc(balloc);
+
+  char *line = NULL;
+  size_t linelen = 0;
+  while (getline(&line, &linelen, fp) > 0) {
+    // tab-separated: id, name, asciiname, alternates, lat, lon, class,
+    // code, country, cc2, admin1-4, population, ...
+    char *field[15];
+    int nf = 0;
+    char *s = line;
+    while (nf < 15) {
+      field[nf++] = s;
+      s = strchr(s, '\t');
+      if (s == NULL) break;
+      *s++ = '\0';
+    }
+    if (nf < 15 || field[6][0] != 'P') continue;
+
+    if (n == nalloc) {
+      nalloc *= 2;
+      p = realloc(p, nalloc*sizeof(place));
+    }
+    const size_t l1 = strlen(field[1])+1;
+    const size_t l2 = strlen(field[2])+1;
+    while (nbytes+l1+l2 > balloc) {
+      balloc *= 2;
+      names = realloc(names, balloc);
+    }
+    place *pl = &p[n++];
+    latlon_to_vec(atof(field[4]), atof(field[5]), pl->v);
+    pl->pop = (unsigned int)atol(field[14]);
+    pl->name = nbytes;
+    memcpy(names+nbytes, field[1], l1);
+    nbytes += l1;
+    pl->ascii = nbytes;
+    memcpy(names+nbytes, field[2], l2);
+    nbytes += l2;
+    memset(pl->cc, 0, 4);
+    strncpy(pl->cc, field[8], 3);
+  }
+  free(line);
+  fclose(fp);
+  if (n == 0) {
+    fprintf(stderr,"No populated places in %s\n",infile);
+    exit(0);
+  }
+
+  place_tree(p, 0, n, 0);
+  unsigned int *byname = malloc(n*sizeof(unsigned int));
+  for (unsigned int i=0; i<n; ++i) byname[i] = i;
+  sort_places = p;
+  sort_names = names;
+  qsort(byname, n, sizeof(unsigned int), place_name_compare);
+
+  fp = fopen(outfile,"wb");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",outfile);
+    fflush(stderr);
+    exit(0);
+  }
+  const unsigned int hdr[2] = { n, (unsigned int)nbytes };
+  fwrite(PLACE_MAGIC, 1, 8, fp);
+  fwrite(hdr, sizeof(unsigned int), 2, fp);
+  fwrite(p, sizeof(place), n, fp);
+  fwrite(byname, sizeof(unsigned int), n, fp);
+  fwrite(names, 1, nbytes, fp);
+  fclose(fp);
+  printf("Wrote %u places to %s\n", n, outfile);
+  free(p);
+  free(byname);
+  free(names);
+  return(0);
+}
+
+/*
+ * map the place index, returns NULL if it isn't there and isn't required
+ */
+placeindex* open_places (const int required) {
+  if (places) return places;
+  const int fd = open(placefile, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    if (!required) return NULL;
+    fprintf(stderr,"Could not open place index %s, make one with -mkplaces\n",placefile);
+    fail(0);
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  const unsigned int *hdr = (const unsigned int *)((const char *)map + 8);
+  if (map == MAP_FAILED || st.st_size < 16 || memcmp(map, PLACE_MAGIC, 8) != 0 ||
+      (size_t)st.st_size != 16 + (size_t)hdr[0]*(sizeof(place)+sizeof(unsigned int)) + hdr[1]) {
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    fprintf(stderr,"File %s is not a place index\n",placefile);
+    fail(0);
+  }
+  places = (placeindex *)malloc(sizeof(placeindex));
+  places->n = hdr[0];
+  places->p = (const place *)((const char *)map + 16);
+  places->byname = (const unsigned int *)(places->p + places->n);
+  places->names = (const char *)(places->byname + places->n);
+  places->map = map;
+  places->maplen = st.st_size;
+  return places;
+}
+
+// k-nearest places to q, kept sorted by squared chord length
+static void place_search (const placeindex *pi, const float *q, const int lo, const int hi,
+                          const int depth, const int k, int *nbest, int *best, float *bestd2) {
+  if (lo >= hi) return;
+  const int mid = (lo+hi)/2;
+  const place *p = &pi->p[mid];
+  const float dx = q[0]-p->v[0], dy = q[1]-p->v[1], dz = q[2]-p->v[2];
+  const float d2 = dx*dx + dy*dy + dz*dz;
+  if (*nbest < k || d2 < bestd2[*nbest-1]) {
+    int i = (*nbest < k) ? (*nbest)++ : k-1;
+    while (i > 0 && bestd2[i-1] > d2) {
+      best[i] = best[i-1];
+      bestd2[i] = bestd2[i-1];
+      --i;
+    }
+    best[i] = mid;
+    bestd2[i] = d2;
+  }
+  const float diff = q[depth%3] - p->v[depth%3];
+  const int nlo = (diff < 0.f) ? lo : mid+1;
+  const int nhi = (diff < 0.f) ? mid : hi;
+  place_search(pi, q, nlo, nhi, depth+1, k, nbest, best, bestd2);
+  if (*nbest < k || diff*diff < bestd2[*nbest-1]) {
+    const int flo = (diff < 0.f) ? mid+1 : lo;
+    const int fhi = (diff < 0.f) ? hi : mid;
+    place_search(pi, q, flo, fhi, depth+1, k, nbest, best, bestd2);
+  }
+}
+
+// find up to k nearest places, with distances in km, return how many
+int nearest_places (const placeindex *pi, const float degN, const float degE,
+                    const int k, int *idx, float *km) {
+  float q[3];
+  latlon_to_vec(degN, degE, q);
+  int n = 0;
+  place_search(pi, q, 0, pi->n, 0, k, &n, idx, km);
+  for (int i=0; i<n; ++i) km[i] = 6371.f * 2.f * asinf(fminf(1.f, 0.5f*sqrtf(km[i])));
+  return n;
+}
+
+void print_nearest_places (const float degN, const float degE) {
+  const placeindex *pi = open_places(FALSE);
+  if (pi == NULL) return;
+  int idx[3];
+  float km[3];
+  const int n = nearest_places(pi, degN, degE, 3, idx, km);
+  printf("  near");
+  for (int i=0; i<n; ++i) {
+    const place *p = &pi->p[idx[i]];
+    printf("%s %s, %s (%.0f km)", (i>0) ? ";" : "", pi->names+p->name, p->cc, km[i]);
+  }
+  printf("\n");
+}
+
+/*
+ * look up a place by name, optionally "name,CC" for a country code,
+ * and take the most populous if there are several
+ */
+int find_place (const placeindex *pi, const char *query, float *degN, float *degE) {
+  char name[255];
+  strncpy(name, query, 254);
+  name[254] = '\0';
+  const char *cc = NULL;
+  char *comma = strrchr(name, ',');
+  if (comma) {
+    *comma = '\0';
+    cc = comma+1;
+    while (*cc == ' ') ++cc;
+  }
+  // first entry with this name
+  int lo = 0, hi = pi->n;
+  while (lo < hi) {
+    const int mid = (lo+hi)/2;
+    if (strcasecmp(pi->names+pi->p[pi->byname[mid]].ascii, name) < 0) lo = mid+1;
+    else hi = mid;
+  }
+  for (int i=lo; i<(int)pi->n; ++i) {
+    const place *p = &pi->p[pi->byname[i]];
+    if (strcasecmp(pi->names+p->ascii, name) != 0) break;
+    if (cc && strcasecmp(p->cc, cc) != 0) continue;
+    vec_to_latlon(p->v, degN, degE);
+    printf("  found %s, %s at %g N %g E\n", pi->names+p->name, p->cc, *degN, *degE);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * read a location from the command line, either "lat lon" or a place
+ * name, and return how many arguments it used
+ */
+int parse_location (const int argc, char **argv, const int i, float *degN, float *degE) {
+  char *end;
+  if (i+2 < argc) {
+    *degN = strtof(argv[i+1], &end);
+    if (*end == '\0' && end != argv[i+1]) {
+      *degE = atof(argv[i+2]);
+      return 2;
+    }
+  }
+  if (i+1 >= argc) {
+    fprintf(stderr,"ERROR: %s needs a location\n", argv[i]);
+    fail(1);
+  }
+  if (!find_place(open_places(TRUE), argv[i+1], degN, degE)) {
+    fprintf(stderr,"ERROR: could not find a place named %s\n", argv[i+1]);
+    fail(1);
+  }
+  return 1;
+}
+
+
+// how many threads to use for the parallel parts
+int nthreads = 1;
+
+// the input layers, in the order of the first seven ideal[] slots
+enum { L_TEMPW, L_TEMPS, L_RAIN, L_CLOUD, L_WIND, L_HDI, L_MTN, NLAYERS };
+
+// and the cost categories that we tally
+enum { C_TEMP, C_RAIN, C_CLOUD, C_WIND, C_HDI, C_MTN, C_DIST, C_EXTRA, NCOSTS };
+
+// how an extra layer's value is compared to its ideal
+enum { COST_LINEAR, COST_LOG, COST_OVER, COST_UNDER, NCOSTFNS };
+static const char *cost_fn_names[NCOSTFNS] = { "linear", "log", "over", "under" };
+
+/*
+ * the layer registry: the built-in layers, then any that a manifest
+ * (-manifest) adds or changes; each layer's resolution is read from its
+ * png, and nothing is read until a query uses it
+ */
+#define MAXDEFS 64
+typedef struct layer_def {
+  char name[32];
+  char file[255];	// %m is the month, like m7, or the annual file's m1 or avg,
+			// and %s and %p the scenario and period
+  float min, range;	// what the full 16-bit range of the png maps onto
+  char units[32];
+  int cost;		// for extra layers, the built-in ones have their own
+  float penalty;	// and the default penalty, times -layer's + and -
+} layer_def;
+
+int ndefs = NLAYERS;
+layer_def layer_defs[MAXDEFS] = {
+  { "jan",   "airtemp_%m.png",        -30.f,   70.f, "C",    COST_LINEAR, 1.f },
+  { "jul",   "airtemp_m7.png",        -30.f,   70.f, "C",    COST_LINEAR, 1.f },
+  { "rain",  "precip_%m.png",           0.f, 1000.f, "mm",   COST_LOG,    1.f },
+  { "cloud", "clouds.png",              0.f,    1.f, "",     COST_LINEAR, 1.f },
+  { "wind",  "windspeed.png",           0.f,   25.f, "m/s",  COST_LINEAR, 1.f },
+  { "hdi",   "hdi.png",                 0.f,    1.f, "",     COST_LINEAR, 1.f },
+  { "mtn",   "dem_variance_area.png",   0.f,    1.f, "",     COST_LINEAR, 1.f },
+};
+
+// extra layers from -layer (from the manifest, or any 0..1 png like those
+// made with -mkfilter) follow the built-in ones
+#define MAXEXTRA 8
+#define MAXLAYERS (NLAYERS+MAXEXTRA)
+int nextra = 0;
+int extra_def[MAXEXTRA];	// each one's registry entry
+
+// value that the full 16-bit range of each layer's png maps onto
+float layer_min[MAXLAYERS]   = { -30.f, -30.f,    0.f, 0.f,  0.f, 0.f, 0.f };
+float layer_range[MAXLAYERS] = {  70.f,  70.f, 1000.f, 1.f, 25.f, 1.f, 1.f };
+
+// climate projections: -scenario and -period each name one or more
+// stacks of the layers that change with them, like ssp245 and 2041-2070
+#define MAXSTACKS 15
+int nscen = 0;
+int nperiod = 0;
+char scen_names[MAXSTACKS][32];
+char period_names[MAXSTACKS][32];
+
+// append k characters of s to the n already in a name that has room for len
+static size_t append_name (char *name, const size_t len, const size_t n, const char *s, const int k) {
+  if (n < len) snprintf(name+n, len-n, "%.*s", k, s);
+  return n + k;
+}
+
+// fill in the file name for a layer in one stack, some change with the
+// month, and %s and %p are the scenario and period; the built-in climate
+// layers are in the stack's own directory unless the manifest says where
+void stack_layer_file (const int layer, const int imonth, const char *scen, const char *period,
+                       char *name, const size_t len) {
+  const layer_def *d = &layer_defs[(layer < NLAYERS) ? layer : extra_def[layer-NLAYERS]];
+  // jul is always july, with a specific month its data goes in the jan slot
+  char month[8];
+  if (layer == L_TEMPS) strcpy(month, "m7");
+  else if (imonth == 0) strcpy(month, (layer == L_TEMPW) ? "m1" : "avg");
+  else snprintf(month, sizeof(month), "m%d", imonth);
+  size_t n = 0;
+  name[0] = '\0';
+  if (layer <= L_RAIN && !strstr(d->file, "%s") && !strstr(d->file, "%p")) {
+    if (scen[0]) n = append_name(name, len, append_name(name, len, n, scen, strlen(scen)), "/", 1);
+    if (period[0]) n = append_name(name, len, append_name(name, len, n, period, strlen(period)), "/", 1);
+  }
+  for (const char *f=d->file; *f; ++f) {
+    if (f[0] == '%' && f[1] == 'm') n = append_name(name, len, n, month, strlen(month));
+    else if (f[0] == '%' && f[1] == 's') n = append_name(name, len, n, scen, strlen(scen));
+    else if (f[0] == '%' && f[1] == 'p') n = append_name(name, len, n, period, strlen(period));
+    else { n = append_name(name, len, n, f, 1); continue; }
+    ++f;
+  }
+  if (n >= len) {
+    fprintf(stderr,"ERROR: the file name for layer %s is longer than %d characters: %s...\n", d->name, (int)len-1, name);
+    fail(0);
+  }
+}
+
+// the same, for the first (or only) stack
+void layer_file (const int layer, const int imonth, char *name, const size_t len) {
+  stack_layer_file(layer, imonth, nscen ? scen_names[0] : "", nperiod ? period_names[0] : "", name, len);
+}
+
+// by name, or by file for the ones that -layer added
+int find_layer_def (const char *name) {
+  for (int d=0; d<ndefs; ++d) if (strcmp(layer_defs[d].name, name) == 0) return d;
+  for (int d=NLAYERS; d<ndefs; ++d) if (strcmp(layer_defs[d].file, name) == 0) return d;
+  return -1;
+}
+
+// read a manifest: one layer a line, as
+//   name file min range [units [linear|log|over|under [penalty]]]
+// where a built-in layer's name changes its file, scale, and units
+void read_manifest (const char *infile) {
+  FILE *fp = fopen(infile,"r");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open manifest %s\n",infile);
+    fflush(stderr);
+    fail(0);
+  }
+  char line[1024];
+  int n = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    char *c = line;
+    while (*c == ' ' || *c == '\t') ++c;
+    if (*c == '#' || *c == '\n' || *c == '\0') continue;
+    layer_def ld = { "", "", 0.f, 1.f, "", COST_LINEAR, 1.f };
+    char cost[32] = "linear";
+    const int nf = sscanf(c, "%31s %254s %f %f %31s %31s %f", ld.name, ld.file, &ld.min, &ld.range, ld.units, cost, &ld.penalty);
+    if (nf < 4 || ld.range <= 0.f) {
+      fprintf(stderr,"Manifest %s: need name, file, min, and a positive range in: %s",infile,line);
+      fclose(fp);
+      fail(0);
+    }
+    if (strcmp(ld.units, "-") == 0) ld.units[0] = '\0';
+    ld.cost = -1;
+    for (int f=0; f<NCOSTFNS; ++f) if (strcmp(cost, cost_fn_names[f]) == 0) ld.cost = f;
+    if (ld.cost < 0) {
+      fprintf(stderr,"Manifest %s: cost of %s must be linear, log, over, or under\n",infile,ld.name);
+      fclose(fp);
+      fail(0);
+    }
+    int d = find_layer_def(ld.name);
+    if (d < 0) {
+      if (ndefs == MAXDEFS) {
+        fprintf(stderr,"No more than %d layers allowed in the manifest\n", MAXDEFS-NLAYERS);
+        fclose(fp);
+        fail(0);
+      }
+      d = ndefs++;
+    } else if (d < NLAYERS) {
+      // the built-in layers keep their own costs
+      ld.cost = layer_defs[d].cost;
+      ld.penalty = 1.f;
+      layer_min[d] = ld.min;
+      layer_range[d] = ld.range;
+    }
+    layer_defs[d] = ld;
+    n++;
+  }
+  fclose(fp);
+  printf("Read %d layers from %s\n", n, infile);
+}
+
+// an extra layer's cost per unit of penalty
+static inline float extra_cost (const int fn, const float v, const float ideal) {
+  switch (fn) {
+    case COST_LOG:   return fabsf(logf(0.1f+fmaxf(v,0.f)) - logf(0.1f+fmaxf(ideal,0.f)));
+    case COST_OVER:  return fmaxf(v-ideal, 0.f);
+    case COST_UNDER: return fmaxf(ideal-v, 0.f);
+    default:         return fabsf(v-ideal);
+  }
+}
+
+// and the worst of it over the layer's range
+static inline float extra_worst (const int k, const float ideal) {
+  const layer_def *d = &layer_defs[extra_def[k]];
+  return d->penalty * fmaxf(extra_cost(d->cost, d->min, ideal), extra_cost(d->cost, d->min+d->range, ideal));
+}
+
+// convert a N,E location to the nearest pixel in our south-up arrays
+void latlon_to_px (const float degN, const float degE, const int xres, const int yres,
+                   int *px, int *py) {
+  *px = 0.5f + xres * (180.f + degE) / 360.f;
+  *py = 0.5f + yres * ( 90.f + degN) / 180.f;
+  if (*px > xres-1) *px = xres-1;
+  if (*py > yres-1) *py = yres-1;
+}
+
+// replace one person's ideals with the layer values at a location
+void set_ideals_like (float *ideal, const float *vals, const int imonth, const int everything) {
+  ideal[0] = vals[L_TEMPW];
+  if (imonth == 0) {
+    // imonth is unset
+    // tempw is January and temps is July
+    printf("  set ideal Jan temp to %g C\n", ideal[0]);
+    ideal[1] = vals[L_TEMPS];
+    printf("  set ideal July temp to %g C\n", ideal[1]);
+  } else {
+    // tempw is given month
+    printf("  set ideal temp in month %d to %g C\n", imonth, ideal[0]);
+  }
+  ideal[2] = vals[L_RAIN];
+  printf("  set ideal monthly rain to %g mm/mo\n", ideal[2]);
+  ideal[3] = vals[L_CLOUD];
+  printf("  set ideal annual cloud cover to %g (1=100%%)\n", ideal[3]);
+  ideal[4] = vals[L_WIND];
+  printf("  set ideal wind speed to %g (m/s)\n", ideal[4]);
+  if (everything) {
+    ideal[5] = vals[L_HDI];
+    printf("  set ideal Human Development Index to %g (1=most)\n", ideal[5]);
+    ideal[6] = vals[L_MTN];
+    printf("  set ideal mountain proximity to %g (1=closest)\n", ideal[6]);
+  }
+}
+
+// does any person use this layer?
+int layer_is_used (float ideal[][15], const int p, const int layer) {
+  // tempw doubles as the land mask
+  if (layer == L_TEMPW) return TRUE;
+  for (int ip=0; ip<p; ++ip) {
+    if (layer == L_TEMPS && ideal[ip][1] > -500.f) return TRUE;
+    if (layer > L_TEMPS && ideal[ip][layer] >= 0.f) return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * "like any of these places" similarity search
+ *
+ * every pixel gets a feature vector of its layer values, each scaled by
+ * that layer's penalty (and rain on a log scale), so that the L1 distance
+ * between two feature vectors is exactly the "everything like" cost
+ *
+ * in seven dimensions a k-d tree over a few hundred targets prunes almost
+ * nothing, so we search by brute force over blocks of targets stored
+ * feature-major, which the compiler vectorizes across targets
+ */
+#define NFEAT NLAYERS
+#define LIKE_BLOCK 256
+
+typedef struct like_match {
+  float dist;
+  int row, col, target;
+} like_match;
+
+typedef struct likeset {
+  int n;
+  float (*loc)[2];	// N, E of each target
+  int *px, *py;
+  int nfeat;		// 6 if we're using a single month, 7 otherwise
+  float *feat;		// [nfeat][n], feature-major
+  float dist[LIKE_BLOCK];	// scratch for one block of distances
+  // the best matches found so far, as a max-heap on dist
+  int k, nbest;
+  like_match *best;
+} likeset;
+
+void free_likeset (likeset *ls) {
+  free(ls->loc);
+  free(ls->px);
+  free(ls->py);
+  free(ls->feat);
+  free(ls->best);
+  free(ls);
+}
+
+// read a file of "lat lon" lines, # starts a comment
+likeset* read_likeset (char *infile) {
+  FILE *fp = fopen(infile,"r");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open target location file %s\n",infile);
+    fflush(stderr);
+    fail(0);
+  }
+  likeset *ls = (likeset *)calloc(1, sizeof(likeset));
+  int nalloc = 64;
+  ls->loc = malloc(nalloc * sizeof(*ls->loc));
+  char line[255];
+  while (fgets(line, 255, fp)) {
+    float degN, degE;
+    if (line[0] == '#' || sscanf(line, "%f %f", &degN, &degE) != 2) continue;
+    if (bad_lat_lon(degN, degE)) {
+      fclose(fp);
+      free_likeset(ls);
+      fail(1);
+    }
+    if (ls->n == nalloc) {
+      nalloc *= 2;
+      ls->loc = realloc(ls->loc, nalloc * sizeof(*ls->loc));
+    }
+    ls->loc[ls->n][0] = degN;
+    ls->loc[ls->n][1] = degE;
+    ls->n++;
+  }
+  fclose(fp);
+  if (ls->n == 0) {
+    fprintf(stderr,"ERROR: no locations found in %s\n",infile);
+    free_likeset(ls);
+    fail(1);
+  }
+  ls->px = malloc(ls->n * sizeof(int));
+  ls->py = malloc(ls->n * sizeof(int));
+  return ls;
+}
+
+// the weighted feature vector of one pixel, given its layer values
+static inline void like_features (const float *v, const float *penalty, const int nfeat, float *f) {
+  f[0] = penalty[C_TEMP] * v[L_TEMPW];
+  f[1] = penalty[C_RAIN] * logf(0.1f + v[L_RAIN]);
+  f[2] = penalty[C_CLOUD] * v[L_CLOUD];
+  f[3] = penalty[C_WIND] * v[L_WIND];
+  f[4] = penalty[C_HDI] * v[L_HDI];
+  f[5] = penalty[C_MTN] * v[L_MTN];
+  // with a specific month, there is no separate summer temperature
+  if (nfeat > 6) f[6] = penalty[C_TEMP] * v[L_TEMPS];
+}
+
+/*
+ * set each target's features from the layer values at its pixel, vals
+ * is [target][layer]
+ */
+void build_likeset (likeset *ls, float (*vals)[NLAYERS], const float *penalty, const int imonth,
+                    const int topk) {
+  ls->nfeat = (imonth == 0) ? 7 : 6;
+  ls->k = topk;
+  ls->nbest = 0;
+  ls->best = malloc((topk > 0 ? topk : 1) * sizeof(like_match));
+
+  // drop any targets that are in the ocean
+  int n = 0;
+  for (int i=0; i<ls->n; ++i) {
+    if (vals[i][L_TEMPW] > -29.9f) {
+      ls->loc[n][0] = ls->loc[i][0];
+      ls->loc[n][1] = ls->loc[i][1];
+      ls->px[n] = ls->px[i];
+      ls->py[n] = ls->py[i];
+      if (n < i) memcpy(vals[n], vals[i], sizeof(*vals));
+      ++n;
+    } else {
+      printf("  skipping target %g N %g E, it is not on land\n", ls->loc[i][0], ls->loc[i][1]);
+    }
+  }
+  ls->n = n;
+  if (n == 0) {
+    fprintf(stderr,"ERROR: none of the target locations are on land\n");
+    fail(1);
+  }
+
+  ls->feat = malloc(ls->nfeat * n * sizeof(float));
+  for (int i=0; i<n; ++i) {
+    float f[NFEAT];
+    like_features(vals[i], penalty, ls->nfeat, f);
+    for (int k=0; k<ls->nfeat; ++k) ls->feat[k*n+i] = f[k];
+  }
+}
+
+// keep the k smallest distances in a max-heap
+static void like_push (likeset *ls, const float dist, const int row, const int col, const int target) {
+  like_match *h = ls->best;
+  int i;
+  if (ls->nbest < ls->k) {
+    // sift a new leaf up
+    i = ls->nbest++;
+    while (i > 0 && h[(i-1)/2].dist < dist) {
+      h[i] = h[(i-1)/2];
+      i = (i-1)/2;
+    }
+  } else if (dist < h[0].dist) {
+    // replace the root and sift it down
+    i = 0;
+    while (TRUE) {
+      int c = 2*i+1;
+      if (c >= ls->nbest) break;
+      if (c+1 < ls->nbest && h[c+1].dist > h[c].dist) ++c;
+      if (h[c].dist <= dist) break;
+      h[i] = h[c];
+      i = c;
+    }
+  } else {
+    return;
+  }
+  h[i] = (like_match){ dist, row, col, target };
+}
+
+/*
+ * add the distance to the most similar target to the listed pixels of a
+ * row, out is indexed like cand
+ */
+void like_row (const int row, const int xres, likeset *ls, const float *penalty,
+               float **vals, const int *cand, const int ncand, float *out, float *total) {
+  const int n = ls->n;
+  const int nfeat = ls->nfeat;
+  float *d = ls->dist;
+  float v[NLAYERS], q[NFEAT];
+  float rowtotal = 0.f;
+
+  for (int i=0; i<ncand; ++i) {
+    const int col = cand[i];
+    for (int l=0; l<NLAYERS; ++l) v[l] = vals[l] ? vals[l][col] : 0.f;
+    like_features(v, penalty, nfeat, q);
+
+    float bestd = 9.9e+9;
+    int besti = 0;
+    for (int t0=0; t0<n; t0+=LIKE_BLOCK) {
+      const int nt = (n-t0 < LIKE_BLOCK) ? n-t0 : LIKE_BLOCK;
+      const float *f = ls->feat + t0;
+      for (int t=0; t<nt; ++t) d[t] = fabsf(q[0]-f[t]);
+      for (int k=1; k<nfeat; ++k) {
+        const float qk = q[k];
+        const float *fk = f + k*n;
+        for (int t=0; t<nt; ++t) d[t] += fabsf(qk-fk[t]);
+      }
+      for (int t=0; t<nt; ++t) {
+        if (d[t] < bestd) { bestd = d[t]; besti = t0+t; }
+      }
+    }
+
+    out[i] += bestd;
+    rowtotal += bestd;
+    // the targets themselves aren't interesting matches
+    if (ls->k > 0 && !(row == ls->py[besti] && col == ls->px[besti])) {
+      like_push(ls, bestd, row, col, besti);
+    }
+  }
+  *total += rowtotal;
+}
+
+static int like_match_compare (const void *a, const void *b) {
+  const float da = ((const like_match *)a)->dist;
+  const float db = ((const like_match *)b)->dist;
+  return (da > db) - (da < db);
+}
+
+void print_like_matches (likeset *ls, const int xres, const int yres) {
+  qsort(ls->best, ls->nbest, sizeof(like_match), like_match_compare);
+  printf("Best %d matches to the %d target locations:\n", ls->nbest, ls->n);
+  for (int i=0; i<ls->nbest; ++i) {
+    const like_match *m = &ls->best[i];
+    const float nlat = -90.f + 180.f * (0.5f+m->row) / (float)yres;
+    const float elong = -180.f + 360.f * (0.5f+m->col) / (float)xres;
+    printf("  %3d  %7.2f N %8.2f E  cost %-8.4g like %g N %g E", i+1, nlat, elong, m->dist,
+           ls->loc[m->target][0], ls->loc[m->target][1]);
+    if (places) {
+      // and put a name to it, if we can
+      int idx;
+      float km;
+      if (nearest_places(places, nlat, elong, 1, &idx, &km) == 1) {
+        printf("  near %s, %s", places->names+places->p[idx].name, places->p[idx].cc);
+      }
+    }
+    printf("\n");
+  }
+}
+
+
+/*
+ * start a row: ocean becomes -1 and land 0, and the land pixels are
+ * listed in cand, return how many there are
+ */
+int land_row (const float *tempw, const int xres, float *out, int *cand) {
+  int ncand = 0;
+  for (int col=0; col<xres; ++col) {
+    if (tempw[col] > -29.9f) {
+      out[col] = 0.f;
+      cand[ncand++] = col;
+    } else {
+      out[col] = -1.f;
+    }
+  }
+  return ncand;
+}
+
+/*
+ * hard constraints: an allowed range of a layer's value, anything
+ * outside of it is treated like ocean and never scored
+ */
+typedef struct constraint {
+  int layer;
+  float lo, hi;
+  float guess;		// fraction expected to pass, before we've seen any
+  long tested, passed;
+} constraint;
+
+typedef struct constraints {
+  int n;
+  constraint c[NLAYERS];	// kept in order of selectivity, most first
+} constraints;
+
+int layer_by_name (const char *name) {
+  // -m uses the first temperature layer for the month
+  if (strcmp(name, "temp") == 0) return L_TEMPW;
+  for (int l=0; l<NLAYERS; ++l) {
+    if (strcmp(name, layer_defs[l].name) == 0) return l;
+  }
+  fprintf(stderr,"Unknown layer %s, use one of jan (or temp), jul, rain, cloud, wind, hdi, mtn\n",name);
+  fail(0);
+}
+
+// narrow the allowed range of a layer
+void add_constraint (constraints *cs, const int layer, const float lo, const float hi) {
+  int i = 0;
+  while (i<cs->n && cs->c[i].layer != layer) ++i;
+  if (i == cs->n) {
+    cs->c[i] = (constraint){ layer, -9.9e+9, 9.9e+9, 1.f, 0, 0 };
+    cs->n++;
+  }
+  constraint *c = &cs->c[i];
+  if (lo > c->lo) c->lo = lo;
+  if (hi < c->hi) c->hi = hi;
+  // until we see some data, guess that values spread evenly over the range
+  const float lmin = layer_min[layer];
+  const float lmax = layer_min[layer] + layer_range[layer];
+  c->guess = (fminf(c->hi,lmax) - fmaxf(c->lo,lmin)) / layer_range[layer];
+  c->guess = fminf(1.f, fmaxf(0.f, c->guess));
+}
+
+int constraint_uses (const constraints *cs, const int layer) {
+  for (int i=0; i<cs->n; ++i) if (cs->c[i].layer == layer) return TRUE;
+  return FALSE;
+}
+
+static inline float pass_rate (const constraint *c) {
+  // the guess counts as a row's worth of pixels
+  return (c->passed + 3600.f*c->guess) / (c->tested + 3600.f);
+}
+
+/*
+ * drop the listed pixels of a row that fail any constraint, testing the
+ * most selective constraint first so that the list shrinks fastest, and
+ * return how many are left
+ */
+int constrain_row (constraints *cs, float **vals, int *cand, int ncand, float *out) {
+  for (int i=0; i<cs->n && ncand>0; ++i) {
+    constraint *c = &cs->c[i];
+    const float *val = vals[c->layer];
+    const float lo = c->lo;
+    const float hi = c->hi;
+    int n = 0;
+    for (int j=0; j<ncand; ++j) {
+      const int col = cand[j];
+      if (val[col] >= lo && val[col] <= hi) {
+        cand[n++] = col;
+      } else {
+        out[col] = -1.f;
+      }
+    }
+    c->tested += ncand;
+    c->passed += n;
+    ncand = n;
+  }
+  // keep the order up to date, there are only a few
+  for (int i=1; i<cs->n; ++i) {
+    for (int j=i; j>0 && pass_rate(&cs->c[j]) < pass_rate(&cs->c[j-1]); --j) {
+      const constraint t = cs->c[j];
+      cs->c[j] = cs->c[j-1];
+      cs->c[j-1] = t;
+    }
+  }
+  return ncand;
+}
+
+void print_constraints (const constraints *cs) {
+  for (int i=0; i<cs->n; ++i) {
+    const constraint *c = &cs->c[i];
+    printf("  %s", layer_defs[c->layer].name);
+    if (c->lo > -9.e+9) printf(" >= %g", c->lo);
+    if (c->hi < 9.e+9) printf(" <= %g", c->hi);
+    printf(", %.1f%% of %ld pixels passed\n", 100.0*c->passed/(c->tested>0 ? c->tested : 1), c->tested);
+  }
+}
+
+/*
+ * a route, or any polyline, to stay close to: each segment is the
+ * shorter great-circle arc between two vertices, and they're kept in
+ * leaves of ROUTE_LEAF consecutive segments under a binary tree of
+ * bounding caps, so that each pixel measures only the few leaves that
+ * could hold its nearest segment
+ */
+#define ROUTE_LEAF 8
+
+typedef struct route_cap {
+  float c[3];		// unit vector to the center
+  float r, cosr, sinr;	// radius in radians, or r < 0 for an empty leaf
+} route_cap;
+
+typedef struct route {
+  int nseg, nleaf;
+  int nnode;		// nodes 1..nnode-1, the root is 1 and leaf k is nnode/2+k
+  // per segment, padded to whole leaves: the endpoints a and b, the pole
+  // n of its great circle, and ta = n x a and tb = b x n, which are both
+  // positive where a point's foot on the circle lies on the arc
+  float *a[3], *b[3], *n[3], *ta[3], *tb[3];
+  route_cap *node;
+} route;
+
+static inline void unit_vector (const float degN, const float degE, float *v) {
+  const float degtorad = asinf(1.f) / 90.f;
+  v[0] = cosf(degtorad*degE) * cosf(degtorad*degN);
+  v[1] = sinf(degtorad*degE) * cosf(degtorad*degN);
+  v[2] = sinf(degtorad*degN);
+}
+
+static inline float dot3 (const float *u, const float *v) {
+  return u[0]*v[0] + u[1]*v[1] + u[2]*v[2];
+}
+
+static inline void cross3 (const float *u, const float *v, float *w) {
+  w[0] = u[1]*v[2] - u[2]*v[1];
+  w[1] = u[2]*v[0] - u[0]*v[2];
+  w[2] = u[0]*v[1] - u[1]*v[0];
+}
+
+// from the chord, which unlike the dot product keeps small angles
+static inline float angle3 (const float *u, const float *v) {
+  const float d[3] = { u[0]-v[0], u[1]-v[1], u[2]-v[2] };
+  return 2.f * asinf(fminf(1.f, 0.5f*sqrtf(dot3(d, d))));
+}
+
+// a cap around caps p and q, or a copy of the one that isn't empty
+static void merge_caps (const route_cap *p, const route_cap *q, route_cap *m) {
+  if (q->r < 0.f) { *m = *p; return; }
+  if (p->r < 0.f) { *m = *q; return; }
+  float c[3] = { p->c[0]+q->c[0], p->c[1]+q->c[1], p->c[2]+q->c[2] };
+  const float len = sqrtf(dot3(c, c));
+  if (len < 1.e-6f) { c[0] = p->c[0]; c[1] = p->c[1]; c[2] = p->c[2]; }
+  else { c[0] /= len; c[1] /= len; c[2] /= len; }
+  m->c[0] = c[0]; m->c[1] = c[1]; m->c[2] = c[2];
+  m->r = fmaxf(angle3(c, p->c) + p->r, angle3(c, q->c) + q->r);
+}
+
+/*
+ * read a file of "lat lon" lines, # starts a comment, and a blank line
+ * starts another line, so one file can hold a whole network
+ */
+route* read_route (char *infile) {
+  FILE *fp = fopen(infile,"r");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open route file %s\n",infile);
+    fflush(stderr);
+    fail(0);
+  }
+  // the segments as pairs of vertices
+  int nalloc = 64, nseg = 0;
+  float (*seg)[2][3] = malloc(nalloc * sizeof(*seg));
+  float last[3];
+  int have_last = FALSE;
+  char line[255];
+  while (fgets(line, 255, fp)) {
+    float degN, degE;
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%f %f", &degN, &degE) != 2) {
+      have_last = FALSE;
+      continue;
+    }
+    int status = bad_lat_lon(degN, degE) ? 1 : -1;
+    float v[3];
+    unit_vector(degN, degE, v);
+    if (status < 0 && have_last && angle3(last, v) > 3.14f) {
+      fprintf(stderr,"ERROR: route %s has a segment ending at %g N %g E whose ends are antipodal\n",infile,degN,degE);
+      status = 0;
+    }
+    if (status >= 0) {
+      fclose(fp);
+      free(seg);
+      fail(status);
+    }
+    if (have_last && angle3(last, v) > 1.e-5f) {
+      if (nseg == nalloc) {
+        nalloc *= 2;
+        seg = realloc(seg, nalloc * sizeof(*seg));
+      }
+      memcpy(seg[nseg][0], last, sizeof(last));
+      memcpy(seg[nseg][1], v, sizeof(v));
+      nseg++;
+    } else if (have_last) {
+      continue;
+    }
+    memcpy(last, v, sizeof(v));
+    have_last = TRUE;
+  }
+  fclose(fp);
+  if (nseg == 0) {
+    fprintf(stderr,"ERROR: no segments found in %s, it needs two or more lat lon lines in a row\n",infile);
+    free(seg);
+    fail(1);
+  }
+
+  route *rt = (route *)calloc(1, sizeof(route));
+  rt->nseg = nseg;
+  rt->nleaf = (nseg + ROUTE_LEAF-1) / ROUTE_LEAF;
+  int nl = 1;
+  while (nl < rt->nleaf) nl *= 2;
+  rt->nnode = 2*nl;
+  const int npad = rt->nleaf * ROUTE_LEAF;
+  for (int d=0; d<3; ++d) {
+    rt->a[d] = malloc(npad * sizeof(float));
+    rt->b[d] = malloc(npad * sizeof(float));
+    rt->n[d] = malloc(npad * sizeof(float));
+    rt->ta[d] = malloc(npad * sizeof(float));
+    rt->tb[d] = malloc(npad * sizeof(float));
+  }
+  rt->node = (route_cap *)malloc(rt->nnode * sizeof(route_cap));
+  for (int i=0; i<rt->nnode; ++i) rt->node[i].r = -1.f;
+
+  for (int s=0; s<npad; ++s) {
+    // the padding repeats the last segment
+    const float *a = seg[s < nseg ? s : nseg-1][0];
+    const float *b = seg[s < nseg ? s : nseg-1][1];
+    float n[3], ta[3], tb[3];
+    cross3(a, b, n);
+    const float len = sqrtf(dot3(n, n));
+    for (int d=0; d<3; ++d) n[d] /= len;
+    cross3(n, a, ta);
+    cross3(b, n, tb);
+    for (int d=0; d<3; ++d) {
+      rt->a[d][s] = a[d];
+      rt->b[d][s] = b[d];
+      rt->n[d][s] = n[d];
+      rt->ta[d][s] = ta[d];
+      rt->tb[d][s] = tb[d];
+    }
+  }
+
+  // each leaf's cap is centered on the mean of its arcs' midpoints, and
+  // reaches every arc since no point of one is farther than half its
+  // length from its midpoint
+  for (int k=0; k<rt->nleaf; ++k) {
+    float mid[ROUTE_LEAF][3], half[ROUTE_LEAF];
+    float c[3] = { 0.f, 0.f, 0.f };
+    for (int j=0; j<ROUTE_LEAF; ++j) {
+      const int s = k*ROUTE_LEAF + j;
+      float m[3] = { rt->a[0][s]+rt->b[0][s], rt->a[1][s]+rt->b[1][s], rt->a[2][s]+rt->b[2][s] };
+      const float len = sqrtf(dot3(m, m));
+      for (int d=0; d<3; ++d) {
+        mid[j][d] = m[d] / len;
+        c[d] += mid[j][d];
+      }
+      const float ab[3] = { rt->a[0][s], rt->a[1][s], rt->a[2][s] };
+      half[j] = angle3(ab, mid[j]);
+    }
+    const float len = sqrtf(dot3(c, c));
+    route_cap *cp = &rt->node[rt->nnode/2 + k];
+    for (int d=0; d<3; ++d) cp->c[d] = (len > 1.e-6f) ? c[d]/len : mid[0][d];
+    cp->r = 0.f;
+    for (int j=0; j<ROUTE_LEAF; ++j) cp->r = fmaxf(cp->r, angle3(cp->c, mid[j]) + half[j]);
+  }
+  for (int i=rt->nnode/2-1; i>0; --i) merge_caps(&rt->node[2*i], &rt->node[2*i+1], &rt->node[i]);
+  for (int i=1; i<rt->nnode; ++i) {
+    // a little slack for rounding, and no cap is bigger than the sphere
+    route_cap *cp = &rt->node[i];
+    if (cp->r < 0.f) continue;
+    cp->r = fminf(cp->r + 1.e-4f, 3.1416f);
+    cp->cosr = cosf(cp->r);
+    cp->sinr = sinf(cp->r);
+  }
+  free(seg);
+  return rt;
+}
+
+void free_route (route *rt) {
+  for (int d=0; d<3; ++d) {
+    free(rt->a[d]);
+    free(rt->b[d]);
+    free(rt->n[d]);
+    free(rt->ta[d]);
+    free(rt->tb[d]);
+  }
+  free(rt->node);
+  free(rt);
+}
+
+/*
+ * squared chord from unit vector p to the nearest of a leaf's arcs: to
+ * the foot of p on an arc's great circle if it falls on the arc, else
+ * to the nearer end; chords keep their precision near zero, where
+ * cosines don't, and there are no branches, so it vectorizes
+ */
+static inline float route_leaf (const route *rt, const int k, const float *p) {
+  float best = 4.f;
+  const int s0 = k*ROUTE_LEAF;
+  for (int s=s0; s<s0+ROUTE_LEAF; ++s) {
+    const float pn = p[0]*rt->n[0][s] + p[1]*rt->n[1][s] + p[2]*rt->n[2][s];
+    const float qa = p[0]*rt->ta[0][s] + p[1]*rt->ta[1][s] + p[2]*rt->ta[2][s];
+    const float qb = p[0]*rt->tb[0][s] + p[1]*rt->tb[1][s] + p[2]*rt->tb[2][s];
+    const float ax = p[0]-rt->a[0][s], ay = p[1]-rt->a[1][s], az = p[2]-rt->a[2][s];
+    const float bx = p[0]-rt->b[0][s], by = p[1]-rt->b[1][s], bz = p[2]-rt->b[2][s];
+    // sin of the angle to the circle is pn, and chord^2 = 2 (1 - cos)
+    const float onarc = 2.f*pn*pn / (1.f + sqrtf(fmaxf(0.f, 1.f - pn*pn)));
+    const float ends = fminf(ax*ax + ay*ay + az*az, bx*bx + by*by + bz*bz);
+    best = fminf(best, (qa >= 0.f && qb >= 0.f) ? onarc : ends);
+  }
+  return best;
+}
+
+/*
+ * the angle from unit vector p to the route, starting from leaf *seed,
+ * which is where the last pixel found its nearest, and set to where this
+ * one's is
+ */
+static float route_angle (const route *rt, const float *p, int *seed) {
+  float hb = route_leaf(rt, *seed, p);
+  // cos and sin of the best angle so far
+  float cb = 1.f - 0.5f*hb;
+  float sb = sqrtf(fmaxf(0.f, hb*(1.f - 0.25f*hb)));
+  const int first_leaf = rt->nnode/2;
+  int stack[64];
+  int ns = 0;
+  stack[ns++] = 1;
+  while (ns > 0) {
+    const int i = stack[--ns];
+    const route_cap *cp = &rt->node[i];
+    if (cp->r < 0.f) continue;
+    // skip the cap if even its nearest point is no closer than the best:
+    // angle(p,c) >= best + r, so p.c <= cos(best + r) while that's under pi
+    if (sb*cp->cosr + cb*cp->sinr > 0.f && dot3(p, cp->c) <= cb*cp->cosr - sb*cp->sinr) continue;
+    if (i >= first_leaf) {
+      const int k = i - first_leaf;
+      if (k == *seed) continue;
+      const float h = route_leaf(rt, k, p);
+      if (h < hb) {
+        hb = h;
+        cb = 1.f - 0.5f*hb;
+        sb = sqrtf(fmaxf(0.f, hb*(1.f - 0.25f*hb)));
+        *seed = k;
+      }
+    } else {
+      // the nearer child is looked at first
+      const int l = 2*i, r = 2*i+1;
+      const int near = (rt->node[r].r < 0.f || dot3(p, rt->node[l].c) >= dot3(p, rt->node[r].c)) ? l : r;
+      stack[ns++] = (near == l) ? r : l;
+      stack[ns++] = near;
+    }
+  }
+  return 2.f * asinf(fminf(1.f, 0.5f*sqrtf(hb)));
+}
+
+/*
+ * how to combine the persons' costs into one:
+ *   sum       add them up (the default)
+ *   max       the least happy person decides, so nobody is miserable
+ *   weighted  weighted mean, see -weight
+ *   norm      weighted mean of each person's cost as a fraction of the
+ *             worst cost their own preferences could give
+ */
+enum { AGG_SUM, AGG_MAX, AGG_WEIGHTED, AGG_NORM };
+
+// the criteria that -robust and -pareto keep apart: the cost categories,
+// and then the "like any of these" similarity
+#define C_LIKE NCOSTS
+#define NCRIT (NCOSTS+1)
+const char *crit_names[NCRIT] = { "temp", "rain", "cloud", "wind", "hdi", "mtn", "dist", "extra", "like" };
+
+/*
+ * everything that's needed to score a row, for every person
+ */
+typedef struct scorer {
+  int p, mode, xres, yres;
+  float (*ideal)[15];
+  float (*extra_ideal)[MAXEXTRA];	// ideal value of each extra layer, <0 if unused
+  float (*penalty)[NCOSTS];	// each person has their own weights
+  likeset **likes;
+  route **routes;		// each person's route to stay close to, if any
+  float *mult;			// scales each person's cost before combining
+  // for close-to [0] and far-from [1]: the point's latitude, and the
+  // cosine of the longitude difference to every column
+  float (*sinlat)[2], (*coslat)[2];
+  float *(*coslon)[2];
+  float *coscol, *sincol;	// and the longitude of every column, for the routes
+  float *pcost;			// one person's cost of each listed pixel
+  // if set, every person's cost in each criterion, also indexed like cand
+  float *crit[NCRIT];
+  float *likecost;
+  float totals[NCOSTS];
+  float total_like;
+} scorer;
+
+// worst cost of a linear penalty over a layer's full range
+static inline float worst_cost (const float pen, const float ideal, const float lo, const float hi) {
+  return pen * fmaxf(ideal-lo, hi-ideal);
+}
+
+void init_scorer (scorer *sc, const int p, const int mode, float ideal[][15],
+                  float extra_ideal[][MAXEXTRA], float penalty[][NCOSTS], const float *weight, likeset **likes,
+                  route **routes, const int xres, const int yres) {
+  const float degtorad = asinf(1.f) / 90.f;
+  sc->p = p;
+  sc->mode = mode;
+  sc->xres = xres;
+  sc->yres = yres;
+  sc->ideal = ideal;
+  sc->extra_ideal = extra_ideal;
+  sc->penalty = penalty;
+  sc->likes = likes;
+  sc->routes = routes;
+  sc->pcost = (float*)malloc(xres*sizeof(float));
+  sc->mult = (float*)malloc(p*sizeof(float));
+  sc->sinlat = malloc(p*sizeof(*sc->sinlat));
+  sc->coslat = malloc(p*sizeof(*sc->coslat));
+  sc->coslon = malloc(p*sizeof(*sc->coslon));
+  for (int c=0; c<NCRIT; ++c) sc->crit[c] = NULL;
+  sc->likecost = NULL;
+  for (int i=0; i<NCOSTS; ++i) sc->totals[i] = 0.f;
+  sc->total_like = 0.f;
+
+  float wsum = 0.f;
+  for (int ip=0; ip<p; ++ip) wsum += weight[ip];
+  if (wsum <= 0.f) wsum = 1.f;
+
+  for (int ip=0; ip<p; ++ip) {
+    const float *id = ideal[ip];
+    const float *pen = penalty[ip];
+
+    // the worst this person could possibly score
+    float scale = 0.f;
+    if (id[0] > -500.f) scale += worst_cost(pen[C_TEMP], id[0], layer_min[L_TEMPW], layer_min[L_TEMPW]+layer_range[L_TEMPW]);
+    if (id[1] > -500.f) scale += worst_cost(pen[C_TEMP], id[1], layer_min[L_TEMPS], layer_min[L_TEMPS]+layer_range[L_TEMPS]);
+    if (id[2] >= 0.f) scale += worst_cost(pen[C_RAIN], logf(0.1f+id[2]), logf(0.1f+layer_min[L_RAIN]), logf(0.1f+layer_min[L_RAIN]+layer_range[L_RAIN]));
+    for (int l=L_CLOUD; l<=L_MTN; ++l) {
+      if (id[l] >= 0.f) scale += worst_cost(pen[C_CLOUD+(l-L_CLOUD)], id[l], layer_min[l], layer_min[l]+layer_range[l]);
+    }
+    for (int k=0; k<nextra; ++k) {
+      if (extra_ideal[ip][k] > -500.f) scale += pen[C_EXTRA] * extra_worst(k, extra_ideal[ip][k]);
+    }
+    if (id[7] > -500.f) scale += pen[C_DIST] * 3.1416f;
+    if (id[9] > -500.f) scale += pen[C_DIST] * 3.1416f;
+    if (routes && routes[ip]) scale += pen[C_DIST] * 3.1416f;
+    if (likes[ip]) {
+      float vlo[NLAYERS], vhi[NLAYERS], flo[NFEAT], fhi[NFEAT];
+      for (int l=0; l<NLAYERS; ++l) { vlo[l] = layer_min[l]; vhi[l] = layer_min[l]+layer_range[l]; }
+      like_features(vlo, pen, likes[ip]->nfeat, flo);
+      like_features(vhi, pen, likes[ip]->nfeat, fhi);
+      for (int k=0; k<likes[ip]->nfeat; ++k) scale += fabsf(fhi[k]-flo[k]);
+    }
+    if (scale <= 0.f) scale = 1.f;
+
+    switch (mode) {
+      case AGG_WEIGHTED: sc->mult[ip] = weight[ip] / wsum; break;
+      case AGG_NORM:     sc->mult[ip] = weight[ip] / (wsum*scale); break;
+      default:           sc->mult[ip] = 1.f; break;
+    }
+
+    // tables for the distance penalties, the same angles as gcr_dist_px
+    for (int k=0; k<2; ++k) {
+      sc->coslon[ip][k] = NULL;
+      const int islot = (k==0) ? 7 : 9;
+      if (id[islot] < -500.f) continue;
+      int px, py;
+      latlon_to_px(id[islot], id[islot+1], xres, yres, &px, &py);
+      const float lat1 = degtorad * (90.f - 180.f * (0.5f+py) / (float)yres);
+      const float lon1 = -180.f + 360.f * (0.5f+px) / (float)xres;
+      sc->sinlat[ip][k] = sinf(lat1);
+      sc->coslat[ip][k] = cosf(lat1);
+      float *cl = (float*)malloc(xres*sizeof(float));
+      for (int col=0; col<xres; ++col) {
+        const float lon2 = -180.f + 360.f * (0.5f+col) / (float)xres;
+        cl[col] = cosf(degtorad*(lon2-lon1));
+      }
+      sc->coslon[ip][k] = cl;
+    }
+  }
+
+  // every pixel's unit vector, for measuring how far it is from a route
+  sc->coscol = sc->sincol = NULL;
+  for (int ip=0; ip<p; ++ip) {
+    if (routes == NULL || routes[ip] == NULL || sc->coscol) continue;
+    sc->coscol = (float*)malloc(xres*sizeof(float));
+    sc->sincol = (float*)malloc(xres*sizeof(float));
+    for (int col=0; col<xres; ++col) {
+      const float lon = -180.f + 360.f * (0.5f+col) / (float)xres;
+      sc->coscol[col] = cosf(degtorad*lon);
+      sc->sincol[col] = sinf(degtorad*lon);
+    }
+  }
+}
+
+/*
+ * the built-in layers are scored in one fused pass over the listed
+ * pixels; the shape of a query (which criteria are set, and whether
+ * each criterion's cost is kept) is a constant in the common shapes, so
+ * each gets its own copy with everything else folded away, and any
+ * other shape runs the same code with it tested per pixel
+ */
+enum { K_TEMPW = 1, K_TEMPS = 2, K_RAIN = 4, K_CLOUD = 8, K_WIND = 16, K_HDI = 32, K_MTN = 64, K_CRIT = 128,
+       K_ADD = 256 };	// add to the pixels' costs instead of starting them
+
+static inline int builtin_shape (const float *ideal, const int keepcrit) {
+  int shape = keepcrit ? K_CRIT : 0;
+  if (ideal[0] > -500.f) shape |= K_TEMPW;
+  if (ideal[1] > -500.f) shape |= K_TEMPS;
+  if (ideal[2] >= 0.f) shape |= K_RAIN;
+  for (int l=L_CLOUD; l<=L_MTN; ++l) {
+    if (ideal[l] >= 0.f) shape |= K_CLOUD << (l-L_CLOUD);
+  }
+  return shape;
+}
+
+static inline __attribute__((always_inline))
+void fused_row (const int shape, float **vals, const int *cand, const int ncand,
+                const float *ideal, const float *penalty, const float m,
+                float *restrict pc, float **crit, float *totals) {
+  // none of the rows overlap, which lets the pass vectorize
+  const float *restrict tempw = vals[L_TEMPW], *restrict temps = vals[L_TEMPS], *restrict rain = vals[L_RAIN];
+  const float *restrict cloud = vals[L_CLOUD], *restrict wind = vals[L_WIND];
+  const float *restrict hdi = vals[L_HDI], *restrict mtn = vals[L_MTN];
+  const float tw = ideal[0], ts = ideal[1], rn = 0.1f+ideal[2];
+  const float cl = ideal[L_CLOUD], wn = ideal[L_WIND], hd = ideal[L_HDI], mt = ideal[L_MTN];
+  const float ptemp = penalty[C_TEMP], prain = penalty[C_RAIN];
+  const float pcloud = penalty[C_CLOUD], pwind = penalty[C_WIND], phdi = penalty[C_HDI], pmtn = penalty[C_MTN];
+  float *restrict ctemp = crit[C_TEMP], *restrict crain = crit[C_RAIN];
+  float *restrict ccloud = crit[C_CLOUD], *restrict cwind = crit[C_WIND];
+  float *restrict chdi = crit[C_HDI], *restrict cmtn = crit[C_MTN];
+  float ttw = 0.f, tts = 0.f, trn = 0.f, tcl = 0.f, twn = 0.f, thd = 0.f, tmt = 0.f;
+  for (int i=0; i<ncand; ++i) {
+    const int c = cand[i];
+    float cost = 0.f;
+    if (shape & K_TEMPW) {
+      const float v = ptemp * fabsf(tempw[c]-tw);
+      cost += v;
+      ttw += v;
+      if (shape & K_CRIT) ctemp[i] += m*v;
+    }
+    if (shape & K_TEMPS) {
+      const float v = ptemp * fabsf(temps[c]-ts);
+      cost += v;
+      tts += v;
+      if (shape & K_CRIT) ctemp[i] += m*v;
+    }
+    if (shape & K_RAIN) {
+      const float v = prain * fabsf(logf((0.1f+rain[c])/rn));
+      cost += v;
+      trn += v;
+      if (shape & K_CRIT) crain[i] += m*v;
+    }
+    if (shape & K_CLOUD) {
+      const float v = pcloud * fabsf(cloud[c]-cl);
+      cost += v;
+      tcl += v;
+      if (shape & K_CRIT) ccloud[i] += m*v;
+    }
+    if (shape & K_WIND) {
+      const float v = pwind * fabsf(wind[c]-wn);
+      cost += v;
+      twn += v;
+      if (shape & K_CRIT) cwind[i] += m*v;
+    }
+    if (shape & K_HDI) {
+      const float v = phdi * fabsf(hdi[c]-hd);
+      cost += v;
+      thd += v;
+      if (shape & K_CRIT) chdi[i] += m*v;
+    }
+    if (shape & K_MTN) {
+      const float v = pmtn * fabsf(mtn[c]-mt);
+      cost += v;
+      tmt += v;
+      if (shape & K_CRIT) cmtn[i] += m*v;
+    }
+    if (shape & K_ADD) pc[i] += cost;
+    else pc[i] = cost;
+  }
+  totals[C_TEMP] += ttw;
+  totals[C_TEMP] += tts;
+  totals[C_RAIN] += trn;
+  totals[C_CLOUD] += tcl;
+  totals[C_WIND] += twn;
+  totals[C_HDI] += thd;
+  totals[C_MTN] += tmt;
+}
+
+// the shapes of most queries: the temperatures, maybe of one month, with
+// or without the rain, and then the rest of the climate
+#define K_TEMPS2 (K_TEMPW|K_TEMPS)
+#define K_CLIMATE (K_TEMPW|K_TEMPS|K_RAIN|K_CLOUD|K_WIND)
+
+// any other shape is one pass per criterion
+static inline __attribute__((always_inline))
+void builtin_passes (const int shape, const int keep, float **vals, const int *cand, const int ncand,
+                     const float *ideal, const float *penalty, const float m,
+                     float *pc, float **crit, float *totals) {
+  memset(pc, 0, ncand*sizeof(float));
+  if (shape & K_TEMPW) fused_row(keep|K_ADD|K_TEMPW, vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+  if (shape & K_TEMPS) fused_row(keep|K_ADD|K_TEMPS, vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+  if (shape & K_RAIN)  fused_row(keep|K_ADD|K_RAIN,  vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+  if (shape & K_CLOUD) fused_row(keep|K_ADD|K_CLOUD, vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+  if (shape & K_WIND)  fused_row(keep|K_ADD|K_WIND,  vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+  if (shape & K_HDI)   fused_row(keep|K_ADD|K_HDI,   vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+  if (shape & K_MTN)   fused_row(keep|K_ADD|K_MTN,   vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+}
+
+static void score_builtin (const int shape, float **vals, const int *cand, const int ncand,
+                           const float *ideal, const float *penalty, const float m,
+                           float *pc, float **crit, float *totals) {
+  switch (shape) {
+    case 0:                                    memset(pc, 0, ncand*sizeof(float)); break;
+    case K_TEMPW:                              fused_row(K_TEMPW, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    case K_TEMPW|K_RAIN:                       fused_row(K_TEMPW|K_RAIN, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    case K_TEMPS2:                             fused_row(K_TEMPS2, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    case K_TEMPS2|K_RAIN:                      fused_row(K_TEMPS2|K_RAIN, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    case K_TEMPS2|K_RAIN|K_CLOUD:              fused_row(K_TEMPS2|K_RAIN|K_CLOUD, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    case K_CLIMATE:                            fused_row(K_CLIMATE, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    case K_CLIMATE|K_HDI|K_MTN:                fused_row(K_CLIMATE|K_HDI|K_MTN, vals, cand, ncand, ideal, penalty, m, pc, crit, totals); break;
+    default:
+      if (shape & K_CRIT) builtin_passes(shape, K_CRIT, vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+      else builtin_passes(shape, 0, vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+      break;
+  }
+}
+
+/*
+ * score the listed pixels of one row for every person, and combine
+ *
+ * vals holds this row of each input layer (unused layers may be NULL),
+ * and only the columns in cand are touched, see land_row; each person's
+ * cost is built up in pcost, indexed like cand, then folded into out
+ */
+void score_row (scorer *sc, const int row, float **vals,
+                const int *cand, const int ncand, float *out) {
+
+  const float degtorad = asinf(1.f) / 90.f;
+  const float lat2 = degtorad * (90.f - 180.f * (0.5f+row) / (float)sc->yres);
+  const float sinlat2 = sinf(lat2);
+  const float coslat2 = cosf(lat2);
+  float *pc = sc->pcost;
+  float *totals = sc->totals;
+  float **crit = sc->crit;
+  if (crit[0]) {
+    for (int c=0; c<NCRIT; ++c) memset(crit[c], 0, ncand*sizeof(float));
+  }
+
+  for (int ip=0; ip<sc->p; ++ip) {
+  const float *ideal = sc->ideal[ip];
+  const float *penalty = sc->penalty[ip];
+  const float m = sc->mult[ip];
+
+  // all preferences are now optional, and the built-in layers are
+  // scored together in one pass
+  score_builtin(builtin_shape(ideal, crit[0] != NULL), vals, cand, ncand, ideal, penalty, m, pc, crit, totals);
+
+  // and any extra layers, each with its own cost function and penalty
+  for (int k=0; k<nextra; ++k) {
+    const float ideal_val = sc->extra_ideal[ip][k];
+    if (ideal_val > -500.f) {
+      const float *val = vals[NLAYERS+k];
+      const int fn = layer_defs[extra_def[k]].cost;
+      const float pen = penalty[C_EXTRA] * layer_defs[extra_def[k]].penalty;
+      float *cc = crit[C_EXTRA];
+      float total = 0.f;
+      for (int i=0; i<ncand; ++i) {
+        const float cost = pen * extra_cost(fn, val[cand[i]], ideal_val);
+        pc[i] += cost;
+        total += cost;
+        if (cc) cc[i] += m*cost;
+      }
+      totals[C_EXTRA] += total;
+    }
+  }
+
+  // want close to, so penalize far from; and want far from, so penalize
+  // close to: great circle distance from the dot product of unit vectors
+  for (int k=0; k<2; ++k) {
+    const float *cl = sc->coslon[ip][k];
+    if (cl == NULL) continue;
+    const float a = sc->sinlat[ip][k] * sinlat2;
+    const float b = sc->coslat[ip][k] * coslat2;
+    const float base = (k==0) ? 0.f : 3.1416f;
+    const float sign = (k==0) ? 1.f : -1.f;
+    float *cc = crit[C_DIST];
+    float total = 0.f;
+    for (int i=0; i<ncand; ++i) {
+      const float dp = fminf(1.f, fmaxf(-1.f, a + b*cl[cand[i]]));
+      const float distcost = penalty[C_DIST] * (base + sign*(asinf(1.f) - asinf(dp)));
+      pc[i] += distcost;
+      total += distcost;
+      if (cc) cc[i] += m*distcost;
+    }
+    totals[C_DIST] += total;
+  }
+
+  // and want close to a route, so penalize the distance to its nearest arc
+  if (sc->routes && sc->routes[ip]) {
+    const route *rt = sc->routes[ip];
+    const float nlat = degtorad * (-90.f + 180.f * (0.5f+row) / (float)sc->yres);
+    const float sinlat = sinf(nlat);
+    const float coslat = cosf(nlat);
+    float *cc = crit[C_DIST];
+    float total = 0.f;
+    int seed = 0;
+    for (int i=0; i<ncand; ++i) {
+      const float p[3] = { coslat*sc->coscol[cand[i]], coslat*sc->sincol[cand[i]], sinlat };
+      const float distcost = penalty[C_DIST] * route_angle(rt, p, &seed);
+      pc[i] += distcost;
+      total += distcost;
+      if (cc) cc[i] += m*distcost;
+    }
+    totals[C_DIST] += total;
+  }
+
+  if (sc->likes[ip] && crit[C_LIKE]) {
+    // keep the similarity cost apart, too
+    float *lc = sc->likecost;
+    memset(lc, 0, ncand*sizeof(float));
+    like_row(row, sc->xres, sc->likes[ip], penalty, vals, cand, ncand, lc, &sc->total_like);
+    for (int i=0; i<ncand; ++i) {
+      pc[i] += lc[i];
+      crit[C_LIKE][i] += m*lc[i];
+    }
+  } else if (sc->likes[ip]) {
+    like_row(row, sc->xres, sc->likes[ip], penalty, vals, cand, ncand, pc, &sc->total_like);
+  }
+
+  // fold this person into the combined cost
+  if (sc->mode == AGG_MAX) {
+    for (int i=0; i<ncand; ++i) out[cand[i]] = fmaxf(out[cand[i]], m*pc[i]);
+  } else {
+    for (int i=0; i<ncand; ++i) out[cand[i]] += m*pc[i];
+  }
+
+  }
+}
+
+
+/*
+ * split [0,n) into contiguous chunks, one per thread
+ */
+typedef void (*range_fn)(void *arg, const int lo, const int hi, const int ithread);
+
+typedef struct range_task {
+  range_fn fn;
+  void *arg;
+  int lo, hi, ithread;
+} range_task;
+
+static void* run_range_task (void *arg) {
+  range_task *t = (range_task *)arg;
+  t->fn(t->arg, t->lo, t->hi, t->ithread);
+  return NULL;
+}
+
+void parallel_for (const int nthreads, const int n, range_fn fn, void *arg) {
+  if (nthreads < 2 || n < nthreads) {
+    fn(arg, 0, n, 0);
+    return;
+  }
+  pthread_t *th = malloc(nthreads * sizeof(pthread_t));
+  range_task *t = malloc(nthreads * sizeof(range_task));
+  for (int i=0; i<nthreads; ++i) {
+    t[i] = (range_task){ fn, arg, (int)((long)n*i/nthreads), (int)((long)n*(i+1)/nthreads), i };
+    if (i > 0 && pthread_create(&th[i], NULL, run_range_task, &t[i])) {
+      fprintf(stderr,"ERROR: could not start thread %d\n",i);
+      exit(1);
+    }
+  }
+  // the calling thread does the first chunk
+  run_range_task(&t[0]);
+  for (int i=1; i<nthreads; ++i) pthread_join(th[i], NULL);
+  free(th);
+  free(t);
+}
+
+
+
+/*
+ * great-circle distance from every pixel to the nearest water pixel
+ *
+ * the distance is smallest where the dot product of unit vectors
+ *   cos(lat) cos(lat') cos(lon-lon') + sin(lat) sin(lat')
+ * is largest; since cos(lat) cos(lat') >= 0, the best water pixel in
+ * any one source row is simply the one with the smallest longitude
+ * difference (with wrap-around), whatever the target's latitude, so
+ * first we find that for every row with two sweeps along it
+ *
+ * then for each column every source row is a point
+ *   (cos(lat') cos(dlon), sin(lat'))
+ * and the target at latitude lat wants the point furthest along the
+ * direction (cos(lat), sin(lat)); that is always on the right half of
+ * the convex hull of the points, and as lat rises from south to north
+ * the answer only moves up the hull, so all rows of a column take
+ * linear time too, and the whole transform is exact and O(N)
+ */
+#define WATER_BLOCK 64
+#define WATER_RANGE 5000.f	// km, for the 16-bit output
+
+typedef struct water_job {
+  int xres, yres;
+  float **grid;		// in: columns to nearest water in the row, or -1 if none
+			// out: distance in km
+  const double *sinlat, *coslat, *cosdlon;
+} water_job;
+
+static void water_columns (void *arg, const int lo, const int hi, const int ithread) {
+  water_job *wj = (water_job *)arg;
+  const int yres = wj->yres;
+  float *buf = malloc((long)yres*WATER_BLOCK*sizeof(float));
+  // near water, the distance depends on tiny differences of the dot
+  // product from 1, which needs double precision
+  double *ha = malloc(yres*sizeof(double));
+  double *hb = malloc(yres*sizeof(double));
+  (void)ithread;
+
+  for (int b=lo; b<hi; ++b) {
+    // gather a block of columns so that we stream rows, not columns
+    const int c0 = b*WATER_BLOCK;
+    const int nc = (wj->xres-c0 < WATER_BLOCK) ? wj->xres-c0 : WATER_BLOCK;
+    for (int row=0; row<yres; ++row) {
+      memcpy(buf+(long)row*WATER_BLOCK, wj->grid[row]+c0, nc*sizeof(float));
+    }
+
+    for (int c=0; c<nc; ++c) {
+      // right hull of the points, in order of rising latitude
+      int nh = 0;
+      for (int row=0; row<yres; ++row) {
+        const float g = buf[(long)row*WATER_BLOCK+c];
+        if (g < 0.f) continue;
+        const double a = wj->coslat[row] * wj->cosdlon[(int)g];
+        const double bb = wj->sinlat[row];
+        while (nh >= 2 &&
+               (ha[nh-1]-ha[nh-2])*(bb-hb[nh-1]) - (hb[nh-1]-hb[nh-2])*(a-ha[nh-1]) <= 0.f) --nh;
+        ha[nh] = a;
+        hb[nh] = bb;
+        ++nh;
+      }
+
+      // then walk up the hull as the target moves north
+      int k = 0;
+      for (int row=0; row<yres; ++row) {
+        float dist = 20037.5f;	// half way around, if there's no water at all
+        if (nh > 0) {
+          const double ca = wj->coslat[row];
+          const double sa = wj->sinlat[row];
+          while (k+1 < nh && ca*ha[k+1] + sa*hb[k+1] >= ca*ha[k] + sa*hb[k]) ++k;
+          const double dp = fmin(1.0, fmax(-1.0, ca*ha[k] + sa*hb[k]));
+          dist = 6371.0 * acos(dp);
+        }
+        buf[(long)row*WATER_BLOCK+c] = dist;
+      }
+    }
+
+    for (int row=0; row<yres; ++row) {
+      memcpy(wj->grid[row]+c0, buf+(long)row*WATER_BLOCK, nc*sizeof(float));
+    }
+  }
+  free(buf);
+  free(ha);
+  free(hb);
+}
+
+/*
+ * turn a grid of water flags (>0.5 is water) into distances in km
+ */
+void water_distance (float **grid, const int xres, const int yres) {
+  const double degtorad = asin(1.0) / 90.0;
+
+  // nearest water along each row, in pixels, in both directions and around
+  int *left = malloc(xres*sizeof(int));
+  for (int row=0; row<yres; ++row) {
+    float *g = grid[row];
+    int last = -2*xres;
+    // find the last water pixel, so the sweep can start with wrap-around
+    for (int col=xres-1; col>=0 && last==-2*xres; --col) if (g[col] > 0.5f) last = col - xres;
+    if (last == -2*xres) {
+      // no water in this row
+      for (int col=0; col<xres; ++col) g[col] = -1.f;
+      continue;
+    }
+    for (int col=0; col<xres; ++col) {
+      if (g[col] > 0.5f) last = col;
+      left[col] = col - last;
+    }
+    int next = -1;
+    for (int col=0; col<xres && next<0; ++col) if (g[col] > 0.5f) next = col + xres;
+    for (int col=xres-1; col>=0; --col) {
+      if (g[col] > 0.5f) next = col;
+      const int d = (next-col < left[col]) ? next-col : left[col];
+      g[col] = d;
+    }
+  }
+  free(left);
+
+  water_job wj;
+  wj.xres = xres;
+  wj.yres = yres;
+  wj.grid = grid;
+  double *sinlat = malloc(yres*sizeof(double));
+  double *coslat = malloc(yres*sizeof(double));
+  for (int row=0; row<yres; ++row) {
+    const double lat = degtorad * (-90.0 + 180.0 * (0.5+row) / (double)yres);
+    sinlat[row] = sin(lat);
+    coslat[row] = cos(lat);
+  }
+  double *cosdlon = malloc((xres/2+1)*sizeof(double));
+  for (int d=0; d<=xres/2; ++d) cosdlon[d] = cos(degtorad * 360.0 * d / xres);
+  wj.sinlat = sinlat;
+  wj.coslat = coslat;
+  wj.cosdlon = cosdlon;
+  parallel_for(nthreads, (xres+WATER_BLOCK-1)/WATER_BLOCK, water_columns, &wj);
+  free(sinlat);
+  free(coslat);
+  free(cosdlon);
+}
+
+
+/*
+ * neighborhood filters: the max or mean of a layer over the lat-lon box
+ * reaching R km north, south, east, and west of every pixel; the box
+ * widens in longitude towards the poles and wraps around
+ *
+ * the vertical pass goes first, so that each target row can then use
+ * its own width in the horizontal pass, and both passes take constant
+ * time per pixel whatever the radius: the max with the van Herk/Gil-Werman
+ * algorithm, and the mean with running sums
+ */
+enum { FILTER_MAX, FILTER_MEAN };
+
+#define FILTER_BLOCK 64
+
+// windowed max or mean with radius h of x[0..n), out-of-range is skipped
+static void filter_1d (const int type, const float *x, const int n, const int h,
+                       const int wrap, float *out, float *scratch) {
+  if (wrap && 2*h+1 >= n) {
+    // the window is the whole row
+    float v = (type == FILTER_MAX) ? -9.9e+9 : 0.f;
+    double sum = 0.0;
+    for (int i=0; i<n; ++i) {
+      if (type == FILTER_MAX) v = fmaxf(v, x[i]);
+      else sum += x[i];
+    }
+    if (type == FILTER_MEAN) v = sum / n;
+    for (int i=0; i<n; ++i) out[i] = v;
+    return;
+  }
+
+  const int len = n + 2*h;
+  float *p = scratch;	// x, padded by h on both ends
+  for (int j=0; j<len; ++j) {
+    const int i = j-h;
+    if (i >= 0 && i < n) p[j] = x[i];
+    else if (wrap) p[j] = x[(i+n)%n];
+    else p[j] = (type == FILTER_MAX) ? -9.9e+9 : 0.f;
+  }
+
+  if (type == FILTER_MAX) {
+    // prefix max from the start of each block of w, and suffix max to its end
+    const int w = 2*h+1;
+    float *g = scratch + len;
+    float *s = scratch + 2*len;
+    for (int j=0; j<len; ++j) g[j] = (j%w == 0) ? p[j] : fmaxf(g[j-1], p[j]);
+    for (int j=len-1; j>=0; --j) s[j] = (j%w == w-1 || j == len-1) ? p[j] : fmaxf(s[j+1], p[j]);
+    // any window of w spans at most two blocks
+    for (int i=0; i<n; ++i) out[i] = fmaxf(s[i], g[i+2*h]);
+  } else {
+    double sum = 0.0;
+    for (int j=0; j<2*h; ++j) sum += p[j];
+    for (int i=0; i<n; ++i) {
+      sum += p[i+2*h];
+      // near the poles, only count the rows that exist
+      const int cnt = wrap ? 2*h+1 : ((i+h < n) ? i+h : n-1) - ((i-h > 0) ? i-h : 0) + 1;
+      out[i] = sum / cnt;
+      sum -= p[i];
+    }
+  }
+}
+
+typedef struct filter_job {
+  int type, xres, yres, hrow;
+  const int *hcol;	// horizontal radius of each row, in pixels
+  float **grid;
+} filter_job;
+
+static void filter_columns (void *arg, const int lo, const int hi, const int ithread) {
+  filter_job *fj = (filter_job *)arg;
+  const int yres = fj->yres;
+  float *col = malloc(2*yres*sizeof(float));
+  float *buf = malloc((long)yres*FILTER_BLOCK*sizeof(float));
+  float *scratch = malloc(3*(yres+2*fj->hrow)*sizeof(float));
+  (void)ithread;
+  for (int b=lo; b<hi; ++b) {
+    const int c0 = b*FILTER_BLOCK;
+    const int nc = (fj->xres-c0 < FILTER_BLOCK) ? fj->xres-c0 : FILTER_BLOCK;
+    for (int row=0; row<yres; ++row) {
+      memcpy(buf+(long)row*FILTER_BLOCK, fj->grid[row]+c0, nc*sizeof(float));
+    }
+    for (int c=0; c<nc; ++c) {
+      for (int row=0; row<yres; ++row) col[row] = buf[(long)row*FILTER_BLOCK+c];
+      filter_1d(fj->type, col, yres, fj->hrow, FALSE, col+yres, scratch);
+      for (int row=0; row<yres; ++row) buf[(long)row*FILTER_BLOCK+c] = col[yres+row];
+    }
+    for (int row=0; row<yres; ++row) {
+      memcpy(fj->grid[row]+c0, buf+(long)row*FILTER_BLOCK, nc*sizeof(float));
+    }
+  }
+  free(col);
+  free(buf);
+  free(scratch);
+}
+
+static void filter_rows (void *arg, const int lo, const int hi, const int ithread) {
+  filter_job *fj = (filter_job *)arg;
+  const int xres = fj->xres;
+  float *row = malloc(xres*sizeof(float));
+  float *scratch = malloc(3*3*xres*sizeof(float));
+  (void)ithread;
+  for (int r=lo; r<hi; ++r) {
+    memcpy(row, fj->grid[r], xres*sizeof(float));
+    // radii of more than a row's width were handled as the whole row
+    const int h = (fj->hcol[r] < xres) ? fj->hcol[r] : xres;
+    filter_1d(fj->type, row, xres, h, TRUE, fj->grid[r], scratch);
+  }
+  free(row);
+  free(scratch);
+}
+
+// horizontal radius of km at a row of the global grid, in pixels
+static int filter_hcol (const int row, const int xres, const int yres, const float km) {
+  const float degtorad = asinf(1.f) / 90.f;
+  const float lat = -90.f + 180.f * (0.5f+row) / (float)yres;
+  const float kmpercol = 6371.f * degtorad * cosf(degtorad*lat) * 360.f / xres;
+  return (km < kmpercol*xres) ? (int)(0.5f + km / kmpercol) : xres;
+}
+
+// vertical radius of km, in rows
+static int filter_hrow (const int yres, const float km) {
+  const float degtorad = asinf(1.f) / 90.f;
+  return (int)(0.5f + km / (6371.f * degtorad * 180.f / yres));
+}
+
+/*
+ * replace a grid with its max or mean within radius km, in place; the
+ * grid is nrows rows of the global grid of yres, starting at row0, and
+ * the results within the radius of a cut edge are only approximate
+ */
+void neighborhood_filter (float **grid, const int xres, const int nrows, const int row0, const int yres,
+                          const int type, const float km) {
+  filter_job fj;
+  fj.type = type;
+  fj.xres = xres;
+  fj.yres = nrows;
+  fj.grid = grid;
+  fj.hrow = filter_hrow(yres, km);
+  int *hcol = malloc(nrows*sizeof(int));
+  for (int row=0; row<nrows; ++row) hcol[row] = filter_hcol(row0+row, xres, yres, km);
+  fj.hcol = hcol;
+  printf("  radius of %g km is %d rows, and %d to %d columns\n", km, fj.hrow,
+         filter_hcol(yres/2, xres, yres, km), filter_hcol(0, xres, yres, km));
+  parallel_for(nthreads, (xres+FILTER_BLOCK-1)/FILTER_BLOCK, filter_columns, &fj);
+  parallel_for(nthreads, nrows, filter_rows, &fj);
+  free(hcol);
+}
+
+/*
+ * replace every land pixel's cost with the average cost of the land
+ * within km, so that a lone good pixel among bad ones no longer beats
+ * the middle of a good region; more passes of the box approach a
+ * Gaussian, and three boxes of half-width km have a std dev of km
+ */
+void smooth_costs (float **out, const int xres, const int nrows, const int row0, const int yres,
+                   const float km, const int passes) {
+  float** sum = allocate_2d_array_f(nrows,xres);
+  float** wgt = allocate_2d_array_f(nrows,xres);
+  for (int row=0; row<nrows; ++row) {
+    for (int col=0; col<xres; ++col) {
+      // ocean and excluded pixels are negative, and don't count
+      const int land = (out[row][col] >= 0.f);
+      sum[row][col] = land ? out[row][col] : 0.f;
+      wgt[row][col] = land ? 1.f : 0.f;
+    }
+  }
+  for (int pass=0; pass<passes; ++pass) {
+    neighborhood_filter(sum, xres, nrows, row0, yres, FILTER_MEAN, km);
+    neighborhood_filter(wgt, xres, nrows, row0, yres, FILTER_MEAN, km);
+  }
+  for (int row=0; row<nrows; ++row) {
+    for (int col=0; col<xres; ++col) {
+      if (out[row][col] >= 0.f) out[row][col] = sum[row][col] / wgt[row][col];
+    }
+  }
+  free_2d_array_f(sum);
+  free_2d_array_f(wgt);
+}
+
+/*
+ * climate zones: land pixels clustered in the weighted feature space
+ * of like_features, with the range of every input file in each zone,
+ * so that a query can bound the cost of a whole zone at once
+ */
+#define ZONE_OCEAN 65535
+#define MAXZONEFILES 32
+
+typedef struct zoneset {
+  int xres, yres, nzones, nfiles;
+  char name[MAXZONEFILES][32];
+  int *rowmin, *rowmax, *count;
+  float *fmin, *fmax, *fmean;	// [nfiles][nzones]
+  unsigned short *zone;		// [row*xres+col], ZONE_OCEAN if not land
+  // per-query results of prune_zones
+  char *keep;
+  float *fill;
+} zoneset;
+
+// every input file that some query could use, so zones work with -m too
+int zone_file_list (char name[][32]) {
+  int n = 0;
+  for (int imonth=0; imonth<=12; ++imonth) {
+    for (int l=0; l<NLAYERS; ++l) {
+      char f[255];
+      layer_file(l, imonth, f, sizeof(f));
+      if (strlen(f) > 31) {
+        fprintf(stderr,"Zone files hold layer file names of up to 31 characters, not %s\n",f);
+        exit(0);
+      }
+      int found = FALSE;
+      for (int i=0; i<n; ++i) if (strcmp(name[i], f) == 0) found = TRUE;
+      if (!found) strcpy(name[n++], f);
+    }
+  }
+  return n;
+}
+
+int zone_file_index (const zoneset *zs, const char *f) {
+  for (int i=0; i<zs->nfiles; ++i) if (strcmp(zs->name[i], f) == 0) return i;
+  fprintf(stderr,"ERROR: zone file has no bounds for %s\n",f);
+  exit(1);
+}
+
+// small, fast, and repeatable
+static unsigned int zone_rand (unsigned int *state) {
+  unsigned int x = *state;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return (*state = x);
+}
+
+static inline float feat_dist (const float *a, const float *b, const int nf) {
+  float d = 0.f;
+  for (int k=0; k<nf; ++k) d += (a[k]-b[k])*(a[k]-b[k]);
+  return sqrtf(d);
+}
+
+typedef struct kmeans {
+  int nf, k;
+  float *c;		// [k][nf] centroids
+  float *cc;		// [k][k] distances between centroids
+  int *nbr;		// [k][k] centroids in order of distance from each one
+  // the points being assigned
+  int n;
+  const float *x;	// [n][nf]
+  int *assign;
+  // per-thread partial sums for the update
+  double *sum;		// [nthreads][k][nf]
+  int *cnt;		// [nthreads][k]
+  int changed;
+  pthread_mutex_t lock;
+} kmeans;
+
+static kmeans *kd_sort_km;
+static int kd_sort_from;
+static int kmeans_nbr_compare (const void *a, const void *b) {
+  const float *d = kd_sort_km->cc + (long)kd_sort_from*kd_sort_km->k;
+  const float da = d[*(const int *)a];
+  const float db = d[*(const int *)b];
+  return (da > db) - (da < db);
+}
+
+// centroid distances and sorted neighbor lists, for pruning assignments
+static void kmeans_neighbors (kmeans *km) {
+  const int k = km->k;
+  for (int i=0; i<k; ++i) {
+    for (int j=0; j<k; ++j) km->cc[(long)i*k+j] = feat_dist(km->c+i*km->nf, km->c+j*km->nf, km->nf);
+  }
+  kd_sort_km = km;
+  for (int i=0; i<k; ++i) {
+    int *nb = km->nbr + (long)i*k;
+    for (int j=0; j<k; ++j) nb[j] = j;
+    kd_sort_from = i;
+    qsort(nb, k, sizeof(int), kmeans_nbr_compare);
+  }
+}
+
+/*
+ * nearest centroid to x, starting from a good guess: any centroid c with
+ * d(guess,c) >= 2 d(x,guess) cannot be closer, so we stop there
+ */
+static inline int kmeans_nearest (const kmeans *km, const float *x, const int guess) {
+  const int k = km->k;
+  const float d0 = feat_dist(x, km->c+guess*km->nf, km->nf);
+  const float *cc = km->cc + (long)guess*k;
+  const int *nb = km->nbr + (long)guess*k;
+  float bestd = d0;
+  int best = guess;
+  for (int j=1; j<k; ++j) {
+    const int c = nb[j];
+    if (cc[c] >= 2.f*d0) break;
+    const float d = feat_dist(x, km->c+c*km->nf, km->nf);
+    if (d < bestd) { bestd = d; best = c; }
+  }
+  return best;
+}
+
+static void kmeans_assign_range (void *arg, const int lo, const int hi, const int ithread) {
+  kmeans *km = (kmeans *)arg;
+  const int nf = km->nf;
+  double *sum = km->sum + (long)ithread*km->k*nf;
+  int *cnt = km->cnt + (long)ithread*km->k;
+  memset(sum, 0, km->k*nf*sizeof(double));
+  memset(cnt, 0, km->k*sizeof(int));
+  int changed = 0;
+  for (int i=lo; i<hi; ++i) {
+    const float *x = km->x + (long)i*nf;
+    // last iteration's answer is usually right, and neighbors agree too
+    const int guess = (km->assign[i] >= 0) ? km->assign[i] : ((i > lo) ? km->assign[i-1] : 0);
+    const int c = kmeans_nearest(km, x, guess);
+    if (c != km->assign[i]) ++changed;
+    km->assign[i] = c;
+    for (int f=0; f<nf; ++f) sum[c*nf+f] += x[f];
+    cnt[c]++;
+  }
+  pthread_mutex_lock(&km->lock);
+  km->changed += changed;
+  pthread_mutex_unlock(&km->lock);
+}
+
+/*
+ * cluster n points into k zones, Lloyd's iterations from a k-means++ start
+ */
+void run_kmeans (kmeans *km, const int maxiter) {
+  const int n = km->n, k = km->k, nf = km->nf;
+  unsigned int seed = 2463534242u;
+
+  // k-means++ seeding: each new centroid is drawn with probability d^2
+  float *d2 = malloc(n * sizeof(float));
+  int first = zone_rand(&seed) % n;
+  memcpy(km->c, km->x+(long)first*nf, nf*sizeof(float));
+  for (int i=0; i<n; ++i) {
+    const float d = feat_dist(km->x+(long)i*nf, km->c, nf);
+    d2[i] = d*d;
+  }
+  for (int c=1; c<k; ++c) {
+    double total = 0.0;
+    for (int i=0; i<n; ++i) total += d2[i];
+    double pick = total * (zone_rand(&seed) / 4294967296.0);
+    int chosen = n-1;
+    for (int i=0; i<n; ++i) {
+      pick -= d2[i];
+      if (pick <= 0.0) { chosen = i; break; }
+    }
+    memcpy(km->c+c*nf, km->x+(long)chosen*nf, nf*sizeof(float));
+    for (int i=0; i<n; ++i) {
+      const float d = feat_dist(km->x+(long)i*nf, km->c+c*nf, nf);
+      if (d*d < d2[i]) d2[i] = d*d;
+    }
+  }
+  free(d2);
+
+  for (int i=0; i<n; ++i) km->assign[i] = -1;
+  for (int iter=0; iter<maxiter; ++iter) {
+    kmeans_neighbors(km);
+    km->changed = 0;
+    parallel_for(nthreads, n, kmeans_assign_range, km);
+
+    // merge the per-thread sums into new centroids
+    for (int c=0; c<k; ++c) {
+      double s[NFEAT] = {0.0};
+      int count = 0;
+      for (int t=0; t<nthreads; ++t) {
+        for (int f=0; f<nf; ++f) s[f] += km->sum[((long)t*k+c)*nf+f];
+        count += km->cnt[(long)t*k+c];
+      }
+      if (count > 0) {
+        for (int f=0; f<nf; ++f) km->c[c*nf+f] = s[f]/count;
+      } else {
+        // restart an empty zone on a random point
+        memcpy(km->c+c*nf, km->x+(long)(zone_rand(&seed)%n)*nf, nf*sizeof(float));
+      }
+    }
+    printf("  k-means iteration %d, %d of %d points changed zones\n", iter+1, km->changed, n);
+    if (km->changed < n/1000) break;
+  }
+  kmeans_neighbors(km);
+}
+
+static void kmeans_init (kmeans *km, const int k, const int nf, const int n, const float *x) {
+  km->k = k;
+  km->nf = nf;
+  km->n = n;
+  km->x = x;
+  km->c = malloc((long)k*nf*sizeof(float));
+  km->cc = malloc((long)k*k*sizeof(float));
+  km->nbr = malloc((long)k*k*sizeof(int));
+  km->assign = malloc(n*sizeof(int));
+  km->sum = malloc((long)nthreads*k*nf*sizeof(double));
+  km->cnt = malloc((long)nthreads*k*sizeof(int));
+  pthread_mutex_init(&km->lock, NULL);
+}
+
+static void kmeans_free (kmeans *km) {
+  free(km->c); free(km->cc); free(km->nbr); free(km->assign);
+  free(km->sum); free(km->cnt);
+  pthread_mutex_destroy(&km->lock);
+}
+
+/*
+ * cluster the land pixels of the (annual) layers into nzones zones,
+ * then tally the range of every input file within every zone
+ */
+zoneset* build_zones (const int nzones, float ***layer, const float *penalty,
+                      const int xres, const int yres) {
+
+  zoneset *zs = (zoneset *)calloc(1, sizeof(zoneset));
+  zs->xres = xres;
+  zs->yres = yres;
+  zs->nzones = nzones;
+  zs->nfiles = zone_file_list(zs->name);
+
+  // weighted features of every land pixel, row-major order
+  const int nf = 7;
+  int npix = 0;
+  for (int row=0; row<yres; ++row) {
+    for (int col=0; col<xres; ++col) if (layer[L_TEMPW][row][col] > -29.9f) ++npix;
+  }
+  if (npix < nzones) {
+    fprintf(stderr,"ERROR: only %d land pixels, cannot make %d zones\n",npix,nzones);
+    exit(1);
+  }
+  float *x = malloc((long)npix*nf*sizeof(float));
+  int *pix = malloc(npix*sizeof(int));
+  npix = 0;
+  for (int row=0; row<yres; ++row) {
+    for (int col=0; col<xres; ++col) {
+      if (layer[L_TEMPW][row][col] > -29.9f) {
+        float v[NLAYERS];
+        for (int l=0; l<NLAYERS; ++l) v[l] = layer[l][row][col];
+        like_features(v, penalty, nf, x+(long)npix*nf);
+        pix[npix++] = row*xres+col;
+      }
+    }
+  }
+
+  // train on an evenly-spaced sample, it's plenty
+  const int nsamp = (npix < 100*nzones) ? npix : 100*nzones;
+  float *xs = malloc((long)nsamp*nf*sizeof(float));
+  for (int i=0; i<nsamp; ++i) {
+    memcpy(xs+(long)i*nf, x+((long)i*npix/nsamp)*nf, nf*sizeof(float));
+  }
+  printf("Clustering %d land pixels into %d zones, training on %d\n", npix, nzones, nsamp);
+  kmeans km;
+  kmeans_init(&km, nzones, nf, nsamp, xs);
+  run_kmeans(&km, 30);
+  float *trained = km.c;
+  km.c = NULL;
+  kmeans_free(&km);
+  free(xs);
+
+  // then one pass to put every pixel in its zone
+  kmeans_init(&km, nzones, nf, npix, x);
+  memcpy(km.c, trained, (long)nzones*nf*sizeof(float));
+  free(trained);
+  kmeans_neighbors(&km);
+  for (int i=0; i<npix; ++i) km.assign[i] = -1;
+  parallel_for(nthreads, npix, kmeans_assign_range, &km);
+
+  zs->zone = malloc((long)xres*yres*sizeof(unsigned short));
+  for (long i=0; i<(long)xres*yres; ++i) zs->zone[i] = ZONE_OCEAN;
+  zs->rowmin = malloc(nzones*sizeof(int));
+  zs->rowmax = malloc(nzones*sizeof(int));
+  zs->count = calloc(nzones, sizeof(int));
+  for (int z=0; z<nzones; ++z) { zs->rowmin[z] = yres; zs->rowmax[z] = -1; }
+  for (int i=0; i<npix; ++i) {
+    const int z = km.assign[i];
+    const int row = pix[i] / xres;
+    zs->zone[pix[i]] = z;
+    zs->count[z]++;
+    if (row < zs->rowmin[z]) zs->rowmin[z] = row;
+    if (row > zs->rowmax[z]) zs->rowmax[z] = row;
+  }
+  kmeans_free(&km);
+  free(x);
+  free(pix);
+
+  // now the range of every input within every zone
+  const long nzf = (long)zs->nfiles*nzones;
+  zs->fmin = malloc(nzf*sizeof(float));
+  zs->fmax = malloc(nzf*sizeof(float));
+  zs->fmean = malloc(nzf*sizeof(float));
+  double *sum = malloc(nzones*sizeof(double));
+  for (int fi=0; fi<zs->nfiles; ++fi) {
+    // find this file's layer to get its value range
+    int il = -1;
+    float** grid = NULL;
+    for (int l=0; l<NLAYERS && il<0; ++l) {
+      for (int imonth=0; imonth<=12 && il<0; ++imonth) {
+        char f[255];
+        layer_file(l, imonth, f, sizeof(f));
+        if (strcmp(f, zs->name[fi]) == 0) {
+          il = l;
+          // the annual layers are already in memory
+          if (imonth == 0 || l > L_RAIN) grid = layer[l];
+        }
+      }
+    }
+    float** scratch = NULL;
+    if (grid == NULL) {
+      scratch = read_layer_grid(zs->name[fi],xres,yres,layer_min[il],layer_range[il]);
+      grid = scratch;
+    }
+    float *fmin = zs->fmin + (long)fi*nzones;
+    float *fmax = zs->fmax + (long)fi*nzones;
+    for (int z=0; z<nzones; ++z) { fmin[z] = 9.9e+9; fmax[z] = -9.9e+9; sum[z] = 0.0; }
+    for (int row=0; row<yres; ++row) {
+      for (int col=0; col<xres; ++col) {
+        const int z = zs->zone[row*xres+col];
+        if (z == ZONE_OCEAN) continue;
+        const float v = grid[row][col];
+        if (v < fmin[z]) fmin[z] = v;
+        if (v > fmax[z]) fmax[z] = v;
+        sum[z] += v;
+      }
+    }
+    for (int z=0; z<nzones; ++z) zs->fmean[(long)fi*nzones+z] = zs->count[z] ? sum[z]/zs->count[z] : 0.f;
+    if (scratch) free_2d_array_f(scratch);
+  }
+  free(sum);
+
+  return zs;
+}
+
+int write_zones (const zoneset *zs, char *outfile) {
+  FILE *fp = fopen(outfile,"wb");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",outfile);
+    fflush(stderr);
+    exit(0);
+  }
+  const int hdr[4] = { zs->xres, zs->yres, zs->nzones, zs->nfiles };
+  const long nzf = (long)zs->nfiles*zs->nzones;
+  fwrite("IPZONES1", 1, 8, fp);
+  fwrite(hdr, sizeof(int), 4, fp);
+  fwrite(zs->name, 32, zs->nfiles, fp);
+  fwrite(zs->rowmin, sizeof(int), zs->nzones, fp);
+  fwrite(zs->rowmax, sizeof(int), zs->nzones, fp);
+  fwrite(zs->count, sizeof(int), zs->nzones, fp);
+  fwrite(zs->fmin, sizeof(float), nzf, fp);
+  fwrite(zs->fmax, sizeof(float), nzf, fp);
+  fwrite(zs->fmean, sizeof(float), nzf, fp);
+  fwrite(zs->zone, sizeof(unsigned short), (long)zs->xres*zs->yres, fp);
+  fclose(fp);
+  printf("Wrote %d zones to %s\n", zs->nzones, outfile);
+  return(0);
+}
+
+zoneset* read_zones (char *infile) {
+  FILE *fp = fopen(infile,"rb");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open zone file %s\n",infile);
+    fflush(stderr);
+    exit(0);
+  }
+  char magic[8];
+  int hdr[4];
+  if (fread(magic, 1, 8, fp) != 8 || strncmp(magic, "IPZONES1", 8) != 0 ||
+      fread(hdr, sizeof(int), 4, fp) != 4 || hdr[3] > MAXZONEFILES) {
+    fprintf(stderr,"File %s is not a zone file\n",infile);
+    fflush(stderr);
+    exit(0);
+  }
+  zoneset *zs = (zoneset *)calloc(1, sizeof(zoneset));
+  zs->xres = hdr[0];
+  zs->yres = hdr[1];
+  zs->nzones = hdr[2];
+  zs->nfiles = hdr[3];
+  const long nzf = (long)zs->nfiles*zs->nzones;
+  const long npx = (long)zs->xres*zs->yres;
+  zs->rowmin = malloc(zs->nzones*sizeof(int));
+  zs->rowmax = malloc(zs->nzones*sizeof(int));
+  zs->count = malloc(zs->nzones*sizeof(int));
+  zs->fmin = malloc(nzf*sizeof(float));
+  zs->fmax = malloc(nzf*sizeof(float));
+  zs->fmean = malloc(nzf*sizeof(float));
+  zs->zone = malloc(npx*sizeof(unsigned short));
+  size_t nread = fread(zs->name, 32, zs->nfiles, fp);
+  nread += fread(zs->rowmin, sizeof(int), zs->nzones, fp);
+  nread += fread(zs->rowmax, sizeof(int), zs->nzones, fp);
+  nread += fread(zs->count, sizeof(int), zs->nzones, fp);
+  nread += fread(zs->fmin, sizeof(float), nzf, fp);
+  nread += fread(zs->fmax, sizeof(float), nzf, fp);
+  nread += fread(zs->fmean, sizeof(float), nzf, fp);
+  nread += fread(zs->zone, sizeof(unsigned short), npx, fp);
+  fclose(fp);
+  if (nread != zs->nfiles + 3*zs->nzones + 3*nzf + npx) {
+    fprintf(stderr,"Zone file %s is truncated\n",infile);
+    fflush(stderr);
+    exit(0);
+  }
+  return zs;
+}
+
+// bounds and a typical value for one criterion over a range of layer values
+static inline void linear_bounds (const float pen, const float t, const float a, const float b,
+                                  const float mean, float *lb, float *ub, float *approx) {
+  *lb += pen * ((t < a) ? a-t : ((t > b) ? t-b : 0.f));
+  *ub += pen * fmaxf(fabsf(a-t), fabsf(b-t));
+  *approx += pen * fabsf(mean-t);
+}
+
+/*
+ * bound every zone's cost for this query, and keep only the zones that
+ * could hold a pixel in the best zonecut fraction of the cost range;
+ * the other zones' pixels get a stand-in cost that is never below
+ * their lower bound, so they can never outrank a scored pixel
+ */
+void prune_zones (zoneset *zs, const scorer *sc, const constraints *cs,
+                  const int imonth, const float zonecut) {
+  const int nz = zs->nzones;
+  float *lb = calloc(nz, sizeof(float));
+  float *ub = calloc(nz, sizeof(float));
+  float *approx = calloc(nz, sizeof(float));
+  char *pass = calloc(nz, 1);
+  const float degtorad = asinf(1.f) / 90.f;
+  char f[255];
+
+  // where each layer's bounds are
+  const float *lmin[NLAYERS], *lmax[NLAYERS], *lmean[NLAYERS];
+  for (int l=0; l<NLAYERS; ++l) {
+    layer_file(l, imonth, f, sizeof(f));
+    const long off = (long)zone_file_index(zs, f)*nz;
+    lmin[l] = zs->fmin + off;
+    lmax[l] = zs->fmax + off;
+    lmean[l] = zs->fmean + off;
+  }
+
+  for (int z=0; z<nz; ++z) {
+    if (zs->count[z] == 0) continue;
+
+    // zones that fail a hard constraint everywhere are out, and only
+    // zones that pass them everywhere can vouch for the best cost
+    pass[z] = 2;
+    for (int i=0; i<cs->n; ++i) {
+      const constraint *c = &cs->c[i];
+      const float a = lmin[c->layer][z];
+      const float b = lmax[c->layer][z];
+      if (b < c->lo || a > c->hi) pass[z] = 0;
+      else if (pass[z] == 2 && (a < c->lo || b > c->hi)) pass[z] = 1;
+    }
+
+    for (int ip=0; ip<sc->p; ++ip) {
+      const float *id = sc->ideal[ip];
+      const float *pen = sc->penalty[ip];
+      float pl = 0.f, pu = 0.f, pa = 0.f;
+      if (id[0] > -500.f) linear_bounds(pen[C_TEMP], id[0], lmin[L_TEMPW][z], lmax[L_TEMPW][z], lmean[L_TEMPW][z], &pl, &pu, &pa);
+      if (id[1] > -500.f) linear_bounds(pen[C_TEMP], id[1], lmin[L_TEMPS][z], lmax[L_TEMPS][z], lmean[L_TEMPS][z], &pl, &pu, &pa);
+      if (id[2] >= 0.f) {
+        // rain is penalized on a log scale, which is monotonic
+        const float t = logf(0.1f+id[2]);
+        linear_bounds(pen[C_RAIN], t, logf(0.1f+lmin[L_RAIN][z]), logf(0.1f+lmax[L_RAIN][z]), logf(0.1f+lmean[L_RAIN][z]), &pl, &pu, &pa);
+      }
+      for (int l=L_CLOUD; l<=L_MTN; ++l) {
+        if (id[l] >= 0.f) linear_bounds(pen[C_CLOUD+(l-L_CLOUD)], id[l], lmin[l][z], lmax[l][z], lmean[l][z], &pl, &pu, &pa);
+      }
+      if (id[7] > -500.f) {
+        // no closer than the latitude band that the zone spans
+        const float lat0 = -90.f + 180.f*zs->rowmin[z]/(float)zs->yres;
+        const float lat1 = -90.f + 180.f*(zs->rowmax[z]+1)/(float)zs->yres;
+        const float t = id[7];
+        const float dlat = (t < lat0) ? lat0-t : ((t > lat1) ? t-lat1 : 0.f);
+        pl += pen[C_DIST] * degtorad * dlat;
+        pu += pen[C_DIST] * 3.1416f;
+        pa += pen[C_DIST] * degtorad * dlat;
+      }
+      if (id[9] > -500.f) {
+        pu += pen[C_DIST] * 3.1416f;
+      }
+      if (sc->routes && sc->routes[ip]) {
+        // no closer than the latitude band is to the route's bounding cap
+        const route_cap *cp = &sc->routes[ip]->node[1];
+        const float lat0 = degtorad * (-90.f + 180.f*zs->rowmin[z]/(float)zs->yres);
+        const float lat1 = degtorad * (-90.f + 180.f*(zs->rowmax[z]+1)/(float)zs->yres);
+        const float t = asinf(fminf(1.f, fmaxf(-1.f, cp->c[2])));
+        const float dlat = (t < lat0) ? lat0-t : ((t > lat1) ? t-lat1 : 0.f);
+        pl += pen[C_DIST] * fmaxf(0.f, dlat - cp->r);
+        pu += pen[C_DIST] * 3.1416f;
+        pa += pen[C_DIST] * fmaxf(0.f, dlat - cp->r);
+      }
+      for (int k=0; k<nextra; ++k) {
+        // zones know nothing of extra layers, so assume the worst
+        const float t = sc->extra_ideal[ip][k];
+        if (t > -500.f) pu += pen[C_EXTRA] * extra_worst(k, t);
+      }
+      if (sc->likes[ip]) {
+        // each target's distance to the zone's box in feature space
+        const likeset *ls = sc->likes[ip];
+        float vlo[NLAYERS], vhi[NLAYERS], vmean[NLAYERS], flo[NFEAT], fhi[NFEAT], fmean[NFEAT];
+        for (int l=0; l<NLAYERS; ++l) { vlo[l] = lmin[l][z]; vhi[l] = lmax[l][z]; vmean[l] = lmean[l][z]; }
+        like_features(vlo, pen, ls->nfeat, flo);
+        like_features(vhi, pen, ls->nfeat, fhi);
+        like_features(vmean, pen, ls->nfeat, fmean);
+        float tlb = 9.9e+9, tub = 9.9e+9, tap = 9.9e+9;
+        for (int t=0; t<ls->n; ++t) {
+          float l0 = 0.f, u0 = 0.f, a0 = 0.f;
+          for (int k=0; k<ls->nfeat; ++k) linear_bounds(1.f, ls->feat[k*ls->n+t], flo[k], fhi[k], fmean[k], &l0, &u0, &a0);
+          if (l0 < tlb) tlb = l0;
+          if (u0 < tub) tub = u0;
+          if (a0 < tap) tap = a0;
+        }
+        pl += tlb;
+        pu += tub;
+        pa += tap;
+      }
+      // and fold the person into the zone's bounds, as in score_row
+      const float m = sc->mult[ip];
+      if (sc->mode == AGG_MAX) {
+        lb[z] = fmaxf(lb[z], m*pl);
+        ub[z] = fmaxf(ub[z], m*pu);
+        approx[z] = fmaxf(approx[z], m*pa);
+      } else {
+        lb[z] += m*pl;
+        ub[z] += m*pu;
+        approx[z] += m*pa;
+      }
+    }
+  }
+
+  // the best pixel is no worse than the best zone's upper bound
+  float bestub = 9.9e+9, maxub = -9.9e+9;
+  for (int z=0; z<nz; ++z) {
+    if (zs->count[z] == 0 || pass[z] == 0) continue;
+    if (pass[z] == 2 && ub[z] < bestub) bestub = ub[z];
+    if (ub[z] > maxub) maxub = ub[z];
+  }
+  const float cut = (1.f-zonecut)*bestub + zonecut*maxub;
+
+  if (!zs->keep) zs->keep = malloc(nz);
+  if (!zs->fill) zs->fill = malloc(nz*sizeof(float));
+  int nkeep = 0;
+  long npkeep = 0, nptotal = 0;
+  for (int z=0; z<nz; ++z) {
+    zs->keep[z] = (zs->count[z] > 0 && pass[z] > 0 && lb[z] <= cut);
+    zs->fill[z] = (pass[z] > 0) ? fmaxf(approx[z], lb[z]) : -1.f;
+    nptotal += zs->count[z];
+    if (zs->keep[z]) { ++nkeep; npkeep += zs->count[z]; }
+  }
+  printf("  scoring %d of %d zones (%.1f%% of land pixels)\n", nkeep, nz, 100.0*npkeep/(nptotal>0 ? nptotal : 1));
+  free(lb);
+  free(ub);
+  free(approx);
+  free(pass);
+}
+
+/*
+ * drop the listed pixels whose zones were pruned, giving them their
+ * zone's stand-in cost, and return how many are left to score
+ */
+int zone_row (const zoneset *zs, const int row, int *cand, const int ncand, float *out) {
+  const unsigned short *zone = zs->zone + (long)row*zs->xres;
+  int n = 0;
+  for (int i=0; i<ncand; ++i) {
+    const int col = cand[i];
+    const int z = zone[col];
+    if (z == ZONE_OCEAN || zs->keep[z]) {
+      cand[n++] = col;
+    } else {
+      out[col] = zs->fill[z];
+    }
+  }
+  return n;
+}
+
+/*
+ * color every zone by its average climate, a bit like a Koppen map:
+ * red is summer warmth, green is rain, and blue is winter cold
+ */
+int write_zone_map (const zoneset *zs, char *outfile) {
+  const int nz = zs->nzones;
+  const float *tjan = zs->fmean + (long)zone_file_index(zs, "airtemp_m1.png")*nz;
+  const float *tjul = zs->fmean + (long)zone_file_index(zs, "airtemp_m7.png")*nz;
+  const float *rain = zs->fmean + (long)zone_file_index(zs, "precip_avg.png")*nz;
+  float** red = allocate_2d_array_f(zs->yres,zs->xres);
+  float** grn = allocate_2d_array_f(zs->yres,zs->xres);
+  float** blu = allocate_2d_array_f(zs->yres,zs->xres);
+  for (int row=0; row<zs->yres; ++row) {
+    // on either side of the equator, summer is warmer of the two
+    for (int col=0; col<zs->xres; ++col) {
+      const int z = zs->zone[(long)row*zs->xres+col];
+      if (z == ZONE_OCEAN) {
+        red[row][col] = grn[row][col] = blu[row][col] = 0.f;
+      } else {
+        const float warm = fmaxf(tjan[z], tjul[z]);
+        const float cold = fminf(tjan[z], tjul[z]);
+        red[row][col] = (warm + 10.f) / 45.f;
+        grn[row][col] = logf(1.f+rain[z]) / logf(401.f);
+        blu[row][col] = (10.f - cold) / 45.f;
+      }
+    }
+  }
+  (void)write_png(outfile,zs->xres,zs->yres,TRUE,FALSE, red,0.f,1.f, grn,0.f,1.f, blu,0.f,1.f);
+  free_2d_array_f(red);
+  free_2d_array_f(grn);
+  free_2d_array_f(blu);
+  printf("Wrote zone map to %s\n", outfile);
+  return(0);
+}
+
+
+/*
+ * every scored pixel's cost in each criterion, for the modes that need
+ * to re-weigh or compare the criteria after scoring
+ */
+typedef struct critset {
+  int n, nalloc;
+  int nk;			// the criteria that anyone uses
+  int k[NCRIT];
+  int *row, *col;
+  float *cost[NCRIT];		// [criterion][pixel]
+} critset;
+
+// which criteria anyone uses
+void used_criteria (const int p, float ideal[][15], float extra_ideal[][MAXEXTRA], likeset **likes, route **routes,
+                    int *used) {
+  for (int c=0; c<NCRIT; ++c) used[c] = FALSE;
+  for (int ip=0; ip<p; ++ip) {
+    const float *id = ideal[ip];
+    if (id[0] > -500.f || id[1] > -500.f) used[C_TEMP] = TRUE;
+    if (id[2] >= 0.f) used[C_RAIN] = TRUE;
+    for (int l=L_CLOUD; l<=L_MTN; ++l) if (id[l] >= 0.f) used[C_CLOUD+(l-L_CLOUD)] = TRUE;
+    for (int k=0; k<nextra; ++k) if (extra_ideal[ip][k] > -500.f) used[C_EXTRA] = TRUE;
+    if (id[7] > -500.f || id[9] > -500.f || (routes && routes[ip])) used[C_DIST] = TRUE;
+    if (likes[ip]) used[C_LIKE] = TRUE;
+  }
+}
+
+critset* new_critset (const scorer *sc) {
+  critset *cs = (critset *)calloc(1, sizeof(critset));
+  int used[NCRIT];
+  used_criteria(sc->p, sc->ideal, sc->extra_ideal, sc->likes, sc->routes, used);
+  for (int c=0; c<NCRIT; ++c) if (used[c]) cs->k[cs->nk++] = c;
+  return cs;
+}
+
+// have score_row keep every criterion apart
+void keep_criteria (scorer *sc) {
+  for (int c=0; c<NCRIT; ++c) sc->crit[c] = (float*)malloc(sc->xres*sizeof(float));
+  sc->likecost = (float*)malloc(sc->xres*sizeof(float));
+}
+
+void free_scorer (scorer *sc) {
+  free(sc->pcost);
+  for (int ip=0; ip<sc->p; ++ip) {
+    for (int k=0; k<2; ++k) free(sc->coslon[ip][k]);
+  }
+  free(sc->mult);
+  free(sc->sinlat);
+  free(sc->coslat);
+  free(sc->coslon);
+  free(sc->coscol);
+  free(sc->sincol);
+  for (int c=0; c<NCRIT; ++c) free(sc->crit[c]);
+  free(sc->likecost);
+}
+
+// append the pixels that score_row just scored
+void critset_add_row (critset *cs, const scorer *sc, const int row, const int *cand, const int ncand) {
+  if (cs->n + ncand > cs->nalloc) {
+    cs->nalloc = 2*cs->nalloc + ncand;
+    cs->row = realloc(cs->row, cs->nalloc*sizeof(int));
+    cs->col = realloc(cs->col, cs->nalloc*sizeof(int));
+    for (int kk=0; kk<cs->nk; ++kk) {
+      const int c = cs->k[kk];
+      cs->cost[c] = realloc(cs->cost[c], cs->nalloc*sizeof(float));
+    }
+  }
+  for (int i=0; i<ncand; ++i) {
+    cs->row[cs->n+i] = row;
+    cs->col[cs->n+i] = cand[i];
+  }
+  for (int kk=0; kk<cs->nk; ++kk) {
+    const int c = cs->k[kk];
+    memcpy(cs->cost[c]+cs->n, sc->crit[c], ncand*sizeof(float));
+  }
+  cs->n += ncand;
+}
+
+// index of a pixel in the set, or -1
+int critset_find (const critset *cs, const int row, const int col) {
+  for (int i=0; i<cs->n; ++i) if (cs->row[i] == row && cs->col[i] == col) return i;
+  return -1;
+}
+
+
+/*
+ * weight sensitivity: re-weigh the criteria many random ways, and find
+ * how often each pixel is in the best pct percent and how much its rank
+ * moves around
+ *
+ * each weighting scales every criterion by 2^u, u uniform in -1..1, the
+ * same as anywhere from one - to one + on the command line; a histogram
+ * of a sample of the pixels gives each weighting's cutoff, and its rank
+ * in each of ROBUST_BINS cost bins; then one pass goes over blocks of
+ * pixels, and for each weighting in turn scores the whole block, so that
+ * the block's costs and tallies and that weighting's table all stay in
+ * cache
+ */
+#define ROBUST_SAMPLE 50000
+#define ROBUST_BINS 4096
+#define ROBUST_BLOCK 256
+
+typedef struct robust_job {
+  const critset *cs;
+  int ns;
+  const float *mult;		// [weighting][criterion]
+  const float *cutoff, *lo, *binscale;	// per weighting
+  const float *rank;		// [weighting][bin], as a percentile
+  float *hits, *mean, *spread;	// per pixel
+} robust_job;
+
+static void robust_blocks (void *arg, const int lo, const int hi, const int ithread) {
+  const robust_job *rj = (const robust_job *)arg;
+  const critset *cs = rj->cs;
+  const int nk = cs->nk;
+  float t[ROBUST_BLOCK], nhit[ROBUST_BLOCK], sum[ROBUST_BLOCK], sumsq[ROBUST_BLOCK];
+
+  for (int blk=lo; blk<hi; ++blk) {
+    const int i0 = blk*ROBUST_BLOCK;
+    const int n = (cs->n-i0 < ROBUST_BLOCK) ? cs->n-i0 : ROBUST_BLOCK;
+    for (int i=0; i<n; ++i) nhit[i] = sum[i] = sumsq[i] = 0.f;
+
+    for (int s=0; s<rj->ns; ++s) {
+      // the block's costs under this weighting
+      const float *m = rj->mult + (long)s*nk;
+      for (int i=0; i<n; ++i) t[i] = 0.f;
+      for (int kk=0; kk<nk; ++kk) {
+        const float *c = cs->cost[cs->k[kk]] + i0;
+        const float mk = m[kk];
+        for (int i=0; i<n; ++i) t[i] += mk*c[i];
+      }
+
+      // and where they rank
+      const float cut = rj->cutoff[s];
+      const float tlo = rj->lo[s];
+      const float bs = rj->binscale[s];
+      const float *rank = rj->rank + (long)s*ROBUST_BINS;
+      for (int i=0; i<n; ++i) {
+        nhit[i] += (t[i] <= cut) ? 1.f : 0.f;
+        const int b = (int)fminf(fmaxf((t[i]-tlo)*bs, 0.f), ROBUST_BINS-1);
+        const float r = rank[b];
+        sum[i] += r;
+        sumsq[i] += r*r;
+      }
+    }
+
+    for (int i=0; i<n; ++i) {
+      const float mean = sum[i] / rj->ns;
+      rj->hits[i0+i] = nhit[i] / rj->ns;
+      rj->mean[i0+i] = mean;
+      rj->spread[i0+i] = sqrtf(fmaxf(0.f, sumsq[i]/rj->ns - mean*mean));
+    }
+  }
+}
+
+void robust_weights (const critset *cs, const int ns, const float pct,
+                     float *hits, float *mean, float *spread) {
+  const int nk = cs->nk;
+  float *mult = (float *)malloc((long)ns*nk*sizeof(float));
+  unsigned int state = 2463534242u;
+  for (long j=0; j<(long)ns*nk; ++j) {
+    const float u = 2.f * (zone_rand(&state) / 4294967296.f) - 1.f;
+    mult[j] = exp2f(u);
+  }
+
+  // a compact copy of a sample of the pixels' costs
+  const int nsamp = (cs->n < ROBUST_SAMPLE) ? cs->n : ROBUST_SAMPLE;
+  float *samp = (float *)malloc((long)nsamp*nk*sizeof(float));
+  for (int j=0; j<nsamp; ++j) {
+    const long i = (long)j*cs->n/nsamp;
+    for (int kk=0; kk<nk; ++kk) samp[(long)kk*nsamp+j] = cs->cost[cs->k[kk]][i];
+  }
+
+  // then each weighting's cutoff and rank table, from a histogram of it
+  float *cutoff = (float *)malloc(ns*sizeof(float));
+  float *lo = (float *)malloc(ns*sizeof(float));
+  float *binscale = (float *)malloc(ns*sizeof(float));
+  float *rank = (float *)malloc((long)ns*ROBUST_BINS*sizeof(float));
+  float *t = (float *)malloc(nsamp*sizeof(float));
+  int *count = (int *)malloc(ROBUST_BINS*sizeof(int));
+  for (int s=0; s<ns; ++s) {
+    for (int j=0; j<nsamp; ++j) t[j] = 0.f;
+    for (int kk=0; kk<nk; ++kk) {
+      const float m = mult[(long)s*nk+kk];
+      const float *c = samp + (long)kk*nsamp;
+      for (int j=0; j<nsamp; ++j) t[j] += m*c[j];
+    }
+    float tlo = t[0];
+    float thi = t[0];
+    for (int j=1; j<nsamp; ++j) {
+      tlo = fminf(tlo, t[j]);
+      thi = fmaxf(thi, t[j]);
+    }
+    const float bs = (thi > tlo) ? ROBUST_BINS / (thi-tlo) : 0.f;
+    memset(count, 0, ROBUST_BINS*sizeof(int));
+    for (int j=0; j<nsamp; ++j) {
+      const int b = (int)fminf((t[j]-tlo)*bs, ROBUST_BINS-1);
+      count[b]++;
+    }
+
+    // rank at the middle of each bin, and the cutoff within its bin
+    const float want = 0.01f*pct*nsamp;
+    float *r = rank + (long)s*ROBUST_BINS;
+    cutoff[s] = thi;
+    int below = 0;
+    for (int b=0; b<ROBUST_BINS; ++b) {
+      r[b] = 100.f * (below + 0.5f*count[b]) / nsamp;
+      if (below <= want && below+count[b] > want) {
+        cutoff[s] = tlo + (b + (want-below)/count[b]) / bs;
+      }
+      below += count[b];
+    }
+    lo[s] = tlo;
+    binscale[s] = bs;
+  }
+  free(t);
+  free(samp);
+  free(count);
+
+  robust_job rj = { cs, ns, mult, cutoff, lo, binscale, rank, hits, mean, spread };
+  parallel_for(nthreads, (cs->n+ROBUST_BLOCK-1)/ROBUST_BLOCK, robust_blocks, &rj);
+
+  free(mult);
+  free(cutoff);
+  free(lo);
+  free(binscale);
+  free(rank);
+}
+
+
+/*
+ * the Pareto front, or skyline: the pixels that no other pixel beats in
+ * one criterion while matching it in the rest
+ *
+ * the front can hold a tenth of the land, so rather than compare each
+ * pixel with the front so far, each one asks a k-d tree of all of them
+ * whether anything is no worse in every criterion; every node keeps the
+ * least and most of each criterion below it, so most of the tree is
+ * either skipped (all worse somewhere) or settles it at once (all
+ * better), and leaves are checked a block at a time; the pixels are
+ * independent, so the threads split them up
+ */
+#define PARETO_LEAF 16
+
+// does a beat p?
+static inline int pareto_beats (const float *a, const float *p, const int nk) {
+  int lt = FALSE;
+  for (int kk=0; kk<nk; ++kk) {
+    if (a[kk] > p[kk]) return FALSE;
+    lt |= (a[kk] < p[kk]);
+  }
+  return lt;
+}
+
+typedef struct paretree {
+  int nk, n, nnode;
+  float *v[NCRIT];		// [criterion][pixel], in tree order
+  int *id;			// each pixel's index into the set
+  int *lo, *hi, *right;		// per node, its pixels and its second child,
+				// the first is the next node, leaves have no children
+  float *bmin, *bmax;		// [node][criterion]
+} paretree;
+
+static void paretree_swap (paretree *t, const int i, const int j) {
+  for (int kk=0; kk<t->nk; ++kk) {
+    const float f = t->v[kk][i];
+    t->v[kk][i] = t->v[kk][j];
+    t->v[kk][j] = f;
+  }
+  const int k = t->id[i];
+  t->id[i] = t->id[j];
+  t->id[j] = k;
+}
+
+// put the k-th lowest of criterion kk at k, with none higher before it
+// and none lower after it
+static void paretree_select (paretree *t, int lo, int hi, const int k, const int kk) {
+  const float *v = t->v[kk];
+  while (hi-lo > 1) {
+    const float a = v[lo];
+    const float b = v[(lo+hi)/2];
+    const float c = v[hi-1];
+    const float pivot = fmaxf(fminf(a,b), fminf(fmaxf(a,b),c));
+    int i = lo;
+    int j = hi-1;
+    while (i <= j) {
+      while (v[i] < pivot) ++i;
+      while (v[j] > pivot) --j;
+      if (i <= j) paretree_swap(t, i++, j--);
+    }
+    if (k <= j) hi = j+1;
+    else if (k >= i) lo = i;
+    else return;
+  }
+}
+
+static void paretree_build (paretree *t, const int lo, const int hi) {
+  const int nk = t->nk;
+  const int node = t->nnode++;
+  float *mn = t->bmin + (long)node*nk;
+  float *mx = t->bmax + (long)node*nk;
+  for (int kk=0; kk<nk; ++kk) {
+    const float *v = t->v[kk];
+    float a = v[lo];
+    float b = v[lo];
+    for (int i=lo+1; i<hi; ++i) {
+      a = fminf(a, v[i]);
+      b = fmaxf(b, v[i]);
+    }
+    mn[kk] = a;
+    mx[kk] = b;
+  }
+  t->lo[node] = lo;
+  t->hi[node] = hi;
+  t->right[node] = -1;
+  if (hi-lo <= PARETO_LEAF) return;
+
+  // split the widest criterion at its median
+  int ks = 0;
+  for (int kk=1; kk<nk; ++kk) if (mx[kk]-mn[kk] > mx[ks]-mn[ks]) ks = kk;
+  const int mid = (lo+hi)/2;
+  paretree_select(t, lo, hi, mid, ks);
+  paretree_build(t, lo, mid);
+  t->right[node] = t->nnode;
+  paretree_build(t, mid, hi);
+}
+
+// the pixel that beats p, or -1
+static int paretree_beats (const paretree *t, const float *p) {
+  const int nk = t->nk;
+  unsigned char le[PARETO_LEAF], lt[PARETO_LEAF];
+  int stack[64];
+  int ns = 0;
+  stack[ns++] = 0;
+  while (ns) {
+    const int node = stack[--ns];
+    const float *mn = t->bmin + (long)node*nk;
+    const float *mx = t->bmax + (long)node*nk;
+    int worse = FALSE;
+    int allle = TRUE;
+    int somelt = FALSE;
+    for (int kk=0; kk<nk; ++kk) {
+      worse |= (mn[kk] > p[kk]);
+      allle &= (mx[kk] <= p[kk]);
+      somelt |= (mx[kk] < p[kk]);
+    }
+    if (worse) continue;
+    if (allle && somelt) return t->lo[node];
+
+    if (t->right[node] >= 0) {
+      // the lower half first, it is likelier to beat p
+      stack[ns++] = t->right[node];
+      stack[ns++] = node+1;
+      continue;
+    }
+    const int lo = t->lo[node];
+    const int nb = t->hi[node] - lo;
+    for (int i=0; i<nb; ++i) {
+      le[i] = 1;
+      lt[i] = 0;
+    }
+    for (int kk=0; kk<nk; ++kk) {
+      const float *v = t->v[kk] + lo;
+      const float pk = p[kk];
+      for (int i=0; i<nb; ++i) {
+        le[i] &= (v[i] <= pk);
+        lt[i] |= (v[i] < pk);
+      }
+    }
+    for (int i=0; i<nb; ++i) if (le[i] & lt[i]) return lo+i;
+  }
+  return -1;
+}
+
+typedef struct pareto_job {
+  const paretree *t;
+  unsigned char *beaten;	// in tree order
+} pareto_job;
+
+// pixels in tree order, so that neighbouring queries walk the same
+// nodes, and whatever beat the last one likely beats this one too
+static void pareto_rows (void *arg, const int lo, const int hi, const int ithread) {
+  const pareto_job *pj = (const pareto_job *)arg;
+  const paretree *t = pj->t;
+  const int nk = t->nk;
+  float p[NCRIT], last[NCRIT];
+  int haslast = FALSE;
+  for (int i=lo; i<hi; ++i) {
+    for (int kk=0; kk<nk; ++kk) p[kk] = t->v[kk][i];
+    if (haslast && pareto_beats(last, p, nk)) {
+      pj->beaten[i] = TRUE;
+      continue;
+    }
+    const int b = paretree_beats(t, p);
+    pj->beaten[i] = (b >= 0);
+    if (b >= 0) {
+      for (int kk=0; kk<nk; ++kk) last[kk] = t->v[kk][b];
+      haslast = TRUE;
+    }
+  }
+}
+
+static const critset *sort_crits;
+static const float *sort_sums;
+static int pareto_compare (const void *a, const void *b) {
+  const int ia = *(const int *)a;
+  const int ib = *(const int *)b;
+  if (sort_sums[ia] != sort_sums[ib]) return (sort_sums[ia] > sort_sums[ib]) - (sort_sums[ia] < sort_sums[ib]);
+  for (int kk=0; kk<sort_crits->nk; ++kk) {
+    const float *c = sort_crits->cost[sort_crits->k[kk]];
+    if (c[ia] != c[ib]) return (c[ia] > c[ib]) - (c[ia] < c[ib]);
+  }
+  return (ia > ib) - (ia < ib);
+}
+
+// the pixels on the front, as indexes into the set, by the sum of their
+// criteria; returns how many
+int pareto_front (const critset *cs, int *front) {
+  const int nk = cs->nk;
+  const int n = cs->n;
+
+  paretree t;
+  t.nk = nk;
+  t.n = n;
+  t.nnode = 0;
+  for (int kk=0; kk<nk; ++kk) {
+    t.v[kk] = (float *)malloc(n*sizeof(float));
+    memcpy(t.v[kk], cs->cost[cs->k[kk]], n*sizeof(float));
+  }
+  t.id = (int *)malloc(n*sizeof(int));
+  for (int i=0; i<n; ++i) t.id[i] = i;
+  const int maxnode = 4*(n/PARETO_LEAF) + 1;
+  t.lo = (int *)malloc(maxnode*sizeof(int));
+  t.hi = (int *)malloc(maxnode*sizeof(int));
+  t.right = (int *)malloc(maxnode*sizeof(int));
+  t.bmin = (float *)malloc((long)maxnode*nk*sizeof(float));
+  t.bmax = (float *)malloc((long)maxnode*nk*sizeof(float));
+  paretree_build(&t, 0, n);
+
+  unsigned char *beaten = (unsigned char *)malloc(n);
+  pareto_job pj = { &t, beaten };
+  parallel_for(nthreads, n, pareto_rows, &pj);
+
+  int nfront = 0;
+  for (int i=0; i<n; ++i) if (!beaten[i]) front[nfront++] = t.id[i];
+
+  // and list them by the sum of their criteria
+  float *sum = (float *)calloc(n, sizeof(float));
+  for (int j=0; j<nfront; ++j) {
+    for (int kk=0; kk<nk; ++kk) sum[front[j]] += cs->cost[cs->k[kk]][front[j]];
+  }
+  sort_crits = cs;
+  sort_sums = sum;
+  qsort(front, nfront, sizeof(int), pareto_compare);
+
+  free(sum);
+  free(beaten);
+  for (int kk=0; kk<nk; ++kk) free(t.v[kk]);
+  free(t.id);
+  free(t.lo);
+  free(t.hi);
+  free(t.right);
+  free(t.bmin);
+  free(t.bmax);
+  return nfront;
+}
+
+// running min, max, and best (lowest cost) pixel of the land costs
+typedef struct score_range {
+  float lo, hi;
+  int bestrow, bestcol;
+} score_range;
+
+void init_score_range (score_range *sr) {
+  sr->lo = 9.9e+9;
+  sr->hi = -9.9e+9;
+  sr->bestrow = -1;
+  sr->bestcol = -1;
+}
+
+// fold one row of costs into the range, ocean is negative
+void track_score_range (const float *out, const int xres, const int row, score_range *sr) {
+  for (int col=0; col<xres; ++col) {
+    if (out[col] >= 0.f) {
+      // on ties, keep the southernmost then westernmost, whatever the row order
+      if (out[col] < sr->lo || (out[col] == sr->lo && (row < sr->bestrow || (row == sr->bestrow && col < sr->bestcol)))) {
+        sr->lo = out[col];
+        sr->bestrow = row;
+        sr->bestcol = col;
+      }
+      if (out[col] > sr->hi) sr->hi = out[col];
+    }
+  }
+}
+
+// the range and best pixel of rows lo to hi of a grid of costs
+void find_score_range (float **out, const int xres, const int lo, const int hi, score_range *sr) {
+  init_score_range(sr);
+  for (int row=lo; row<hi; ++row) track_score_range(out[row], xres, row, sr);
+}
+
+// decimals that show every pixel center of a grid step exactly
+static int center_digits (const double step) {
+  int d = 0;
+  for (double h=0.5*step; d<4 && fabs(h-rint(h)) > 1.e-6; h*=10.) ++d;
+  return d;
+}
+
+// print where the best pixel is, and what's near it
+void print_best_place (const score_range *sr, const int xres, const int yres, const char *how) {
+  //printf("Best pixel is %d %d\n", sr->bestcol, sr->bestrow);
+  printf("Best place on Earth%s is", how);
+  const double nlat = -90. + 180.*(0.5+sr->bestrow)/yres;
+  const double elong = -180. + 360.*(0.5+sr->bestcol)/xres;
+  const int dlat = center_digits(180./yres);
+  const int dlon = center_digits(360./xres);
+  if (nlat>0.) printf(" %.*f N", dlat, nlat);
+  else printf(" %.*f S", dlat, -nlat);
+  if (elong>0.) printf(" %.*f E", dlon, elong);
+  else printf(" %.*f W", dlon, -elong);
+  printf("\n");
+  print_nearest_places(nlat, elong);
+}
+
+// flip a row of costs to 0=bad, 1=best, and zero out the ocean
+void finalize_row (float *out, const int xres, const float loval, const float hival) {
+  for (int col=0; col<xres; ++col) {
+    if (out[col] < 0.f) {
+      // zero out the ocean
+      out[col] = 0.0f;
+    } else {
+      // flip to 0=bad, 1=best
+      out[col] = 1.0f - (out[col]-loval)/(hival-loval);
+      // apply power to accentuate the best
+      out[col] = powf(out[col], 8.f);
+    }
+  }
+}
+
+/*
+ * raw outputs for analysis: the same values as the image, but as float32
+ * with the ocean at -1, north row first, mapped and filled in place
+ */
+enum { OUT_PNG, OUT_RAW, OUT_NPY };
+
+int output_format (const char *outfile) {
+  const char *dot = strrchr(outfile, '.');
+  if (dot && strcasecmp(dot, ".npy") == 0) return OUT_NPY;
+  if (dot && (strcasecmp(dot, ".f32") == 0 || strcasecmp(dot, ".raw") == 0)) return OUT_RAW;
+  return OUT_PNG;
+}
+
+// same name with another extension
+void sidecar_file (const char *outfile, const char *ext, char *name) {
+  const char *dot = strrchr(outfile, '.');
+  const int n = dot ? (int)(dot-outfile) : (int)strlen(outfile);
+  sprintf(name, "%.*s%s", n, outfile, ext);
+}
+
+typedef struct raw_job {
+  float **outval;
+  float *dst;
+  int xres, yres;
+  int finalize;		// or the values are final already
+  float lo, hi;
+} raw_job;
+
+static void raw_rows (void *arg, const int lo, const int hi, const int ithread) {
+  const raw_job *rj = (const raw_job *)arg;
+  const int xres = rj->xres;
+  for (int j=lo; j<hi; ++j) {
+    const float *src = rj->outval[rj->yres-1-j];
+    float *dst = rj->dst + (long)j*xres;
+    memcpy(dst, src, xres*sizeof(float));
+    if (rj->finalize) {
+      finalize_row(dst, xres, rj->lo, rj->hi);
+      for (int col=0; col<xres; ++col) if (src[col] < 0.f) dst[col] = -1.f;
+    }
+  }
+}
+
+static int little_endian (void) {
+  const int one = 1;
+  return *(const char *)&one;
+}
+
+int write_raw (char *outfile, const int format, float **outval, const int xres, const int yres,
+  const int finalize, const float lo, const float hi) {
+
+  // numpy's version 1.0 header, padded so that the data is aligned
+  char header[256];
+  int nhead = 0;
+  if (format == OUT_NPY) {
+    const int n = sprintf(header+10, "{'descr': '%cf4', 'fortran_order': False, 'shape': (%d, %d), }",
+                          little_endian() ? '<' : '>', yres, xres);
+    nhead = (10 + n + 1 + 63) / 64 * 64;
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (char)((nhead-10) & 0xff);
+    header[9] = (char)((nhead-10) >> 8);
+    memset(header+10+n, ' ', nhead-10-n-1);
+    header[nhead-1] = '\n';
+  }
+
+  const size_t size = nhead + (size_t)xres*yres*sizeof(float);
+  const int fd = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    fprintf(stderr,"Could not open output file %s\n",outfile);
+    fflush(stderr);
+    exit(0);
+  }
+  char *map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"Could not map output file %s\n",outfile);
+    fflush(stderr);
+    exit(0);
+  }
+  memcpy(map, header, nhead);
+  raw_job rj = { outval, (float *)(map + nhead), xres, yres, finalize, lo, hi };
+  parallel_for(nthreads, yres, raw_rows, &rj);
+  munmap(map, size);
+  close(fd);
+  printf("Wrote %d x %d float32 values to %s\n", xres, yres, outfile);
+  if (format == OUT_NPY) return(0);
+
+  // and where they are, in a json sidecar and a world file
+  char name[255];
+  const double dx = 360.0/xres;
+  const double dy = 180.0/yres;
+  sidecar_file(outfile, ".json", name);
+  FILE *fp = fopen(name,"w");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",name);
+    fflush(stderr);
+    exit(0);
+  }
+  fprintf(fp,"{\n  \"width\": %d,\n  \"height\": %d,\n  \"dtype\": \"float32\",\n", xres, yres);
+  fprintf(fp,"  \"byte_order\": \"%s\",\n  \"rows\": \"north first\",\n  \"nodata\": -1,\n", little_endian() ? "little" : "big");
+  fprintf(fp,"  \"crs\": \"EPSG:4326\",\n  \"bounds\": [-180, -90, 180, 90],\n");
+  fprintf(fp,"  \"geotransform\": [-180, %.12g, 0, 90, 0, %.12g]\n}\n", dx, -dy);
+  fclose(fp);
+  sidecar_file(outfile, ".wld", name);
+  fp = fopen(name,"w");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",name);
+    fflush(stderr);
+    exit(0);
+  }
+  // the world file gives the centre of the top-left pixel
+  fprintf(fp,"%.12g\n0\n0\n%.12g\n%.12g\n%.12g\n", dx, -dy, -180.0+0.5*dx, 90.0-0.5*dy);
+  fclose(fp);
+  return(0);
+}
+
+/*
+ * the places whose final value is above thresh, as float32 triples of
+ * latitude, longitude, and value, north row first
+ */
+long write_sparse (char *outfile, float **outval, const int xres, const int yres, const float thresh) {
+  FILE *fp = fopen(outfile,"wb");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",outfile);
+    fflush(stderr);
+    exit(0);
+  }
+  float *buf = (float *)malloc(3*xres*sizeof(float));
+  long count = 0;
+  for (int row=yres-1; row>=0; --row) {
+    const float nlat = -90.f + 180.f*(0.5f+row)/(float)yres;
+    int n = 0;
+    for (int col=0; col<xres; ++col) {
+      if (outval[row][col] > thresh) {
+        buf[3*n] = nlat;
+        buf[3*n+1] = -180.f + 360.f*(0.5f+col)/(float)xres;
+        buf[3*n+2] = outval[row][col];
+        ++n;
+      }
+    }
+    if (n > 0 && fwrite(buf, 3*sizeof(float), n, fp) != (size_t)n) {
+      fprintf(stderr,"Could not write to %s\n",outfile);
+      fflush(stderr);
+      exit(0);
+    }
+    count += n;
+  }
+  fclose(fp);
+  free(buf);
+  return(count);
+}
+
+/*
+ * vector outlines of the best places: marching squares over the finished
+ * image, in row bands on their own threads; every segment runs from one
+ * grid edge to another with the region on its left, so joining them by
+ * those edges stitches the bands and the date line with no special cases,
+ * and rows of nothing above and below the poles close every ring
+ */
+#define CONTOUR_BINS 4096
+#define CONTOUR_TOL 0.5f	// in pixels, for simplifying
+
+typedef struct contour_seg {
+  long from, to;	// 2*(row*xres+col), +1 for the vertical edges
+} contour_seg;
+
+typedef struct contour_job {
+  float **val;
+  int xres, yres;
+  float level;
+  contour_seg **seg;	// by thread
+  int *nseg, *cap;
+} contour_job;
+
+static int float_compare (const void *a, const void *b) {
+  const float fa = *(const float *)a;
+  const float fb = *(const float *)b;
+  return (fa > fb) - (fa < fb);
+}
+
+// the final value at the edge of the best pct percent of the land
+float best_level (float **cost, const int xres, const int yres, const float lo, const float hi, const float pct) {
+  const float bs = (hi > lo) ? CONTOUR_BINS / (hi-lo) : 0.f;
+  long *count = (long *)calloc(CONTOUR_BINS, sizeof(long));
+  long nland = 0;
+  for (int row=0; row<yres; ++row) {
+    for (int col=0; col<xres; ++col) {
+      if (cost[row][col] < 0.f) continue;
+      count[(int)fminf((cost[row][col]-lo)*bs, CONTOUR_BINS-1)]++;
+      nland++;
+    }
+  }
+  if (nland == 0) {
+    free(count);
+    return(1.f);
+  }
+
+  // find the bin, then the value within it
+  const long want = (long)(0.01f*pct*nland);
+  long below = 0;
+  int b = 0;
+  while (b < CONTOUR_BINS-1 && below + count[b] <= want) below += count[b++];
+  float *inbin = (float *)malloc(count[b]*sizeof(float));
+  long n = 0;
+  for (int row=0; row<yres; ++row) {
+    for (int col=0; col<xres; ++col) {
+      if (cost[row][col] >= 0.f && (int)fminf((cost[row][col]-lo)*bs, CONTOUR_BINS-1) == b) inbin[n++] = cost[row][col];
+    }
+  }
+  qsort(inbin, n, sizeof(float), float_compare);
+  const float cut = inbin[(want-below < n) ? want-below : n-1];
+  free(inbin);
+  free(count);
+
+  // the same flip and power as finalize_row, but never down to the ocean
+  float level = (hi > lo) ? powf(1.0f - (cut-lo)/(hi-lo), 8.f) : 1.f;
+  return fmaxf(level, 1.e-20f);
+}
+
+// the image, with a row of zero beyond each pole
+static inline float contour_val (const contour_job *cj, const int r, const int col) {
+  return (r < 1 || r > cj->yres) ? 0.f : cj->val[r-1][col];
+}
+
+static void contour_add (contour_job *cj, const int ithread, const long from, const long to) {
+  if (cj->nseg[ithread] == cj->cap[ithread]) {
+    cj->cap[ithread] = 2*cj->cap[ithread] + 1024;
+    cj->seg[ithread] = (contour_seg *)realloc(cj->seg[ithread], cj->cap[ithread]*sizeof(contour_seg));
+  }
+  cj->seg[ithread][cj->nseg[ithread]++] = (contour_seg){ from, to };
+}
+
+static void contour_rows (void *arg, const int lo, const int hi, const int ithread) {
+  contour_job *cj = (contour_job *)arg;
+  const int xres = cj->xres;
+  const float lev = cj->level;
+  for (int r=lo; r<hi; ++r) {
+    for (int col=0; col<xres; ++col) {
+      const int c1 = (col+1 < xres) ? col+1 : 0;
+      // the corners counter-clockwise from the south-west
+      const float v[4] = { contour_val(cj,r,col), contour_val(cj,r,c1), contour_val(cj,r+1,c1), contour_val(cj,r+1,col) };
+      const int in[4] = { v[0] >= lev, v[1] >= lev, v[2] >= lev, v[3] >= lev };
+      const int mask = in[0] | in[1]<<1 | in[2]<<2 | in[3]<<3;
+      if (mask == 0 || mask == 15) continue;
+
+      // south, east, north, and west edges, in the same order
+      const long edge[4] = { 2*((long)r*xres+col), 2*((long)r*xres+c1)+1, 2*((long)(r+1)*xres+col), 2*((long)r*xres+col)+1 };
+      // a mixed cell crosses 2 or 4 of its edges
+      long x[4] = { 0, 0, 0, 0 };
+      int leaving[4] = { 0, 0, 0, 0 };
+      int k = 0;
+      for (int e=0; e<4; ++e) {
+        if (in[e] != in[(e+1)&3]) {
+          x[k] = edge[e];
+          leaving[k++] = in[e];
+        }
+      }
+      if (k == 2) {
+        if (leaving[0]) contour_add(cj, ithread, x[0], x[1]);
+        else contour_add(cj, ithread, x[1], x[0]);
+      } else {
+        // a saddle, joined through the middle or not
+        const int joined = (0.25f*(v[0]+v[1]+v[2]+v[3]) >= lev);
+        for (int i=0; i<4; ++i) {
+          if (leaving[i]) contour_add(cj, ithread, x[i], x[(i + (joined ? 1 : 3)) & 3]);
+        }
+      }
+    }
+  }
+}
+
+// where the contour crosses an edge, in pixels
+static void contour_point (const contour_job *cj, const long id, float *px, float *py) {
+  const long cell = id >> 1;
+  const int r = (int)(cell / cj->xres);
+  const int col = (int)(cell % cj->xres);
+  if (id & 1) {
+    const float v0 = contour_val(cj, r, col);
+    const float v1 = contour_val(cj, r+1, col);
+    *px = col;
+    *py = r - 1 + (cj->level-v0)/(v1-v0);
+  } else {
+    const float v0 = contour_val(cj, r, col);
+    const float v1 = contour_val(cj, r, (col+1 < cj->xres) ? col+1 : 0);
+    *px = col + (cj->level-v0)/(v1-v0);
+    *py = r - 1;
+  }
+}
+
+// douglas-peucker on the open run a..b of points, marking those to keep
+static void simplify_run (const float *pt, unsigned char *keep, const int a, const int b, int *stack) {
+  int ns = 0;
+  stack[ns++] = a;
+  stack[ns++] = b;
+  while (ns > 0) {
+    const int j = stack[--ns];
+    const int i = stack[--ns];
+    const float dx = pt[2*j] - pt[2*i];
+    const float dy = pt[2*j+1] - pt[2*i+1];
+    const float len = sqrtf(dx*dx + dy*dy);
+    float worst = 0.f;
+    int iw = -1;
+    for (int m=i+1; m<j; ++m) {
+      const float ex = pt[2*m] - pt[2*i];
+      const float ey = pt[2*m+1] - pt[2*i+1];
+      const float d = (len > 0.f) ? fabsf(ex*dy - ey*dx) / len : sqrtf(ex*ex + ey*ey);
+      if (d > worst) {
+        worst = d;
+        iw = m;
+      }
+    }
+    if (worst > CONTOUR_TOL) {
+      keep[iw] = 1;
+      stack[ns++] = i;
+      stack[ns++] = iw;
+      stack[ns++] = iw;
+      stack[ns++] = j;
+    }
+  }
+}
+
+// simplify a closed ring of n points in place, split at the point farthest from the first
+static int simplify_ring (float *pt, const int n) {
+  if (n < 5) return n;
+  float *loop = (float *)malloc(2*(n+1)*sizeof(float));
+  memcpy(loop, pt, 2*n*sizeof(float));
+  loop[2*n] = pt[0];
+  loop[2*n+1] = pt[1];
+  unsigned char *keep = (unsigned char *)calloc(n+1, 1);
+  int *stack = (int *)malloc(4*(n+1)*sizeof(int));
+  int far = 0;
+  float dfar = -1.f;
+  for (int i=1; i<n; ++i) {
+    const float d = (pt[2*i]-pt[0])*(pt[2*i]-pt[0]) + (pt[2*i+1]-pt[1])*(pt[2*i+1]-pt[1]);
+    if (d > dfar) {
+      dfar = d;
+      far = i;
+    }
+  }
+  keep[0] = keep[far] = 1;
+  simplify_run(loop, keep, 0, far, stack);
+  simplify_run(loop, keep, far, n, stack);
+  int m = 0;
+  for (int i=0; i<n; ++i) if (keep[i]) m++;
+  // a pixel or two on its own would vanish, keep it as it was
+  if (m >= 3) {
+    m = 0;
+    for (int i=0; i<n; ++i) {
+      if (!keep[i]) continue;
+      pt[2*m] = loop[2*i];
+      pt[2*m+1] = loop[2*i+1];
+      m++;
+    }
+  } else {
+    m = n;
+  }
+  free(loop);
+  free(keep);
+  free(stack);
+  return m;
+}
+
+typedef struct contour_ring {
+  long start;		// first point
+  int n;
+  double area;		// positive around a region, negative around a hole
+  float xmin, xmax, ymin, ymax;
+  int outer;		// for a hole, the ring that it is in
+  int shift;		// and how many times round the world from it
+  int wind;		// all the way round to the east, west, or not
+} contour_ring;
+
+// is the point above this ring all the way round, so that a line down
+// from it crosses the ring an odd number of times
+static int ring_below (const float *pt, const contour_ring *rg, const float x, const float y, const int xres) {
+  const float *p = pt + 2*rg->start;
+  int crossings = 0;
+  for (int i=0; i<rg->n; ++i) {
+    const int j = (i+1 < rg->n) ? i+1 : 0;
+    float x0 = p[2*i];
+    float x1 = p[2*j];
+    while (x1 - x0 > 0.5f*xres) x1 -= xres;
+    while (x1 - x0 < -0.5f*xres) x1 += xres;
+    // the copy of the point nearest this step
+    float px = x;
+    while (px - x0 > 0.5f*xres) px -= xres;
+    while (px - x0 < -0.5f*xres) px += xres;
+    if ((x0 <= px) != (x1 <= px)) {
+      const float yc = p[2*i+1] + (p[2*j+1]-p[2*i+1]) * (px-x0) / (x1-x0);
+      if (yc < y) crossings++;
+    }
+  }
+  return crossings & 1;
+}
+
+// join an eastward ring and the westward one above it into one ring
+// around the band between them, with a seam where the first one starts
+static long join_band (float *pt, long npt, const contour_ring *e, const contour_ring *w, const int xres) {
+  const float *pe = pt + 2*e->start;
+  const float *pw = pt + 2*w->start;
+  const float x0 = pe[0];
+  int k = 0;
+  float best = (float)xres;
+  for (int i=0; i<w->n; ++i) {
+    float off = fmodf(pw[2*i] - x0, (float)xres);
+    if (off < 0.f) off += xres;
+    if (off < best) {
+      best = off;
+      k = i;
+    }
+  }
+  memmove(pt + 2*npt, pe, 2*e->n*sizeof(float));
+  npt += e->n;
+  const float shift = x0 + best + xres - pw[2*k];
+  for (int j=0; j<w->n; ++j) {
+    const int i = (k+j < w->n) ? k+j : k+j-w->n;
+    pt[2*npt] = pw[2*i] + shift - ((k+j < w->n) ? 0.f : (float)xres);
+    pt[2*npt+1] = pw[2*i+1];
+    npt++;
+  }
+  return npt;
+}
+
+static int ring_contains (const float *pt, const contour_ring *rg, const float x, const float y) {
+  int inside = FALSE;
+  const float *p = pt + 2*rg->start;
+  for (int i=0, j=rg->n-1; i<rg->n; j=i++) {
+    if ((p[2*i+1] > y) != (p[2*j+1] > y) &&
+        x < p[2*j] + (p[2*i]-p[2*j]) * (y-p[2*j+1]) / (p[2*i+1]-p[2*j+1])) inside = !inside;
+  }
+  return inside;
+}
+
+typedef struct simplify_job {
+  float *pt;
+  contour_ring *ring;
+} simplify_job;
+
+static void simplify_rings (void *arg, const int lo, const int hi, const int ithread) {
+  simplify_job *sj = (simplify_job *)arg;
+  for (int i=lo; i<hi; ++i) {
+    contour_ring *rg = &sj->ring[i];
+    float *p = sj->pt + 2*rg->start;
+    rg->n = simplify_ring(p, rg->n);
+    double a = 0.0;
+    rg->xmin = rg->xmax = p[0];
+    rg->ymin = rg->ymax = p[1];
+    for (int k=0, j=rg->n-1; k<rg->n; j=k++) {
+      a += (double)p[2*j]*p[2*k+1] - (double)p[2*k]*p[2*j+1];
+      rg->xmin = fminf(rg->xmin, p[2*k]);
+      rg->xmax = fmaxf(rg->xmax, p[2*k]);
+      rg->ymin = fminf(rg->ymin, p[2*k+1]);
+      rg->ymax = fmaxf(rg->ymax, p[2*k+1]);
+    }
+    rg->area = 0.5*a;
+  }
+}
+
+/*
+ * outline where the finished image is at least level as geojson
+ * polygons, with their holes
+ */
+int write_contours (char *outfile, float **val, const int xres, const int yres, const float level, const float pct) {
+  contour_job cj;
+  cj.val = val;
+  cj.xres = xres;
+  cj.yres = yres;
+  cj.level = level;
+  cj.seg = (contour_seg **)calloc(nthreads, sizeof(contour_seg *));
+  cj.nseg = (int *)calloc(nthreads, sizeof(int));
+  cj.cap = (int *)calloc(nthreads, sizeof(int));
+  parallel_for(nthreads, yres+1, contour_rows, &cj);
+
+  // all of the segments, indexed by the edge they start from
+  long nseg = 0;
+  for (int t=0; t<nthreads; ++t) nseg += cj.nseg[t];
+  contour_seg *seg = (contour_seg *)malloc((nseg+1)*sizeof(contour_seg));
+  nseg = 0;
+  for (int t=0; t<nthreads; ++t) {
+    if (cj.nseg[t]) memcpy(seg+nseg, cj.seg[t], cj.nseg[t]*sizeof(contour_seg));
+    nseg += cj.nseg[t];
+    free(cj.seg[t]);
+  }
+  int bits = 1;
+  while ((1L << bits) < 2*nseg) ++bits;
+  const long hmask = (1L << bits) - 1;
+  long *hash = (long *)malloc((hmask+1)*sizeof(long));
+  for (long h=0; h<=hmask; ++h) hash[h] = -1;
+  for (long i=0; i<nseg; ++i) {
+    long h = (long)(((unsigned long)seg[i].from * 0x9E3779B97F4A7C15UL) >> (64-bits));
+    while (hash[h] >= 0) h = (h+1) & hmask;
+    hash[h] = i;
+  }
+
+  // follow each ring round, in pixels, with no jump at the date line
+  unsigned char *used = (unsigned char *)calloc(nseg+1, 1);
+  // one point a segment, and room to join the rings all the way round
+  float *pt = (float *)malloc(4*(nseg+1)*sizeof(float));
+  long npt = 0;
+  int nring = 0;
+  int cring = 1024;
+  contour_ring *ring = (contour_ring *)malloc(cring*sizeof(contour_ring));
+  for (long s0=0; s0<nseg; ++s0) {
+    if (used[s0]) continue;
+    const long start = npt;
+    long s = s0;
+    while (!used[s]) {
+      used[s] = 1;
+      float x, y;
+      contour_point(&cj, seg[s].from, &x, &y);
+      if (npt > start) {
+        while (x - pt[2*npt-2] > 0.5f*xres) x -= xres;
+        while (x - pt[2*npt-2] < -0.5f*xres) x += xres;
+      }
+      pt[2*npt] = x;
+      pt[2*npt+1] = y;
+      npt++;
+      long h = (long)(((unsigned long)seg[s].to * 0x9E3779B97F4A7C15UL) >> (64-bits));
+      while (hash[h] >= 0 && seg[hash[h]].from != seg[s].to) h = (h+1) & hmask;
+      if (hash[h] < 0) break;
+      s = hash[h];
+    }
+
+    // does it go all the way round, and which way
+    float xback = pt[2*start];
+    while (xback - pt[2*npt-2] > 0.5f*xres) xback -= xres;
+    while (xback - pt[2*npt-2] < -0.5f*xres) xback += xres;
+
+    if (nring == cring) {
+      cring *= 2;
+      ring = (contour_ring *)realloc(ring, cring*sizeof(contour_ring));
+    }
+    ring[nring].start = start;
+    ring[nring].n = (int)(npt-start);
+    ring[nring].outer = -1;
+    ring[nring].shift = 0;
+    ring[nring].wind = (xback > pt[2*start] + 0.5f*xres) ? 1 : (xback < pt[2*start] - 0.5f*xres) ? -1 : 0;
+    nring++;
+  }
+
+  // rings all the way round come in pairs, as the poles are outside: one
+  // going east below a band of the region and one going west above it
+  int *wr = (int *)malloc((nring+1)*sizeof(int));
+  int *nbelow = (int *)calloc(nring+1, sizeof(int));
+  int nwr = 0;
+  for (int i=0; i<nring; ++i) if (ring[i].wind) wr[nwr++] = i;
+  for (int a=0; a<nwr; ++a) {
+    const float *p = pt + 2*ring[wr[a]].start;
+    for (int b=0; b<nwr; ++b) {
+      if (b != a && ring_below(pt, &ring[wr[b]], p[0], p[1], xres)) nbelow[wr[a]]++;
+    }
+  }
+  for (int a=1; a<nwr; ++a) {
+    for (int b=a; b>0 && nbelow[wr[b]] < nbelow[wr[b-1]]; --b) {
+      const int t = wr[b];
+      wr[b] = wr[b-1];
+      wr[b-1] = t;
+    }
+  }
+  for (int a=0; a<nwr; ++a) {
+    contour_ring *rg = &ring[wr[a]];
+    if (a+1 < nwr && rg->wind > 0 && ring[wr[a+1]].wind < 0) {
+      const long start = npt;
+      npt = join_band(pt, npt, rg, &ring[wr[a+1]], xres);
+      rg->start = start;
+      rg->n = (int)(npt-start);
+      rg->wind = 0;
+      ring[wr[++a]].n = 0;
+    } else {
+      rg->n = 0;
+    }
+  }
+  free(wr);
+  free(nbelow);
+  free(hash);
+  free(used);
+  free(seg);
+  free(cj.seg);
+  free(cj.nseg);
+  free(cj.cap);
+
+  simplify_job sj = { pt, ring };
+  parallel_for(nthreads, nring, simplify_rings, &sj);
+
+  // each hole goes in the smallest ring around it
+  int nholes = 0;
+  for (int i=0; i<nring; ++i) {
+    if (ring[i].area >= 0.0) continue;
+    const float *p = pt + 2*ring[i].start;
+    for (int j=0; j<nring; ++j) {
+      if (ring[j].area <= 0.0) continue;
+      if (ring[i].outer >= 0 && ring[j].area >= ring[ring[i].outer].area) continue;
+      for (int w=-1; w<=1; ++w) {
+        const float x = p[0] + w*xres;
+        if (x < ring[j].xmin || x > ring[j].xmax || p[1] < ring[j].ymin || p[1] > ring[j].ymax) continue;
+        if (ring_contains(pt, &ring[j], x, p[1])) {
+          ring[i].outer = j;
+          ring[i].shift = w;
+          break;
+        }
+      }
+    }
+    if (ring[i].outer >= 0) nholes++;
+  }
+
+  // then write them out, each region with its holes
+  FILE *fp = fopen(outfile,"w");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",outfile);
+    fflush(stderr);
+    exit(0);
+  }
+  fprintf(fp,"{\"type\": \"FeatureCollection\", \"features\": [{\"type\": \"Feature\",\n");
+  fprintf(fp," \"properties\": {\"best_percent\": %g, \"level\": %g},\n", pct, level);
+  fprintf(fp," \"geometry\": {\"type\": \"MultiPolygon\", \"coordinates\": [");
+  long nout = 0;
+  int npoly = 0;
+  for (int i=0; i<nring; ++i) {
+    if (ring[i].area <= 0.0) continue;
+    fprintf(fp, "%s\n  [", npoly++ ? "," : "");
+    int first = TRUE;
+    for (int j=i; j<nring; ++j) {
+      if (j != i && (ring[j].area >= 0.0 || ring[j].outer != i)) continue;
+      const float *p = pt + 2*ring[j].start;
+      fprintf(fp, "%s[", first ? "" : ", ");
+      for (int k=0; k<=ring[j].n; ++k) {
+        const int m = (k < ring[j].n) ? k : 0;
+        const float lon = -180.f + 360.f*(0.5f+p[2*m]+ring[j].shift*xres)/(float)xres;
+        const float lat = fminf(fmaxf(-90.f + 180.f*(0.5f+p[2*m+1])/(float)yres, -90.f), 90.f);
+        fprintf(fp, "%s[%.4f, %.4f]", k ? ", " : "", lon, lat);
+      }
+      fprintf(fp, "]");
+      nout += ring[j].n;
+      first = FALSE;
+    }
+    fprintf(fp, "]");
+  }
+  fprintf(fp,"\n ]}\n}]}\n");
+  fclose(fp);
+  printf("Wrote %d regions with %d holes and %ld points, outlining the best %g%% of the land, to %s\n",
+         npoly, nholes, nout, pct, outfile);
+  free(pt);
+  free(ring);
+  return(0);
+}
+
+
+/*
+ * a stack store: every month of one stack's changing layers, decoded
+ * onto the scoring grid and kept as 16 bits over each layer's range in
+ * one file, so later runs map it instead of decoding the pngs; the
+ * header lists each grid's file, scale, and the file's size and time
+ * when it was read, and the grids start on a page
+ */
+#define STACK_MAGIC "IPSTACK2"
+#define MAXSTACKGRIDS (MAXLAYERS*13+1)	// and the boundaries, for -preview
+
+typedef struct stack_entry {
+  char file[256];
+  float min, range;
+  long long size, mtime;	// of the file, so a store is rebuilt when it changes
+} stack_entry;
+
+typedef struct stack_store {
+  int n;
+  long npix;
+  const stack_entry *e;
+  const unsigned short *data;	// n grids of xres*yres, row 0 first
+  void *map;
+  size_t maplen;
+} stack_store;
+
+typedef struct store_job {
+  const stack_entry *e;
+  unsigned short *data;
+  int xres, yres;
+} store_job;
+
+// a grid of a store, as its file is now
+static void set_stack_entry (stack_entry *e, const char *file, const float min, const float range) {
+  struct stat st;
+  memset(e, 0, sizeof(stack_entry));
+  snprintf(e->file, sizeof(e->file), "%s", file);
+  e->min = min;
+  e->range = range;
+  e->size = -1;
+  if (stat(file, &st) == 0) {
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+  }
+}
+
+// the grids a store holds: every month of the given layers
+static int stack_entries (const int *used, const char *scen, const char *period, stack_entry *e) {
+  int n = 0;
+  for (int l=0; l<NLAYERS+nextra; ++l) {
+    if (!used[l]) continue;
+    for (int imonth=0; imonth<=12; ++imonth) {
+      char f[255];
+      stack_layer_file(l, imonth, scen, period, f, sizeof(f));
+      int i = 0;
+      while (i<n && (strcmp(e[i].file, f) != 0 || e[i].min != layer_min[l] || e[i].range != layer_range[l])) ++i;
+      if (i < n) continue;
+      set_stack_entry(&e[n++], f, layer_min[l], layer_range[l]);
+    }
+  }
+  return n;
+}
+
+static void store_grids (void *arg, const int lo, const int hi, const int ithread) {
+  store_job *sj = (store_job *)arg;
+  const int xres = sj->xres;
+  for (int k=lo; k<hi; ++k) {
+    const stack_entry *e = &sj->e[k];
+    float** grid = read_layer_grid((char *)e->file, xres, sj->yres, e->min, e->range);
+    unsigned short *q = sj->data + (long)k*xres*sj->yres;
+    for (int row=0; row<sj->yres; ++row) {
+      for (int col=0; col<xres; ++col) {
+        const float v = 65534.f * (grid[row][col]-e->min) / e->range;
+        *q++ = (v <= 0.f) ? 0 : (v >= 65535.f) ? 65535 : (unsigned short)(v+0.5f);
+      }
+    }
+    free_2d_array_f(grid);
+  }
+}
+
+static size_t stack_data_offset (const int n) {
+  return (24 + n*sizeof(stack_entry) + 4095) & ~(size_t)4095;
+}
+
+// map a store, or NULL if it isn't there or is for another grid
+static stack_store* map_stack_store (const char *file, const int xres, const int yres) {
+  const int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 24) {
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  const int *hdr = (const int *)((const char *)map + 8);
+  const long npix = (long)xres*yres;
+  if (memcmp(map, STACK_MAGIC, 8) != 0 || hdr[0] != xres || hdr[1] != yres || hdr[2] != linear_sampling ||
+      hdr[3] < 0 || hdr[3] > MAXSTACKGRIDS ||
+      (size_t)st.st_size != stack_data_offset(hdr[3]) + hdr[3]*npix*sizeof(unsigned short)) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  stack_store *ss = (stack_store *)malloc(sizeof(stack_store));
+  ss->n = hdr[3];
+  ss->npix = npix;
+  ss->e = (const stack_entry *)((const char *)map + 24);
+  ss->data = (const unsigned short *)((const char *)map + stack_data_offset(ss->n));
+  ss->map = map;
+  ss->maplen = st.st_size;
+  return ss;
+}
+
+// which grid of a store this is, or -1
+static int stack_find (const stack_store *ss, const char *file, const float min, const float range) {
+  for (int k=0; k<ss->n; ++k) {
+    const stack_entry *e = &ss->e[k];
+    if (strcmp(e->file, file) == 0 && e->min == min && e->range == range) return k;
+  }
+  return -1;
+}
+
+// one grid of a store, or NULL
+const unsigned short* stack_grid (const stack_store *ss, const char *file, const float min, const float range) {
+  const int k = stack_find(ss, file, min, range);
+  return (k < 0) ? NULL : ss->data + k*ss->npix;
+}
+
+/*
+ * open a store of the listed grids, and (re)build it first if it doesn't
+ * hold every one of them as their files are now; a new store is written
+ * beside the old one and renamed over it, so any run that has the old
+ * one mapped keeps reading it
+ */
+stack_store* open_store (const char *file, const stack_entry *e, const int n, const int xres, const int yres) {
+  stack_store *ss = map_stack_store(file, xres, yres);
+  for (int k=0; k<n && ss; ++k) {
+    const int i = stack_find(ss, e[k].file, e[k].min, e[k].range);
+    if (i >= 0 && (ss->e[i].size != e[k].size || ss->e[i].mtime != e[k].mtime)) {
+      printf("  %s has changed since stack store %s was built\n", e[k].file, file);
+    }
+    if (i < 0 || ss->e[i].size != e[k].size || ss->e[i].mtime != e[k].mtime) {
+      munmap(ss->map, ss->maplen);
+      free(ss);
+      ss = NULL;
+    }
+  }
+  if (ss) {
+    printf("Using %d layers of stack store %s\n", ss->n, file);
+    return ss;
+  }
+
+  printf("Building stack store %s from %d layers\n", file, n);
+  char tmpfile[300];
+  if (snprintf(tmpfile, sizeof(tmpfile), "%s.%d.tmp", file, (int)getpid()) >= (int)sizeof(tmpfile)) {
+    fprintf(stderr,"Stack store name %s is too long\n",file);
+    exit(0);
+  }
+  const size_t off = stack_data_offset(n);
+  const size_t size = off + (size_t)n*xres*yres*sizeof(unsigned short);
+  const int fd = open(tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    fprintf(stderr,"Could not create stack store %s\n",tmpfile);
+    exit(0);
+  }
+  char *map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"Could not map stack store %s\n",tmpfile);
+    unlink(tmpfile);
+    exit(0);
+  }
+  const int hdr[4] = { xres, yres, linear_sampling, n };
+  memcpy(map+8, hdr, sizeof(hdr));
+  memcpy(map+24, e, n*sizeof(stack_entry));
+  store_job sj = { e, (unsigned short *)(map+off), xres, yres };
+  parallel_for(nthreads, n, store_grids, &sj);
+  // the magic goes in last, so a store that was cut short is never used
+  memcpy(map, STACK_MAGIC, 8);
+  munmap(map, size);
+  if (fsync(fd) != 0 || close(fd) != 0 || rename(tmpfile, file) != 0) {
+    fprintf(stderr,"Could not write stack store %s\n",file);
+    unlink(tmpfile);
+    exit(0);
+  }
+
+  ss = map_stack_store(file, xres, yres);
+  if (ss == NULL) {
+    fprintf(stderr,"Could not read back stack store %s\n",file);
+    exit(0);
+  }
+  return ss;
+}
+
+// one stack's store, with every month of the used layers
+stack_store* open_stack_store (const char *file, const int *used, const char *scen, const char *period,
+                               const int xres, const int yres) {
+  stack_entry *e = (stack_entry *)malloc(MAXSTACKGRIDS*sizeof(stack_entry));
+  const int n = stack_entries(used, scen, period, e);
+  stack_store *ss = open_store(file, e, n, xres, yres);
+  free(e);
+  return ss;
+}
+
+
+/*
+ * many slices at once, each one a month (-allmonths) or a scenario and
+ * period: only some layers change from slice to slice, so the cost of
+ * the rest is scored once, and each slice (on its own thread) adds its
+ * own to that; costs are kept only for the land, and the frames share
+ * one range so they can be compared
+ */
+#ifndef IDEALPLACE_LIB
+static const char *month_names[12] = { "January", "February", "March", "April", "May", "June",
+                                       "July", "August", "September", "October", "November", "December" };
+#endif
+
+#define MAXSLICES 16	// every month, or the stacks and the robust one
+
+typedef struct slice_job {
+  int xres, yres;
+  int n;			// slices
+  int p, aggmode;
+  float (*ideal)[15];		// only the changing layers' ideals are set
+  float (*extra_ideal)[MAXEXTRA];
+  float (*penalty)[NCOSTS];
+  const float *weight;
+  likeset **likes;		// all NULL
+  const float *mult;		// from the full scorer, for -agg norm
+  const constraints *cons;	// on the changing layers
+  int used[MAXLAYERS];		// the changing layers that are read
+  int imonth[MAXSLICES];
+  const char *scen[MAXSLICES], *period[MAXSLICES];
+  stack_store *store[MAXSLICES];	// or NULL to read the pngs
+  char label[MAXSLICES][80];
+  float **fixed;		// the cost of the other layers, <0 where not scored
+  float **temp;			// the land, if it doesn't change
+  long *start[MAXSLICES];	// each row's first land pixel, by slice
+  unsigned char *land[MAXSLICES];	// one bit per pixel, by slice
+  float *cost[MAXSLICES];	// [slice][land pixel]
+  score_range sr[MAXSLICES];
+  float lo, hi;
+  float **bdry;			// or NULL
+  char frame[MAXSLICES][255];
+} slice_job;
+
+// a stack's name, like ssp245_2041-2070
+void stack_label (const char *scen, const char *period, char *label) {
+  snprintf(label, 80, "%s%s%s", scen, (scen[0] && period[0]) ? "_" : "", period);
+}
+
+// output file name with a slice's name before its extension, like the inputs
+void slice_file (const char *outfile, const char *slice, char *name) {
+  const char *dot = strrchr(outfile, '.');
+  const int n = dot ? (int)(dot-outfile) : (int)strlen(outfile);
+  snprintf(name, 255, "%.*s_%s%s", n, outfile, slice, dot ? dot : ".png");
+}
+
+// one slice's changing layers, whole grids from the pngs or rows from a store
+typedef struct slice_layers {
+  float **grid[MAXLAYERS];
+  const unsigned short *q[MAXLAYERS];
+  float *buf[MAXLAYERS];
+} slice_layers;
+
+static float* slice_row (slice_layers *sl, const int l, const int row, const int xres) {
+  if (sl->grid[l]) return sl->grid[l][row];
+  const unsigned short *q = sl->q[l] + (long)row*xres;
+  const float scale = layer_range[l] / 65534.f;
+  for (int col=0; col<xres; ++col) sl->buf[l][col] = layer_min[l] + scale*q[col];
+  return sl->buf[l];
+}
+
+#ifndef IDEALPLACE_LIB
+static void slice_costs (void *arg, const int lo, const int hi, const int ithread) {
+  slice_job *mj = (slice_job *)arg;
+  const int xres = mj->xres;
+  char infile[255];
+  for (int k=lo; k<hi; ++k) {
+    slice_layers sl;
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      sl.grid[l] = NULL;
+      sl.q[l] = NULL;
+      sl.buf[l] = NULL;
+      if (!mj->used[l]) continue;
+      stack_layer_file(l, mj->imonth[k], mj->scen[k], mj->period[k], infile, sizeof(infile));
+      if (mj->store[k]) {
+        sl.q[l] = stack_grid(mj->store[k], infile, layer_min[l], layer_range[l]);
+        sl.buf[l] = (float*)malloc(xres*sizeof(float));
+      } else {
+        sl.grid[l] = read_layer_grid(infile, xres, mj->yres, layer_min[l], layer_range[l]);
+      }
+    }
+
+    // this slice's land, where the other layers were scored
+    long *start = mj->start[k] = (long*)malloc((mj->yres+1)*sizeof(long));
+    unsigned char *land = mj->land[k] = (unsigned char*)calloc(((long)xres*mj->yres+7)/8, 1);
+    start[0] = 0;
+    for (int row=0; row<mj->yres; ++row) {
+      const float *temp = mj->temp ? mj->temp[row] : slice_row(&sl, L_TEMPW, row, xres);
+      long n = 0;
+      for (int col=0; col<xres; ++col) {
+        if (temp[col] > -29.9f && mj->fixed[row][col] >= 0.f) {
+          const long i = (long)row*xres + col;
+          land[i>>3] |= 1 << (i&7);
+          ++n;
+        }
+      }
+      start[row+1] = start[row] + n;
+    }
+    mj->cost[k] = (float*)malloc(start[mj->yres]*sizeof(float));
+
+    scorer sc;
+    init_scorer(&sc, mj->p, mj->aggmode, mj->ideal, mj->extra_ideal, mj->penalty, mj->weight, mj->likes, NULL, xres, mj->yres);
+    memcpy(sc.mult, mj->mult, mj->p*sizeof(float));
+    constraints cons = *mj->cons;
+
+    float* vals[MAXLAYERS] = { NULL };
+    float* out = (float*)malloc(xres*sizeof(float));
+    int* cand = (int*)malloc(xres*sizeof(int));
+    int* keep = (int*)malloc(xres*sizeof(int));
+    init_score_range(&mj->sr[k]);
+    for (int row=0; row<mj->yres; ++row) {
+      const float *fixed = mj->fixed[row];
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (mj->used[l]) vals[l] = slice_row(&sl, l, row, xres);
+      }
+      if (mj->temp) vals[L_TEMPW] = mj->temp[row];
+
+      int ncand = land_row(vals[L_TEMPW], xres, out, cand);
+      int n = 0;
+      for (int i=0; i<ncand; ++i) {
+        if (fixed[cand[i]] >= 0.f) cand[n++] = cand[i];
+        else out[cand[i]] = -1.f;
+      }
+      ncand = n;
+      memcpy(keep, cand, n*sizeof(int));
+      if (cons.n) ncand = constrain_row(&cons, vals, cand, ncand, out);
+      score_row(&sc, row, vals, cand, ncand, out);
+      for (int i=0; i<ncand; ++i) out[cand[i]] += fixed[cand[i]];
+      track_score_range(out, xres, row, &mj->sr[k]);
+
+      float *cost = mj->cost[k] + start[row];
+      for (int i=0; i<n; ++i) cost[i] = out[keep[i]];
+    }
+    printf("  %s: min and max range %g %g\n", mj->label[k], mj->sr[k].lo, mj->sr[k].hi);
+
+    free(out);
+    free(cand);
+    free(keep);
+    free_scorer(&sc);
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (sl.grid[l]) free_2d_array_f(sl.grid[l]);
+      free(sl.buf[l]);
+    }
+  }
+}
+#endif
+
+// one row of a slice's costs, with -1 where it wasn't scored
+static void slice_cost_row (const slice_job *mj, const int k, const int row, float *out) {
+  const unsigned char *land = mj->land[k];
+  const float *cost = mj->cost[k] + mj->start[k][row];
+  for (int col=0; col<mj->xres; ++col) {
+    const long i = (long)row*mj->xres + col;
+    out[col] = (land[i>>3] >> (i&7) & 1) ? *cost++ : -1.f;
+  }
+}
+
+#ifndef IDEALPLACE_LIB
+static void slice_frames (void *arg, const int lo, const int hi, const int ithread) {
+  slice_job *mj = (slice_job *)arg;
+  const int xres = mj->xres;
+  float* out = (float*)malloc(xres*sizeof(float));
+  for (int k=lo; k<hi; ++k) {
+    png_out po;
+    (void)open_png_out(mj->frame[k], xres, mj->yres, &po);
+    for (int row=mj->yres-1; row>=0; --row) {
+      slice_cost_row(mj, k, row, out);
+      finalize_row(out, xres, mj->lo, mj->hi);
+      if (mj->bdry) {
+        const float *bdry = mj->bdry[row];
+        for (int col=0; col<xres; ++col) {
+          if (bdry[col] > out[col]) out[col] = bdry[col];
+        }
+      }
+      (void)write_png_row(&po, out, 0.f, 1.f);
+    }
+    (void)close_png_out(&po);
+  }
+  free(out);
+}
+#endif
+
+/*
+ * robust across the slices: each place's worst cost of them all, so it
+ * is only as good as its worst scenario, and only where every slice
+ * scored it; this is one more slice, after the others
+ */
+void robust_slice (slice_job *mj) {
+  const int n = mj->n;
+  const int xres = mj->xres;
+  long npix = mj->start[0][mj->yres];
+  for (int k=1; k<n; ++k) if (mj->start[k][mj->yres] < npix) npix = mj->start[k][mj->yres];
+  long *start = mj->start[n] = (long*)malloc((mj->yres+1)*sizeof(long));
+  unsigned char *land = mj->land[n] = (unsigned char*)calloc(((long)xres*mj->yres+7)/8, 1);
+  float *cost = mj->cost[n] = (float*)malloc(npix*sizeof(float));
+  float* out = (float*)malloc(xres*sizeof(float));
+  float* worst = (float*)malloc(xres*sizeof(float));
+  init_score_range(&mj->sr[n]);
+  start[0] = 0;
+  for (int row=0; row<mj->yres; ++row) {
+    for (int col=0; col<xres; ++col) worst[col] = 0.f;
+    for (int k=0; k<n; ++k) {
+      slice_cost_row(mj, k, row, out);
+      for (int col=0; col<xres; ++col) worst[col] = (out[col] < 0.f || worst[col] < 0.f) ? -1.f : fmaxf(worst[col], out[col]);
+    }
+    long m = start[row];
+    for (int col=0; col<xres; ++col) {
+      if (worst[col] < 0.f) continue;
+      const long i = (long)row*xres + col;
+      land[i>>3] |= 1 << (i&7);
+      cost[m++] = worst[col];
+    }
+    start[row+1] = m;
+    track_score_range(worst, xres, row, &mj->sr[n]);
+  }
+  free(out);
+  free(worst);
+}
+
+/*
+ * how much each place's score changes from slice a to slice b, as
+ * 0.5 for no change, brighter where b is better, and black for ocean
+ */
+void slice_delta (const slice_job *mj, const int a, const int b, char *file) {
+  const int xres = mj->xres;
+  float* fa = (float*)malloc(xres*sizeof(float));
+  float* fb = (float*)malloc(xres*sizeof(float));
+  float* out = (float*)malloc(xres*sizeof(float));
+  long nland = 0, nbetter = 0, nworse = 0;
+  png_out po;
+  (void)open_png_out(file, xres, mj->yres, &po);
+  for (int row=mj->yres-1; row>=0; --row) {
+    slice_cost_row(mj, a, row, fa);
+    slice_cost_row(mj, b, row, fb);
+    for (int col=0; col<xres; ++col) out[col] = (fa[col] >= 0.f && fb[col] >= 0.f);
+    finalize_row(fa, xres, mj->lo, mj->hi);
+    finalize_row(fb, xres, mj->lo, mj->hi);
+    for (int col=0; col<xres; ++col) {
+      if (out[col] == 0.f) continue;
+      const float d = fb[col] - fa[col];
+      out[col] = 0.5f + 0.5f*d;
+      ++nland;
+      if (d > 0.001f) ++nbetter;
+      else if (d < -0.001f) ++nworse;
+    }
+    if (mj->bdry) {
+      const float *bdry = mj->bdry[row];
+      for (int col=0; col<xres; ++col) {
+        if (bdry[col] > out[col]) out[col] = bdry[col];
+      }
+    }
+    (void)write_png_row(&po, out, 0.f, 1.f);
+  }
+  (void)close_png_out(&po);
+  if (nland == 0) nland = 1;
+  printf("From %s to %s, %.1f%% of the land scores better and %.1f%% worse, drawn in %s\n",
+         mj->label[a], mj->label[b], 100.0*nbetter/nland, 100.0*nworse/nland, file);
+  free(fa);
+  free(fb);
+  free(out);
+}
+
+
+/*
+ * serving map tiles: the finished image stays in memory with overviews
+ * that halve it at each level, every z/x/y tile in web mercator is drawn
+ * from the coarsest level that is still at least as fine as the tile, and
+ * encoded tiles are kept in a least-recently-used cache
+ */
+#define TILE_SIZE 256
+#define TILE_MAXZOOM 24
+#define TILE_CACHE 4096		// encoded tiles kept
+#define TILE_BUCKETS 8192	// power of 2
+#define TILE_LEVELS 32
+#define TILE_CONNS 256		// connections still sending their request
+#define TILE_QUEUE 256		// requests waiting for a worker
+#define TILE_TIMEOUT 5		// seconds a client gets to send or take a reply
+
+typedef struct tile_entry {
+  unsigned long key;
+  png_byte *png;
+  size_t len;
+  int prev, next;	// most recently used first
+  int hnext;		// next in the same bucket
+} tile_entry;
+
+typedef struct tile_server {
+  int nlevels;
+  int nx[TILE_LEVELS], ny[TILE_LEVELS];
+  float **score[TILE_LEVELS];	// level 0 is the image itself
+  float **bdry[TILE_LEVELS];	// or NULL
+  int sock;
+  pthread_mutex_t lock;
+  // complete requests, from the one thread that reads them to the workers
+  struct { int fd, z, x, y, ok; } req[TILE_QUEUE];
+  int qhead, qn;
+  pthread_cond_t ready;
+  tile_entry *e;
+  int n, head, tail;
+  int bucket[TILE_BUCKETS];
+  long hits, misses;
+} tile_server;
+
+// a png encoded into memory
+typedef struct png_buf {
+  png_byte *data;
+  size_t len, cap;
+} png_buf;
+
+typedef struct halve_job {
+  float **src, **dst;
+  int nx, ny;
+  int usemax;		// for lines, which would fade if averaged
+} halve_job;
+
+static void halve_rows (void *arg, const int lo, const int hi, const int ithread) {
+  const halve_job *hj = (const halve_job *)arg;
+  const int nx = hj->nx;
+  for (int row=lo; row<hi; ++row) {
+    const float *s0 = hj->src[2*row];
+    const float *s1 = hj->src[(2*row+1 < hj->ny) ? 2*row+1 : 2*row];
+    float *d = hj->dst[row];
+    for (int col=0; col<(nx+1)/2; ++col) {
+      const int c0 = 2*col;
+      const int c1 = (c0+1 < nx) ? c0+1 : c0;
+      if (hj->usemax) d[col] = fmaxf(fmaxf(s0[c0], s0[c1]), fmaxf(s1[c0], s1[c1]));
+      else d[col] = 0.25f*(s0[c0] + s0[c1] + s1[c0] + s1[c1]);
+    }
+  }
+}
+
+static float** halve_grid (float **src, const int nx, const int ny, const int usemax) {
+  halve_job hj = { src, allocate_2d_array_f((ny+1)/2, (nx+1)/2), nx, ny, usemax };
+  parallel_for(nthreads, (ny+1)/2, halve_rows, &hj);
+  return hj.dst;
+}
+
+// each tile is small, so every level fits below a few times the image
+void build_tile_levels (tile_server *ts, float **score, float **bdry, const int xres, const int yres) {
+  ts->nlevels = 1;
+  ts->nx[0] = xres;
+  ts->ny[0] = yres;
+  ts->score[0] = score;
+  ts->bdry[0] = bdry;
+  while (ts->nlevels < TILE_LEVELS && ts->nx[ts->nlevels-1] > TILE_SIZE) {
+    const int l = ts->nlevels++;
+    const int nx = ts->nx[l-1];
+    const int ny = ts->ny[l-1];
+    ts->nx[l] = (nx+1)/2;
+    ts->ny[l] = (ny+1)/2;
+    ts->score[l] = halve_grid(ts->score[l-1], nx, ny, FALSE);
+    ts->bdry[l] = bdry ? halve_grid(ts->bdry[l-1], nx, ny, TRUE) : NULL;
+  }
+}
+
+// sample one tile, top row first, from the nearest pixels
+void render_tile (const tile_server *ts, const int z, const int x, const int y, float *img) {
+  // pixels around the world at this zoom
+  const double n = (double)TILE_SIZE * (double)(1L << z);
+  int lev = 0;
+  while (lev+1 < ts->nlevels && ts->nx[lev+1] >= n) ++lev;
+  const int nx = ts->nx[lev];
+  const int ny = ts->ny[lev];
+
+  int cols[TILE_SIZE];
+  for (int px=0; px<TILE_SIZE; ++px) {
+    int col = (int)(nx * ((double)x*TILE_SIZE + px + 0.5) / n);
+    cols[px] = (col < nx) ? col : nx-1;
+  }
+  for (int py=0; py<TILE_SIZE; ++py) {
+    const double merc = M_PI * (1.0 - 2.0*((double)y*TILE_SIZE + py + 0.5) / n);
+    int row = (int)(ny * (atan(sinh(merc))/M_PI + 0.5));
+    if (row < 0) row = 0;
+    else if (row > ny-1) row = ny-1;
+    const float *score = ts->score[lev][row];
+    const float *bdry = ts->bdry[lev] ? ts->bdry[lev][row] : NULL;
+    float *out = img + py*TILE_SIZE;
+    for (int px=0; px<TILE_SIZE; ++px) {
+      const float v = score[cols[px]];
+      out[px] = (bdry && bdry[cols[px]] > v) ? bdry[cols[px]] : v;
+    }
+  }
+}
+
+static void png_buf_write (png_structp png_ptr, png_bytep data, png_size_t len) {
+  png_buf *pb = (png_buf *)png_get_io_ptr(png_ptr);
+  if (pb->len + len > pb->cap) {
+    pb->cap = 2*(pb->len + len);
+    pb->data = (png_byte *)realloc(pb->data, pb->cap);
+  }
+  memcpy(pb->data + pb->len, data, len);
+  pb->len += len;
+}
+
+static void png_buf_flush (png_structp png_ptr) {
+  (void)png_ptr;
+}
+
+/*
+ * encode one tile as an 8-bit grey png, with the same scaling and gamma
+ * as write_png; the tiles are small, so favour speed over size
+ */
+int encode_tile (const float *img, png_buf *pb) {
+
+  // must do 5/9 for stuff to look right on Macs, see write_png
+  float gamma = .55555;
+  png_byte row[TILE_SIZE];
+
+  pb->len = 0;
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (png_ptr == NULL) return(-1);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (info_ptr == NULL) {
+    png_destroy_write_struct(&png_ptr,(png_infopp)NULL);
+    return(-1);
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return(-1);
+  }
+
+  png_set_write_fn(png_ptr, pb, png_buf_write, png_buf_flush);
+  png_set_compression_level(png_ptr, 1);
+  png_set_IHDR(png_ptr, info_ptr, TILE_SIZE, TILE_SIZE, 8,
+    PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+    PNG_FILTER_TYPE_BASE);
+  png_set_gAMA(png_ptr, info_ptr, gamma);
+  png_write_info(png_ptr, info_ptr);
+  for (int j=0; j<TILE_SIZE; ++j) {
+    for (int i=0; i<TILE_SIZE; ++i) {
+      int printval = (int)(0.5 + 254*img[j*TILE_SIZE+i]);
+      if (printval<0) printval = 0;
+      else if (printval>255) printval = 255;
+      row[i] = (png_byte)printval;
+    }
+    png_write_row(png_ptr, row);
+  }
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  return(0);
+}
+
+// the tile's coordinates make a unique key, and a well-mixed bucket
+static inline unsigned long tile_key (const int z, const int x, const int y) {
+  return ((unsigned long)z << 52) | ((unsigned long)x << 26) | (unsigned long)y;
+}
+
+static inline int tile_bucket (const unsigned long key) {
+  return (int)((key * 0x9E3779B97F4A7C15UL) >> 51) & (TILE_BUCKETS-1);
+}
+
+static void tile_unlink (tile_server *ts, const int i) {
+  tile_entry *e = &ts->e[i];
+  if (e->prev >= 0) ts->e[e->prev].next = e->next;
+  else ts->head = e->next;
+  if (e->next >= 0) ts->e[e->next].prev = e->prev;
+  else ts->tail = e->prev;
+}
+
+static void tile_push_front (tile_server *ts, const int i) {
+  ts->e[i].prev = -1;
+  ts->e[i].next = ts->head;
+  if (ts->head >= 0) ts->e[ts->head].prev = i;
+  ts->head = i;
+  if (ts->tail < 0) ts->tail = i;
+}
+
+// copy out a cached tile, call with the lock held
+static int tile_cache_get (tile_server *ts, const unsigned long key, png_buf *pb) {
+  for (int i=ts->bucket[tile_bucket(key)]; i>=0; i=ts->e[i].hnext) {
+    if (ts->e[i].key != key) continue;
+    tile_unlink(ts, i);
+    tile_push_front(ts, i);
+    if (ts->e[i].len > pb->cap) {
+      pb->cap = ts->e[i].len;
+      pb->data = (png_byte *)realloc(pb->data, pb->cap);
+    }
+    memcpy(pb->data, ts->e[i].png, ts->e[i].len);
+    pb->len = ts->e[i].len;
+    return(TRUE);
+  }
+  return(FALSE);
+}
+
+// keep a copy of a new tile, dropping the least recently used one if full
+static void tile_cache_put (tile_server *ts, const unsigned long key, const png_buf *pb) {
+  const int b = tile_bucket(key);
+  for (int i=ts->bucket[b]; i>=0; i=ts->e[i].hnext) {
+    if (ts->e[i].key == key) return;	// another thread got here first
+  }
+  int i;
+  if (ts->n < TILE_CACHE) {
+    i = ts->n++;
+  } else {
+    i = ts->tail;
+    tile_unlink(ts, i);
+    int *pi = &ts->bucket[tile_bucket(ts->e[i].key)];
+    while (*pi != i) pi = &ts->e[*pi].hnext;
+    *pi = ts->e[i].hnext;
+    free(ts->e[i].png);
+  }
+  ts->e[i].key = key;
+  ts->e[i].png = (png_byte *)malloc(pb->len);
+  memcpy(ts->e[i].png, pb->data, pb->len);
+  ts->e[i].len = pb->len;
+  ts->e[i].hnext = ts->bucket[b];
+  ts->bucket[b] = i;
+  tile_push_front(ts, i);
+}
+
+static void send_all (const int fd, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    const ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+    if (sent <= 0) return;
+    p += sent;
+    len -= sent;
+  }
+}
+
+static void send_reply (const int fd, const char *status, const char *type, const void *body, const size_t len) {
+  char head[255];
+  const int n = sprintf(head, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                        "Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n", status, type, len);
+  send_all(fd, head, n);
+  send_all(fd, body, len);
+}
+
+// every worker takes the next complete request, and replies to it
+static void* tile_worker (void *arg) {
+  tile_server *ts = (tile_server *)arg;
+  float *img = (float *)malloc(TILE_SIZE*TILE_SIZE*sizeof(float));
+  png_buf pb = { NULL, 0, 0 };
+  for (;;) {
+    pthread_mutex_lock(&ts->lock);
+    while (ts->qn == 0) pthread_cond_wait(&ts->ready, &ts->lock);
+    const int fd = ts->req[ts->qhead].fd;
+    const int z = ts->req[ts->qhead].z;
+    const int x = ts->req[ts->qhead].x;
+    const int y = ts->req[ts->qhead].y;
+    const int ok = ts->req[ts->qhead].ok;
+    ts->qhead = (ts->qhead+1) % TILE_QUEUE;
+    ts->qn--;
+    pthread_mutex_unlock(&ts->lock);
+    if (!ok) {
+      send_reply(fd, "404 Not Found", "text/plain", "no such tile\n", 13);
+      close(fd);
+      continue;
+    }
+
+    const unsigned long key = tile_key(z, x, y);
+    pthread_mutex_lock(&ts->lock);
+    int hit = tile_cache_get(ts, key, &pb);
+    if (hit) ts->hits++;
+    else ts->misses++;
+    pthread_mutex_unlock(&ts->lock);
+    if (!hit) {
+      render_tile(ts, z, x, y, img);
+      if (encode_tile(img, &pb)) {
+        send_reply(fd, "500 Internal Server Error", "text/plain", "could not encode tile\n", 22);
+        close(fd);
+        continue;
+      }
+      pthread_mutex_lock(&ts->lock);
+      tile_cache_put(ts, key, &pb);
+      pthread_mutex_unlock(&ts->lock);
+    }
+    send_reply(fd, "200 OK", "image/png", pb.data, pb.len);
+    close(fd);
+  }
+  return NULL;
+}
+
+// hand a connection whose request line has arrived to the workers
+static void tile_enqueue (tile_server *ts, const int fd, char *line) {
+  int z = 0, x = 0, y = 0;
+  const int ok = sscanf(line, "GET /%d/%d/%d.png", &z, &x, &y) == 3 &&
+                 z >= 0 && z <= TILE_MAXZOOM && x >= 0 && y >= 0 && x < (1 << z) && y < (1 << z);
+  // a slow reader can only hold up one worker, and not for long
+  const struct timeval tv = { TILE_TIMEOUT, 0 };
+  (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  pthread_mutex_lock(&ts->lock);
+  if (ts->qn == TILE_QUEUE) {
+    pthread_mutex_unlock(&ts->lock);
+    close(fd);
+    return;
+  }
+  const int i = (ts->qhead + ts->qn++) % TILE_QUEUE;
+  ts->req[i].fd = fd;
+  ts->req[i].z = z;
+  ts->req[i].x = x;
+  ts->req[i].y = y;
+  ts->req[i].ok = ok;
+  pthread_cond_signal(&ts->ready);
+  pthread_mutex_unlock(&ts->lock);
+}
+
+/*
+ * accept connections and gather their request lines without blocking,
+ * so that idle or slow clients never hold a worker; any that take more
+ * than TILE_TIMEOUT seconds are dropped
+ */
+static void tile_acceptor (tile_server *ts) {
+  struct pollfd pfd[TILE_CONNS+1];
+  char *buf = (char *)malloc(TILE_CONNS*1024);
+  int got[TILE_CONNS];
+  time_t since[TILE_CONNS];
+  int nconn = 0;
+  pfd[0].fd = ts->sock;
+  pfd[0].events = POLLIN;
+  for (;;) {
+    if (poll(pfd, nconn+1, 1000) < 0) continue;
+    const time_t now = time(NULL);
+    for (int i=nconn-1; i>=0; --i) {
+      struct pollfd *c = &pfd[i+1];
+      char *line = buf + (long)i*1024;
+      int done = FALSE, drop = (now - since[i] > TILE_TIMEOUT);
+      if (!drop && (c->revents & (POLLIN|POLLHUP|POLLERR))) {
+        const ssize_t n = recv(c->fd, line+got[i], 1023-got[i], 0);
+        if (n <= 0) drop = TRUE;
+        else {
+          got[i] += n;
+          line[got[i]] = '\0';
+          // only the request line matters
+          done = (strchr(line, '\n') != NULL || got[i] == 1023);
+        }
+      }
+      if (done) tile_enqueue(ts, c->fd, line);
+      else if (drop) close(c->fd);
+      if (done || drop) {
+        // the last connection takes this one's place
+        --nconn;
+        pfd[i+1] = pfd[nconn+1];
+        got[i] = got[nconn];
+        since[i] = since[nconn];
+        if (i < nconn) memcpy(line, buf + (long)nconn*1024, got[i]+1);
+      }
+    }
+    if (pfd[0].revents & POLLIN) {
+      const int fd = accept(ts->sock, NULL, NULL);
+      if (fd < 0) continue;
+      if (nconn == TILE_CONNS) {
+        close(fd);
+        continue;
+      }
+      (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      pfd[nconn+1].fd = fd;
+      pfd[nconn+1].events = POLLIN;
+      pfd[nconn+1].revents = 0;
+      got[nconn] = 0;
+      since[nconn] = now;
+      ++nconn;
+    }
+  }
+}
+
+/*
+ * serve the finished image (0 to 1, south row first) as map tiles on
+ * a local port until killed
+ */
+void serve_tiles (float **score, float **bdry, const int xres, const int yres, const int port) {
+  static tile_server ts;
+  build_tile_levels(&ts, score, bdry, xres, yres);
+  ts.e = (tile_entry *)malloc(TILE_CACHE*sizeof(tile_entry));
+  ts.n = ts.hits = ts.misses = 0;
+  ts.head = ts.tail = -1;
+  for (int b=0; b<TILE_BUCKETS; ++b) ts.bucket[b] = -1;
+  pthread_mutex_init(&ts.lock, NULL);
+  pthread_cond_init(&ts.ready, NULL);
+  ts.qhead = ts.qn = 0;
+
+  ts.sock = socket(AF_INET, SOCK_STREAM, 0);
+  const int on = 1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (ts.sock < 0 || setsockopt(ts.sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      bind(ts.sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(ts.sock, 64)) {
+    fprintf(stderr,"Could not listen on port %d\n",port);
+    fflush(stderr);
+    exit(0);
+  }
+  printf("Serving %d levels of tiles at http://localhost:%d/{z}/{x}/{y}.png\n", ts.nlevels, port);
+  fflush(stdout);
+  for (int i=0; i<nthreads; ++i) {
+    pthread_t th;
+    if (pthread_create(&th, NULL, tile_worker, &ts) == 0) pthread_detach(th);
+  }
+  tile_acceptor(&ts);
+}
+
+/*
+ * progressive previews: before the full layers are decoded, score the
+ * query on a 1 degree and then a 0.25 degree grid from small stores of
+ * every layer, kept in a directory, and write each as an image with its
+ * best place; the finer grid re-scores only the cells whose coarser cost
+ * was in the best PREVIEW_CUT of the range, or next to one, and fills in
+ * the rest from the coarser grid
+ */
+#define NPREVIEWS 2
+#define PREVIEW_CUT 0.25f
+static const float preview_deg[NPREVIEWS] = { 1.f, 0.25f };
+
+void write_previews (const char *dir, const char *outpng, const int p, const int mode, float ideal[][15],
+                     float extra_ideal[][MAXEXTRA], float penalty[][NCOSTS], const float *weight, route **routes,
+                     const constraints *cons, const int imonth, const int xres, const int drawbdry) {
+  likeset **nolikes = (likeset**)calloc(p, sizeof(likeset*));
+  float **prev = NULL;
+  char *near = NULL;
+  int px = 0, py = 0;
+
+  for (int lv=0; lv<NPREVIEWS; ++lv) {
+    const int cx = (int)(0.5f + 360.f/preview_deg[lv]);
+    const int cy = cx/2;
+    // no finer than the real thing
+    if (cx >= xres) break;
+
+    // every month of every layer, so that any later query can use it
+    int all[MAXLAYERS];
+    for (int l=0; l<NLAYERS+nextra; ++l) all[l] = TRUE;
+    stack_entry *e = (stack_entry *)malloc(MAXSTACKGRIDS*sizeof(stack_entry));
+    int n = stack_entries(all, nscen ? scen_names[0] : "", nperiod ? period_names[0] : "", e);
+    if (drawbdry) set_stack_entry(&e[n++], "natl_bdry.png", 0.f, 1.f);
+    char storefile[255];
+    if (snprintf(storefile, sizeof(storefile), "%s/preview_%dx%d.stack", dir, cx, cy) >= (int)sizeof(storefile)) {
+      fprintf(stderr,"Preview directory name %s is too long\n",dir);
+      exit(0);
+    }
+    stack_store *ss = open_store(storefile, e, n, cx, cy);
+    free(e);
+
+    slice_layers sl;
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      sl.grid[l] = NULL;
+      sl.q[l] = NULL;
+      sl.buf[l] = NULL;
+      if (l >= NLAYERS || layer_is_used(ideal, p, l) || constraint_uses(cons, l)) {
+        char f[255];
+        layer_file(l, imonth, f, sizeof(f));
+        sl.q[l] = stack_grid(ss, f, layer_min[l], layer_range[l]);
+        sl.buf[l] = (float*)malloc(cx*sizeof(float));
+      }
+    }
+
+    // a scorer of its own, and the constraints' counts stay with the full run
+    scorer sc;
+    init_scorer(&sc, p, mode, ideal, extra_ideal, penalty, weight, nolikes, routes, cx, cy);
+    constraints cs = *cons;
+    float** out = allocate_2d_array_f(cy,cx);
+    int* cand = (int*)malloc(cx*sizeof(int));
+    float* vals[MAXLAYERS];
+    score_range sr;
+    init_score_range(&sr);
+    long nscored = 0;
+    for (int row=0; row<cy; ++row) {
+      for (int l=0; l<NLAYERS+nextra; ++l) vals[l] = sl.q[l] ? slice_row(&sl, l, row, cx) : NULL;
+      int ncand = land_row(vals[L_TEMPW], cx, out[row], cand);
+      if (prev) {
+        const int prow = (int)((long)row*py/cy);
+        int nc = 0;
+        for (int i=0; i<ncand; ++i) {
+          const int col = cand[i];
+          const int pcol = (int)((long)col*px/cx);
+          if (near[(long)prow*px+pcol]) cand[nc++] = col;
+          else out[row][col] = (prev[prow][pcol] >= 0.f) ? prev[prow][pcol] : -1.f;
+        }
+        ncand = nc;
+      }
+      if (cs.n) ncand = constrain_row(&cs, vals, cand, ncand, out[row]);
+      score_row(&sc, row, vals, cand, ncand, out[row]);
+      nscored += ncand;
+      track_score_range(out[row], cx, row, &sr);
+    }
+    for (int l=0; l<NLAYERS+nextra; ++l) free(sl.buf[l]);
+    free(cand);
+    free_scorer(&sc);
+
+    if (sr.hi < sr.lo) {
+      printf("No place on Earth meets all of the requirements on the %g degree grid\n", preview_deg[lv]);
+      free_2d_array_f(out);
+      munmap(ss->map, ss->maplen);
+      free(ss);
+      break;
+    }
+    char how[64], suffix[32], file[255];
+    snprintf(how, sizeof(how), " on the %g degree grid", preview_deg[lv]);
+    snprintf(suffix, sizeof(suffix), "%gdeg", preview_deg[lv]);
+    slice_file(outpng, suffix, file);
+    printf("Scored %ld places%s, min and max range: %g %g\n", nscored, how, sr.lo, sr.hi);
+    print_best_place(&sr, cx, cy, how);
+
+    // draw a copy, the costs themselves guide the next grid
+    float** img = allocate_2d_array_f(cy,cx);
+    const unsigned short *bq = drawbdry ? stack_grid(ss, "natl_bdry.png", 0.f, 1.f) : NULL;
+    for (int row=0; row<cy; ++row) {
+      memcpy(img[row], out[row], cx*sizeof(float));
+      finalize_row(img[row], cx, sr.lo, sr.hi);
+      for (int col=0; bq && col<cx; ++col) {
+        const float b = bq[(long)row*cx+col] / 65534.f;
+        if (b > img[row][col]) img[row][col] = b;
+      }
+    }
+    (void)write_png(file,cx,cy,FALSE,TRUE, img,0.f,1.f, NULL,0.0,1.0, NULL,0.0,1.0);
+    printf("Wrote the preview to %s\n", file);
+    fflush(stdout);
+    free_2d_array_f(img);
+    munmap(ss->map, ss->maplen);
+    free(ss);
+
+    // the cells near the best, and their neighbors, are worth a closer look
+    const float cut = sr.lo + PREVIEW_CUT*(sr.hi-sr.lo);
+    free(near);
+    near = (char *)calloc((long)cx*cy, 1);
+    for (int row=0; row<cy; ++row) {
+      for (int col=0; col<cx; ++col) {
+        if (out[row][col] < 0.f || out[row][col] > cut) continue;
+        for (int r=row-1; r<=row+1; ++r) {
+          if (r < 0 || r >= cy) continue;
+          for (int c=col-1; c<=col+1; ++c) near[(long)r*cx+(c+cx)%cx] = 1;
+        }
+      }
+    }
+    if (prev) free_2d_array_f(prev);
+    prev = out;
+    px = cx;
+    py = cy;
+  }
+  if (prev) free_2d_array_f(prev);
+  free(near);
+  free(nolikes);
+}
+
+/*
+ * the preferences that make up one query: everyone's ideals and
+ * weights, the hard limits, and how to combine them
+ */
+typedef struct prefs {
+  int p;			// number of sets of preferences
+  int nalloc;			// and how many there is room for
+  float (*ideal)[15];		// under -100 means ignore this
+  float (*extra_ideal)[MAXEXTRA];
+  float (*penalty)[NCOSTS];	// penalty weight for distance from ideal
+  float *weight;
+  likeset **likes;		// sets of "like any of these" locations
+  route **routes;		// routes to stay close to
+  constraints cons;		// hard limits on layer values
+  int aggmode;
+  int topk;
+} prefs;
+
+// values for my hometown
+const float boston[15] = {
+  1.1f,		// Jan mean temp (-30..40 C)
+  24.5f,	// July mean temp (-30..40 C)
+  101.f,	// Annual average rain (0..1000 mm/mo)
+  0.516f,	// Annual average cloud cover (0..1)
+  3.75f,	// Average wind speed at 10m (0..25 m/s)
+  0.985f,	// Human Development Index (0..1), negative means don't use
+  -1.0f,	// Proximity to mountains (0..1), negative means don't use
+  42.35f,	// latitude (N degrees) - close to
+  -71.05f,	// longitude (E degrees) - close to
+  -999.f, -999.f,	// far from
+  -999.f, -999.f,	// climate like
+  -999.f, -999.f	// everything like
+};
+
+// begin another set of preferences, with nothing set and the default weights
+void add_person (prefs *q) {
+  const float default_penalty[NCOSTS] = { 0.05f, 1.5f, 5.0f, 1.0f, 5.0f, 5.0f, 2.5f, 5.0f };
+  if (q->p == q->nalloc) {
+    q->nalloc = q->nalloc ? 2*q->nalloc : 8;
+    q->ideal = realloc(q->ideal, q->nalloc*sizeof(*q->ideal));
+    q->extra_ideal = realloc(q->extra_ideal, q->nalloc*sizeof(*q->extra_ideal));
+    q->penalty = realloc(q->penalty, q->nalloc*sizeof(*q->penalty));
+    q->weight = realloc(q->weight, q->nalloc*sizeof(float));
+    q->likes = realloc(q->likes, q->nalloc*sizeof(likeset*));
+    q->routes = realloc(q->routes, q->nalloc*sizeof(route*));
+  }
+  const int i = q->p++;
+  for (int j=0; j<15; ++j) q->ideal[i][j] = -999.f;
+  for (int j=0; j<NCOSTS; ++j) q->penalty[i][j] = default_penalty[j];
+  for (int j=0; j<MAXEXTRA; ++j) q->extra_ideal[i][j] = -999.f;
+  q->weight[i] = 1.f;
+  q->likes[i] = NULL;
+  q->routes[i] = NULL;
+}
+
+void init_prefs (prefs *q) {
+  q->p = q->nalloc = 0;
+  q->ideal = NULL;
+  q->extra_ideal = NULL;
+  q->penalty = NULL;
+  q->weight = NULL;
+  q->likes = NULL;
+  q->routes = NULL;
+  add_person(q);	// start with 1 set of preferences
+  q->cons.n = 0;
+  q->aggmode = AGG_SUM;
+  q->topk = 10;
+}
+
+void free_prefs (prefs *q) {
+  for (int ip=0; ip<q->p; ++ip) {
+    if (q->likes[ip]) free_likeset(q->likes[ip]);
+    if (q->routes[ip]) free_route(q->routes[ip]);
+  }
+  free(q->ideal);
+  free(q->extra_ideal);
+  free(q->penalty);
+  free(q->weight);
+  free(q->likes);
+  free(q->routes);
+}
+
+// an option's word, after any + or - in front of it, which scale its weight
+char* option_word (char *arg, float *weight_mult) {
+  *weight_mult = 1.f;
+  int j = 0;
+  for (j=0; j<50; ++j) {
+    if (arg[j] == '+') {
+      // weight remains 1 if this is the first character
+      *weight_mult *= (j==0) ? 1.f : 2.f;
+    } else if (arg[j] == '-') {
+      *weight_mult *= 0.5f;
+    } else {
+      // not a + or -, must be the argument
+      break;
+    }
+  }
+  return arg+j;
+}
+
+// once the layers are loaded, -layer can only pick among them
+int extras_fixed = FALSE;
+
+// a layer from the manifest, or any png on a 0..1 scale, as an extra
+// layer, and return which one it is
+int add_extra_layer (const char *name) {
+  int d = find_layer_def(name);
+  if (d >= 0 && d < NLAYERS) {
+    fprintf(stderr,"%s is a built-in layer, use its own option\n", name);
+    fail(0);
+  }
+  int k = 0;
+  while (k<nextra && extra_def[k] != d) ++k;
+  if (k == nextra && extras_fixed) {
+    fprintf(stderr,"%s is not one of the loaded layers\n", name);
+    fail(0);
+  }
+  if (d < 0) {
+    if (ndefs == MAXDEFS) {
+      fprintf(stderr,"No more than %d layers allowed\n", MAXDEFS-NLAYERS);
+      fail(0);
+    }
+    d = ndefs++;
+    layer_defs[d] = (layer_def){ "", "", 0.f, 1.f, "(0..1)", COST_LINEAR, 1.f };
+    snprintf(layer_defs[d].name, sizeof(layer_defs[d].name), "%s", name);
+    snprintf(layer_defs[d].file, sizeof(layer_defs[d].file), "%s", name);
+  }
+  if (k == MAXEXTRA) {
+    fprintf(stderr,"No more than %d extra layers allowed\n", MAXEXTRA);
+    fail(0);
+  }
+  if (k == nextra) {
+    extra_def[nextra++] = d;
+    layer_min[NLAYERS+k] = layer_defs[d].min;
+    layer_range[NLAYERS+k] = layer_defs[d].range;
+  }
+  return k;
+}
+
+/*
+ * apply option i if it's one of the preferences, and return how many
+ * arguments it used, or 0 if it's something else
+ */
+int parse_pref (prefs *q, const int argc, char **argv, const int i, const char *thisarg, const float weight_mult) {
+  float *ideal = q->ideal[q->p-1];
+  float *extra_ideal = q->extra_ideal[q->p-1];
+  float *penalty = q->penalty[q->p-1];
+  int j = i;
+
+  if (strncmp(thisarg, "boston", 2) == 0) {
+    // replace ideals for current person to Boston
+    for (int i=0; i<6; ++i) ideal[i] = boston[i];
+  } else if (strncmp(thisarg, "new", 2) == 0) {
+    // begin setting preferences for a new person
+    add_person(q);
+    printf("Setting ideals for person %d now\n", q->p);
+  } else if (strncmp(thisarg, "stc", 3) == 0) {
+    const float julylow = atof(argv[++j]);
+    const float julyhigh = atof(argv[++j]);
+    ideal[1] = 0.5*(julylow+julyhigh);
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal July temp to %g C\n", ideal[1]);
+  } else if (strncmp(thisarg, "stf", 3) == 0) {
+    const float julylow = atof(argv[++j]);
+    const float julyhigh = atof(argv[++j]);
+    ideal[1] = ftoc(0.5*(julylow+julyhigh));
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal July temp to %g C\n", ideal[1]);
+  } else if (strncmp(thisarg, "wtc", 3) == 0) {
+    const float janlow = atof(argv[++j]);
+    const float janhigh = atof(argv[++j]);
+    ideal[0] = 0.5*(janlow+janhigh);
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal Jan temp to %g C\n", ideal[0]);
+  } else if (strncmp(thisarg, "wtf", 3) == 0) {
+    const float janlow = atof(argv[++j]);
+    const float janhigh = atof(argv[++j]);
+    ideal[0] = ftoc(0.5*(janlow+janhigh));
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal Jan temp to %g C\n", ideal[0]);
+  } else if (strncmp(thisarg, "tc", 2) == 0) {
+    const float janlow = atof(argv[++j]);
+    const float janhigh = atof(argv[++j]);
+    const float julylow = atof(argv[++j]);
+    const float julyhigh = atof(argv[++j]);
+    ideal[0] = 0.5*(janlow+janhigh);
+    ideal[1] = 0.5*(julylow+julyhigh);
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal Jan, July temps to %g %g C\n", ideal[0], ideal[1]);
+  } else if (strncmp(thisarg, "tf", 2) == 0) {
+    const float janlow = atof(argv[++j]);
+    const float janhigh = atof(argv[++j]);
+    const float julylow = atof(argv[++j]);
+    const float julyhigh = atof(argv[++j]);
+    ideal[0] = ftoc(0.5*(janlow+janhigh));
+    ideal[1] = ftoc(0.5*(julylow+julyhigh));
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal Jan, July temps to %g %g C\n", ideal[0], ideal[1]);
+  } else if (strncmp(thisarg, "mtc", 3) == 0) {
+    const float janlow = atof(argv[++j]);
+    const float janhigh = atof(argv[++j]);
+    ideal[0] = 0.5*(janlow+janhigh);
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal temp to %g C\n", ideal[0]);
+  } else if (strncmp(thisarg, "mtf", 3) == 0) {
+    const float janlow = atof(argv[++j]);
+    const float janhigh = atof(argv[++j]);
+    ideal[0] = ftoc(0.5*(janlow+janhigh));
+    penalty[C_TEMP] *= weight_mult;
+    printf("  set ideal temp to %g C\n", ideal[0]);
+  } else if (strncmp(thisarg, "mr", 2) == 0) {
+    ideal[2] = atof(argv[++j]);
+    penalty[C_RAIN] *= weight_mult;
+    printf("  set ideal monthly rain to %g mm/mo\n", ideal[2]);
+  } else if (strncmp(thisarg, "ac", 2) == 0) {
+    ideal[3] = atof(argv[++j]);
+    penalty[C_CLOUD] *= weight_mult;
+    printf("  set ideal annual cloud cover to %g (1=100%%)\n", ideal[3]);
+  } else if (strncmp(thisarg, "wmps", 4) == 0) {
+    ideal[4] = atof(argv[++j]);
+    penalty[C_WIND] *= weight_mult;
+    printf("  set ideal wind speed to %g (m/s)\n", ideal[4]);
+  } else if (strncmp(thisarg, "wmph", 4) == 0) {
+    ideal[4] = 0.44704f*atof(argv[++j]);
+    penalty[C_WIND] *= weight_mult;
+    printf("  set ideal wind speed to %g (m/s)\n", ideal[4]);
+  } else if (strncmp(thisarg, "hdi", 3) == 0) {
+    ideal[5] = atof(argv[++j]);
+    penalty[C_HDI] *= weight_mult;
+    printf("  set ideal Human Development Index to %g (1=most)\n", ideal[5]);
+  } else if (strncmp(thisarg, "mtn", 3) == 0) {
+    ideal[6] = atof(argv[++j]);
+    penalty[C_MTN] *= weight_mult;
+    printf("  set ideal mountain proximity to %g (1=closest)\n", ideal[6]);
+  } else if (strncmp(thisarg, "ct", 2) == 0) {
+    j += parse_location(argc, argv, j, &ideal[7], &ideal[8]);
+    check_lat_lon(ideal[7], ideal[8]);
+    penalty[C_DIST] *= weight_mult;
+    printf("  prefer close to %g N %g E\n", ideal[7], ideal[8]);
+  } else if (strncmp(thisarg, "ff", 2) == 0) {
+    j += parse_location(argc, argv, j, &ideal[9], &ideal[10]);
+    check_lat_lon(ideal[9], ideal[10]);
+    penalty[C_DIST] *= weight_mult;
+    printf("  prefer far from %g N %g E\n", ideal[9], ideal[10]);
+  //} else if (strncmp(thisarg, "nw", 2) == 0) {
+    //ideal[6] = atof(argv[++j]);
+    //printf("  set ideal water proximity to %g (1=closest)\n", ideal[6]);
+  //} else if (strncmp(thisarg, "no", 2) == 0) {
+    //ideal[6] = atof(argv[++j]);
+    //printf("  set ideal ocean proximity to %g (1=closest)\n", ideal[6]);
+  } else if (strncmp(thisarg, "min", 3) == 0) {
+    const int l = layer_by_name(argv[++j]);
+    add_constraint(&q->cons, l, atof(argv[++j]), 9.9e+9);
+    printf("  require %s at least %g\n", layer_defs[l].name, atof(argv[j]));
+  } else if (strncmp(thisarg, "max", 3) == 0) {
+    const int l = layer_by_name(argv[++j]);
+    add_constraint(&q->cons, l, -9.9e+9, atof(argv[++j]));
+    printf("  require %s at most %g\n", layer_defs[l].name, atof(argv[j]));
+  } else if (strncmp(thisarg, "route", 3) == 0) {
+    if (q->routes[q->p-1]) free_route(q->routes[q->p-1]);
+    q->routes[q->p-1] = read_route(argv[++j]);
+    penalty[C_DIST] *= weight_mult;
+    printf("  prefer close to the %d segments of the route in %s\n", q->routes[q->p-1]->nseg, argv[j]);
+  } else if (strncmp(thisarg, "cl", 2) == 0) {
+    j += parse_location(argc, argv, j, &ideal[11], &ideal[12]);
+    check_lat_lon(ideal[11], ideal[12]);
+    printf("  prefer climate like %g N %g E\n", ideal[11], ideal[12]);
+  } else if (strncmp(thisarg, "el", 2) == 0) {
+    j += parse_location(argc, argv, j, &ideal[13], &ideal[14]);
+    check_lat_lon(ideal[13], ideal[14]);
+    printf("  prefer everything like %g N %g E\n", ideal[13], ideal[14]);
+  } else if (strncmp(thisarg, "weight", 3) == 0) {
+    q->weight[q->p-1] = atof(argv[++j]);
+    printf("  set weight of person %d to %g\n", q->p, q->weight[q->p-1]);
+  } else if (strncmp(thisarg, "agg", 3) == 0) {
+    const char *mode = argv[++j];
+    if (strncmp(mode, "sum", 1) == 0) q->aggmode = AGG_SUM;
+    else if (strncmp(mode, "max", 1) == 0) q->aggmode = AGG_MAX;
+    else if (strncmp(mode, "weighted", 1) == 0) q->aggmode = AGG_WEIGHTED;
+    else if (strncmp(mode, "norm", 1) == 0) q->aggmode = AGG_NORM;
+    else {
+      fprintf(stderr,"Aggregation mode must be sum, max, weighted, or norm\n");
+      fail(0);
+    }
+  } else if (strncmp(thisarg, "layer", 3) == 0) {
+    // a layer from the manifest, or any png on a 0..1 scale
+    char *name = argv[++j];
+    const int k = add_extra_layer(name);
+    const int d = extra_def[k];
+    extra_ideal[k] = atof(argv[++j]);
+    penalty[C_EXTRA] *= weight_mult;
+    printf("  set ideal %s to %g %s\n", name, extra_ideal[k], layer_defs[d].units);
+  } else if (strncmp(thisarg, "like", 4) == 0) {
+    q->likes[q->p-1] = read_likeset(argv[++j]);
+    printf("  prefer everything like any of %d locations in %s\n", q->likes[q->p-1]->n, argv[j]);
+  } else if (strncmp(thisarg, "topk", 4) == 0) {
+    q->topk = atoi(argv[++j]);
+    if (q->topk < 0) q->topk = 0;
+  } else {
+    return 0;
+  }
+  return j-i+1;
+}
+
+/*
+ * the layers held in memory to answer one query after another, each at
+ * its own resolution, as for a single run without -stream
+ */
+typedef struct engine {
+  int xres, yres, imonth;
+  float** layer[MAXLAYERS];
+  resampler* rs[MAXLAYERS];
+} engine;
+
+// fill in an engine from calloc, which free_engine can free even if
+// this fails part way
+void load_engine (engine *en, const int imonth) {
+  en->imonth = imonth;
+  char infile[255];
+  layer_file(L_TEMPW, imonth, infile, sizeof(infile));
+  (void)read_png_res(infile, &en->yres, &en->xres);
+  // every layer, since any query might match another place
+  for (int l=0; l<NLAYERS+nextra; ++l) {
+    layer_file(l, imonth, infile, sizeof(infile));
+    en->rs[l] = layer_resampler(infile, en->xres, en->yres);
+    const int nx = en->rs[l] ? en->rs[l]->nx : en->xres;
+    const int ny = en->rs[l] ? en->rs[l]->ny : en->yres;
+    en->layer[l] = allocate_2d_array_f(ny,nx);
+    (void)read_png(infile,nx,ny,FALSE,FALSE,1.0,FALSE,en->layer[l],layer_min[l],layer_range[l],NULL,0.0,1.0,NULL,0.0,1.0);
+  }
+  extras_fixed = TRUE;
+}
+
+void free_engine (engine *en) {
+  for (int l=0; l<MAXLAYERS; ++l) {
+    if (en->layer[l]) free_2d_array_f(en->layer[l]);
+    if (en->rs[l]) free_resampler(en->rs[l]);
+  }
+  free(en);
+}
+
+// a layer's value at the pixel nearest a location
+static float engine_value (const engine *en, const int l, const float degN, const float degE) {
+  const int nx = en->rs[l] ? en->rs[l]->nx : en->xres;
+  const int ny = en->rs[l] ? en->rs[l]->ny : en->yres;
+  int px, py;
+  latlon_to_px(degN, degE, nx, ny, &px, &py);
+  return en->layer[l][py][px];
+}
+
+/*
+ * turn the -el, -cl, and -like locations of a query into ideals and
+ * targets, from the layers in memory
+ */
+void prepare_query (const engine *en, prefs *q) {
+  for (int pass=0; pass<2; ++pass) {
+    const int islot = (pass==0) ? 13 : 11;
+    for (int ip=0; ip<q->p; ++ip) {
+      if (q->ideal[ip][islot] < -500.f) continue;
+      float vals[NLAYERS];
+      for (int l=0; l<NLAYERS; ++l) vals[l] = engine_value(en, l, q->ideal[ip][islot], q->ideal[ip][islot+1]);
+      set_ideals_like(q->ideal[ip], vals, en->imonth, pass==0);
+    }
+  }
+  for (int ip=0; ip<q->p; ++ip) {
+    likeset *ls = q->likes[ip];
+    if (ls == NULL) continue;
+    float (*tvals)[NLAYERS] = malloc(ls->n * sizeof(*tvals));
+    for (int i=0; i<ls->n; ++i) {
+      latlon_to_px(ls->loc[i][0], ls->loc[i][1], en->xres, en->yres, &ls->px[i], &ls->py[i]);
+      for (int l=0; l<NLAYERS; ++l) tvals[i][l] = engine_value(en, l, ls->loc[i][0], ls->loc[i][1]);
+    }
+    build_likeset(ls, tvals, q->penalty[ip], en->imonth, q->topk);
+    free(tvals);
+  }
+}
+
+/*
+ * score a prepared query into out, and each criterion into crit[c] if
+ * it's set, with -1 wherever a place isn't scored; this only reads the
+ * engine, so any number of queries can run on it at once
+ */
+void score_query (const engine *en, prefs *q, float **out, float **crit[NCRIT], score_range *sr, float *totals) {
+  const int xres = en->xres;
+  const int yres = en->yres;
+  constraints cons = q->cons;
+  scorer sc;
+  init_scorer(&sc, q->p, q->aggmode, q->ideal, q->extra_ideal, q->penalty, q->weight, q->likes, q->routes, xres, yres);
+  int keep = FALSE;
+  for (int c=0; c<NCRIT; ++c) if (crit && crit[c]) keep = TRUE;
+  if (keep) keep_criteria(&sc);
+
+  int* cand = (int*)malloc(xres*sizeof(int));
+  float* vals[MAXLAYERS];
+  for (int l=0; l<NLAYERS+nextra; ++l) {
+    vals[l] = en->rs[l] ? (float*)malloc(xres*sizeof(float)) : NULL;
+  }
+  init_score_range(sr);
+  for (int row=0; row<yres; ++row) {
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (!en->rs[l]) vals[l] = en->layer[l][row];
+    }
+    int ncand = land_row(vals[L_TEMPW], xres, out[row], cand);
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      const resampler *rs = en->rs[l];
+      if (rs) resample_row(rs, row, en->layer[l][rs->r0[row]], en->layer[l][rs->r1[row]], cand, ncand, vals[l]);
+    }
+    if (cons.n) ncand = constrain_row(&cons, vals, cand, ncand, out[row]);
+    score_row(&sc, row, vals, cand, ncand, out[row]);
+    for (int c=0; c<NCRIT && keep; ++c) {
+      if (!crit[c]) continue;
+      for (int col=0; col<xres; ++col) crit[c][row][col] = -1.f;
+      for (int i=0; i<ncand; ++i) crit[c][row][cand[i]] = sc.crit[c][i];
+    }
+    track_score_range(out[row], xres, row, sr);
+  }
+  for (int l=0; l<NLAYERS+nextra; ++l) {
+    if (en->rs[l]) free(vals[l]);
+  }
+  free(cand);
+
+  for (int c=0; c<NCOSTS; ++c) totals[c] = sc.totals[c];
+  totals[C_LIKE] = sc.total_like;
+  free_scorer(&sc);
+}
+
+#ifdef USE_MPI
+/*
+ * distributed runs: built with -DUSE_MPI and started under mpirun, every
+ * process streams the inputs but keeps and scores only its own band of
+ * latitudes, rank 0 the northernmost; the ranges, totals, and best
+ * matches are combined across them, and each deflates its band of the
+ * image so that rank 0 only has to stitch the pieces into one png
+ */
+int mpi_rank = 0;
+int mpi_size = 1;
+
+static void finish_mpi (void) {
+  MPI_Finalize();
+}
+
+void start_mpi (int *argc, char ***argv) {
+  MPI_Init(argc, argv);
+  atexit(finish_mpi);
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+
+  // split the cores among the processes that share them
+  MPI_Comm node;
+  int nlocal;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+  MPI_Comm_size(node, &nlocal);
+  MPI_Comm_free(&node);
+  nthreads = (nthreads/nlocal > 1) ? nthreads/nlocal : 1;
+
+  // only the first one talks
+  if (mpi_rank > 0 && freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr,"Could not silence process %d\n",mpi_rank);
+  }
+}
 
-  // first convert to xyz vectors
-  float v1[3];
-  float v2[3];
+// the rows of a yres-row grid that this process reports, south-up
+void band_rows (const int yres, int *lo, int *hi) {
+  *lo = yres - (int)((long)(mpi_rank+1)*yres/mpi_size);
+  *hi = yres - (int)((long)mpi_rank*yres/mpi_size);
+}
 
-  v1[0] = cosf(lon1)*cosf(lat1);
-  v1[1] = sinf(lon1)*cosf(lat1);
-  v1[2] = sinf(lat1);
-  v2[0] = cosf(lon2)*cosf(lat2);
-  v2[1] = sinf(lon2)*cosf(lat2);
-  v2[2] = sinf(lat2);
+// the lowest and highest cost anywhere, and the best pixel on the usual tie rule
+void reduce_score_range (score_range *sr, const int xres) {
+  struct { float v; int i; } in, out;
+  in.v = sr->lo;
+  // the southernmost, then westernmost, has the lowest index
+  in.i = (sr->bestrow >= 0) ? sr->bestrow*xres + sr->bestcol : INT_MAX;
+  MPI_Allreduce(&in, &out, 1, MPI_FLOAT_INT, MPI_MINLOC, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, &sr->hi, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+  sr->lo = out.v;
+  sr->bestrow = (out.i < INT_MAX) ? out.i / xres : -1;
+  sr->bestcol = (out.i < INT_MAX) ? out.i % xres : -1;
+}
 
-  const float dp = v1[0]*v2[0] + v1[1]*v2[1] + v1[2]*v2[2];
-  const float theta = asinf(1.f) - asinf(dp);
+// sum the costs and the constraints' counts onto rank 0
+void reduce_totals (scorer *sc, constraints *cons) {
+  void *totals = (mpi_rank == 0) ? MPI_IN_PLACE : sc->totals;
+  void *like = (mpi_rank == 0) ? MPI_IN_PLACE : &sc->total_like;
+  MPI_Reduce(totals, sc->totals, NCOSTS, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(like, &sc->total_like, 1, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  // each process may have put them in its own order
+  long count[2][MAXLAYERS];
+  memset(count, 0, sizeof(count));
+  for (int i=0; i<cons->n; ++i) {
+    count[0][cons->c[i].layer] = cons->c[i].tested;
+    count[1][cons->c[i].layer] = cons->c[i].passed;
+  }
+  MPI_Reduce((mpi_rank == 0) ? MPI_IN_PLACE : count, count, 2*MAXLAYERS, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  for (int i=0; i<cons->n; ++i) {
+    cons->c[i].tested = count[0][cons->c[i].layer];
+    cons->c[i].passed = count[1][cons->c[i].layer];
+  }
+}
 
-  return theta;
+// the best k matches of every band, in rank 0's heap
+void reduce_like_matches (likeset *ls, const int lo, const int hi) {
+  // drop those in rows that were scored only to be smoothed, the process
+  // that reports them has them too, and nothing it dropped can be better
+  int n = 0;
+  for (int i=0; i<ls->nbest; ++i) {
+    if (ls->best[i].row >= lo && ls->best[i].row < hi) ls->best[n++] = ls->best[i];
+  }
+  const int nbytes = n * sizeof(like_match);
+  int *counts = NULL, *displs = NULL;
+  like_match *all = NULL;
+  if (mpi_rank == 0) {
+    counts = (int *)malloc(mpi_size*sizeof(int));
+    displs = (int *)malloc(mpi_size*sizeof(int));
+  }
+  MPI_Gather(&nbytes, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (mpi_rank == 0) {
+    int total = 0;
+    for (int r=0; r<mpi_size; ++r) {
+      displs[r] = total;
+      total += counts[r];
+    }
+    all = (like_match *)malloc(total > 0 ? total : 1);
+  }
+  MPI_Gatherv(ls->best, nbytes, MPI_BYTE, all, counts, displs, MPI_BYTE, 0, MPI_COMM_WORLD);
+  if (mpi_rank == 0) {
+    const int nall = (displs[mpi_size-1] + counts[mpi_size-1]) / sizeof(like_match);
+    ls->nbest = 0;
+    for (int i=0; i<nall; ++i) like_push(ls, all[i].dist, all[i].row, all[i].col, all[i].target);
+    free(counts);
+    free(displs);
+    free(all);
+  }
 }
 
-// return great circle route distance in radians (0..pi) given pixel coords
-float gcr_dist_px (const int x1, const int y1, const int x2, const int y2, const int px, const int py) {
+// png and zlib numbers are big-endian
+static void put_be32 (unsigned char *b, const unsigned long v) {
+  b[0] = (v >> 24) & 0xff;
+  b[1] = (v >> 16) & 0xff;
+  b[2] = (v >> 8) & 0xff;
+  b[3] = v & 0xff;
+}
 
-  const float lat1 = 90.f - 180.f * (0.5f+y1) / (float)py;
-  const float lon1 = -180.f + 360.f * (0.5f+x1) / (float)px;
-  const float lat2 = 90.f - 180.f * (0.5f+y2) / (float)py;
-  const float lon2 = -180.f + 360.f * (0.5f+x2) / (float)px;
-  //printf("\npixel %d,%d is %gN %gE\n", x1, y1, lat1, lon1);
-  //printf("pixel %d,%d is %gN %gE\n", x2, y2, lat2, lon2);
-  //printf("distance is %g\n", gcr_dist (lat1, lon1, lat2, lon2));
-  const float degtorad = asinf(1.f) / 90.f;
+// one png chunk, its length and crc around the data
+static void write_png_chunk (FILE *fp, const char *type, const unsigned char *data, const unsigned long len) {
+  unsigned char be[4];
+  put_be32(be, len);
+  fwrite(be, 1, 4, fp);
+  fwrite(type, 1, 4, fp);
+  if (len) fwrite(data, 1, len, fp);
+  unsigned long crc = crc32(0L, (const Bytef *)type, 4);
+  crc = crc32(crc, data, len);
+  put_be32(be, crc);
+  fwrite(be, 1, 4, fp);
+}
 
-  return gcr_dist (degtorad*lat1, degtorad*lon1, degtorad*lat2, degtorad*lon2);
+// deflate some scanlines onto the end of a growing buffer
+static void band_deflate (z_stream *z, unsigned char *in, const long n, const int flush,
+                          unsigned char **buf, long *len, long *cap) {
+  z->next_in = in;
+  z->avail_in = n;
+  while (TRUE) {
+    if (*cap - *len < 65536) {
+      *cap = 2 * *cap + 65536;
+      *buf = (unsigned char *)realloc(*buf, *cap);
+    }
+    z->next_out = *buf + *len;
+    z->avail_out = *cap - *len;
+    const int ret = deflate(z, flush);
+    *len = *cap - z->avail_out;
+    if (ret == Z_STREAM_END || (flush != Z_FINISH && z->avail_in == 0 && z->avail_out > 0)) break;
+  }
 }
 
-// fail if input lat-lon are not usable
-void check_lat_lon( const float degN, const float degE) {
-  int fail = FALSE;
-  if (fabs(degN) > 90.f) {
-    fprintf(stderr,"ERROR: input latitude (%g) is not usable, try -90..90\n", degN); 
-    fail = TRUE;
+/*
+ * finalize this process's rows, overlay the boundaries, and deflate them
+ * as scanlines that don't refer to the rows above; the last band ends the
+ * stream, and rank 0 wraps them all in one zlib stream and png
+ */
+void write_png_band (char *outfile, float **outval, const int xres, const int yres, const int lo, const int hi,
+                     const int drawbdry, const float loval, const float hival) {
+  png_rows pr;
+  float *bdry = NULL;
+  if (drawbdry) {
+    bdry = (float*)malloc(xres*sizeof(float));
+    (void)open_png_rows("natl_bdry.png",xres,yres,0.0,1.0,&pr);
   }
-  if (fabs(degE) > 180.f) {
-    fprintf(stderr,"ERROR: input longitude (%g) is not usable, try -180..180\n", degN); 
-    fail = TRUE;
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  // raw deflate at libpng's default level
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr,"Could not start compressing the image\n");
+    exit(0);
+  }
+  const long linelen = 1 + 2*(long)xres;
+  unsigned char *line = (unsigned char *)malloc(linelen);
+  unsigned char *zbuf = NULL;
+  long zlen = 0, zcap = 0;
+  unsigned long adler = adler32(0L, Z_NULL, 0);
+  float outlo = 9.9e+9;
+  float outhi = -9.9e+9;
+
+  for (int row=yres-1; row>=lo; --row) {
+    if (drawbdry) (void)read_png_row(&pr, bdry);
+    if (row >= hi) continue;
+    float *out = outval[row];
+    finalize_row(out, xres, loval, hival);
+    // and include the boundaries only where they make the pixel brighter
+    for (int col=0; col<xres; ++col) {
+      if (drawbdry && bdry[col] > out[col]) out[col] = bdry[col];
+      if (out[col] < outlo) outlo = out[col];
+      if (out[col] > outhi) outhi = out[col];
+    }
+    // same scaling as write_png_row, then the Sub filter, which takes
+    // each byte from the one two bytes before it, without carrying
+    line[0] = 1;
+    int last = 0;
+    for (int col=0; col<xres; ++col) {
+      int printval = (int)(0.5 + 65534*out[col]);
+      if (printval<0) printval = 0;
+      else if (printval>65535) printval = 65535;
+      line[1+2*col] = (unsigned char)((printval >> 8) - (last >> 8));
+      line[2+2*col] = (unsigned char)((printval & 0xff) - (last & 0xff));
+      last = printval;
+    }
+    adler = adler32(adler, line, linelen);
+    band_deflate(&z, line, linelen, Z_NO_FLUSH, &zbuf, &zlen, &zcap);
+  }
+  band_deflate(&z, line, 0, (mpi_rank == mpi_size-1) ? Z_FINISH : Z_SYNC_FLUSH, &zbuf, &zlen, &zcap);
+  deflateEnd(&z);
+  if (drawbdry) {
+    (void)close_png_rows(&pr);
+    free(bdry);
+  }
+  free(line);
+
+  MPI_Reduce((mpi_rank == 0) ? MPI_IN_PLACE : &outlo, &outlo, 1, MPI_FLOAT, MPI_MIN, 0, MPI_COMM_WORLD);
+  MPI_Reduce((mpi_rank == 0) ? MPI_IN_PLACE : &outhi, &outhi, 1, MPI_FLOAT, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  // in rank order, north to south: a count, the checksum, then the bytes
+  const long nraw = (long)(hi-lo) * linelen;
+  if (mpi_rank > 0) {
+    long head[3] = { zlen, (long)adler, nraw };
+    MPI_Send(head, 3, MPI_LONG, 0, 0, MPI_COMM_WORLD);
+    for (long off=0; off<zlen; off+=(1L<<30)) {
+      const int n = (zlen-off < (1L<<30)) ? zlen-off : (1L<<30);
+      MPI_Send(zbuf+off, n, MPI_BYTE, 0, 1, MPI_COMM_WORLD);
+    }
+    free(zbuf);
+    return;
+  }
+
+  FILE *fp = fopen(outfile,"wb");
+  if (fp==NULL) {
+    fprintf(stderr,"Could not open output file %s\n",outfile);
+    fflush(stderr);
+    MPI_Abort(MPI_COMM_WORLD, 0);
+  }
+  static const unsigned char sig[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  fwrite(sig, 1, 8, fp);
+  // 16-bit grey, and 5/9 gamma like write_png
+  unsigned char ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 16, 0, 0, 0, 0 };
+  put_be32(ihdr, xres);
+  put_be32(ihdr+4, yres);
+  write_png_chunk(fp, "IHDR", ihdr, 13);
+  unsigned char gama[4];
+  put_be32(gama, 55555);
+  write_png_chunk(fp, "gAMA", gama, 4);
+  // the zlib header, for a 32k window at the default level
+  const unsigned char zhead[2] = { 0x78, 0x9c };
+  write_png_chunk(fp, "IDAT", zhead, 2);
+
+  for (int r=0; r<mpi_size; ++r) {
+    if (r > 0) {
+      long head[3];
+      MPI_Recv(head, 3, MPI_LONG, r, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      zlen = head[0];
+      if (zcap < zlen) {
+        zcap = zlen;
+        zbuf = (unsigned char *)realloc(zbuf, zcap);
+      }
+      for (long off=0; off<zlen; off+=(1L<<30)) {
+        const int n = (zlen-off < (1L<<30)) ? zlen-off : (1L<<30);
+        MPI_Recv(zbuf+off, n, MPI_BYTE, r, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      }
+      adler = adler32_combine(adler, (unsigned long)head[1], head[2]);
+    }
+    for (long off=0; off<zlen; off+=(1L<<30)) {
+      const long n = (zlen-off < (1L<<30)) ? zlen-off : (1L<<30);
+      write_png_chunk(fp, "IDAT", zbuf+off, n);
+    }
   }
-  if (fail) exit(1);
+  unsigned char ztail[4];
+  put_be32(ztail, adler);
+  write_png_chunk(fp, "IDAT", ztail, 4);
+  write_png_chunk(fp, "IEND", NULL, 0);
+  fclose(fp);
+  free(zbuf);
+  printf("  output range %g %g\n",outlo,outhi);
 }
+#endif
 
+
+#ifndef IDEALPLACE_LIB
 int main (int argc, char **argv) {
 
-  // array to hold up to 100 sets of preferences
-  float ideal[100][15];
-  int p = 1;	// start with 1 set of preferences
-  // pre-set all
-  for (int i=0; i<100; ++i) {
-    // under -100 means ignore this
-    for (int j=0; j<15; ++j) ideal[i][j] = -999.f;
-  }
-
-  // array to hold values for my hometown
-  float boston[15];
-  boston[0] = 1.1f;		// Jan mean temp (-30..40 C)
-  boston[1] = 24.5f;	// July mean temp (-30..40 C)
-  boston[2] = 101.f;	// Annual average rain (0..1000 mm/mo)
-  boston[3] = 0.516f;	// Annual average cloud cover (0..1)
-  boston[4] = 3.75f;	// Average wind speed at 10m (0..25 m/s)
-  boston[5] = 0.985f;	// Human Development Index (0..1), negative means don't use
-  boston[6] = -1.0f;	// Proximity to mountains (0..1), negative means don't use
-  boston[7] = 42.35f;	// latitude (N degrees) - close to
-  boston[8] = -71.05f;	// longitude (E degrees) - close to
-  boston[9] = -999.f;	// latitude (N degrees) - far from
-  boston[10] = -999.f;	// longitude (E degrees) - far from
-  boston[11] = -999.f;	// latitude (N degrees) - climate like
-  boston[12] = -999.f;	// longitude (E degrees) - climate like
-  boston[13] = -999.f;	// latitude (N degrees) - everything like
-  boston[14] = -999.f;	// longitude (E degrees) - everything like
+  // everyone's preferences, filled in from the command line
+  prefs q;
+  init_prefs(&q);
 
   // are we doing a specific month? (or year-round)
   int imonth = 0;		// default is NO specific month
 
-  // penalty weight for distance from ideal
-  float temp_penalty = 0.05f;
-  float rain_penalty = 1.5f;
-  float cloud_penalty = 5.0f;
-  float wind_penalty = 1.0f;
-  float hdi_penalty = 5.0f;
-  float mtn_penalty = 5.0f;
-  float dist_penalty = 2.5f;
+  // or a neighborhood filter of a layer
+  int filtertype = -1;
+  float filterkm = 0.f;
+  char filterin[255] = "";
+  char filterout[255] = "";
+
+  // climate zones to build, or to prune the search with
+  int mkzones = 0;
+  // or the distance-to-water layer
+  char watermask[255] = "";
+  char waterpng[255] = "";
+  char zonefile[255] = "";
+  char zonemap[255] = "";
+  float zonecut = 0.1f;
+  nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) nthreads = 1;
+#ifdef USE_MPI
+  // and share them with the other processes on this node
+  start_mpi(&argc, &argv);
+#endif
+
+  // smooth the costs over this radius, with this many box passes
+  float smoothkm = 0.f;
+  int smoothpasses = 1;
+
+  // or re-weigh the criteria this many ways, and map the best pct of each
+  int allmonths = FALSE;
+  char stackdir[255] = "";
+  int robust = 0;
+  float robustpct = 1.f;
+  char spreadmap[255] = "";
+  char paretofile[255] = "";
 
   int drawbdry = TRUE;
+  int reduced = FALSE;
+  int stream = FALSE;
+  int pipeline = FALSE;
+  char previewdir[255] = "";	// write coarse previews first, from stores kept here
+  int tileport = 0;	// serve tiles on this port instead of writing outpng
+  char sparsefile[255] = "";
+  float sparsecut = 0.f;
+  char contourfile[255] = "";
+  float contourpct = 5.f;
   char outpng[255];
   sprintf(outpng,"out.png");
 
@@ -920,151 +7115,132 @@ int main (int argc, char **argv) {
   (void) strcpy(progname,argv[0]);
   // if no arguments, find places on earth with weather similar to Boston
   if (argc < 2) {
-    for (int i=0; i<6; ++i) ideal[p-1][i] = boston[i];
+    for (int i=0; i<6; ++i) q.ideal[0][i] = boston[i];
   }
   for (int i=1; i<argc; i++) {
     // first, count the number of + or - in front of the argument
     float weight_mult = 1.f;
-    int j = 0;
-    for (j=0; j<50; ++j) {
-      if (argv[i][j] == '+') {
-        // weight remains 1 if this is the first character
-        weight_mult *= (j==0) ? 1.f : 2.f;
-      } else if (argv[i][j] == '-') {
-        weight_mult *= 0.5f;
-      } else {
-        // not a + or -, must be the argument
-        break;
-      }
-    }
-    // now j is where the word begins
-    char thisarg[255];
-    strcpy(thisarg, argv[i]+j);
+    const char *thisarg = option_word(argv[i], &weight_mult);
     //printf("arg %d mult is %g key is %s\n", i, weight_mult, thisarg);
 
+    // the preferences, then what to do with them
+    const int used = parse_pref(&q, argc, argv, i, thisarg, weight_mult);
+    if (used) {
+      i += used-1;
+      continue;
+    }
     // then look at the remainder of the argument
-    if (strncmp(thisarg, "boston", 2) == 0) {
-      // replace ideals for current person to Boston
-      for (int i=0; i<6; ++i) ideal[p-1][i] = boston[i];
-    } else if (strncmp(thisarg, "nobdry", 2) == 0) {
+    if (strncmp(thisarg, "nobdry", 2) == 0) {
       drawbdry = FALSE;
-    } else if (strncmp(thisarg, "new", 2) == 0) {
-      if (p==8) {
-        printf("No more than 8 sets of preferences allowed.\n");
-      } else {
-        // begin setting preferences for a new person
-        ++p;
-        printf("Setting ideals for person %d now\n", p);
-      }
-    } else if (strncmp(thisarg, "stc", 3) == 0) {
-      const float julylow = atof(argv[++i]);
-      const float julyhigh = atof(argv[++i]);
-      ideal[p-1][1] = 0.5*(julylow+julyhigh);
-      temp_penalty *= weight_mult;
-      printf("  set ideal July temp to %g C\n", ideal[p-1][1]);
-    } else if (strncmp(thisarg, "stf", 3) == 0) {
-      const float julylow = atof(argv[++i]);
-      const float julyhigh = atof(argv[++i]);
-      ideal[p-1][1] = ftoc(0.5*(julylow+julyhigh));
-      temp_penalty *= weight_mult;
-      printf("  set ideal July temp to %g C\n", ideal[p-1][1]);
-    } else if (strncmp(thisarg, "wtc", 3) == 0) {
-      const float janlow = atof(argv[++i]);
-      const float janhigh = atof(argv[++i]);
-      ideal[p-1][0] = 0.5*(janlow+janhigh);
-      temp_penalty *= weight_mult;
-      printf("  set ideal Jan temp to %g C\n", ideal[p-1][0]);
-    } else if (strncmp(thisarg, "wtf", 3) == 0) {
-      const float janlow = atof(argv[++i]);
-      const float janhigh = atof(argv[++i]);
-      ideal[p-1][0] = ftoc(0.5*(janlow+janhigh));
-      temp_penalty *= weight_mult;
-      printf("  set ideal Jan temp to %g C\n", ideal[p-1][0]);
-    } else if (strncmp(thisarg, "tc", 2) == 0) {
-      const float janlow = atof(argv[++i]);
-      const float janhigh = atof(argv[++i]);
-      const float julylow = atof(argv[++i]);
-      const float julyhigh = atof(argv[++i]);
-      ideal[p-1][0] = 0.5*(janlow+janhigh);
-      ideal[p-1][1] = 0.5*(julylow+julyhigh);
-      temp_penalty *= weight_mult;
-      printf("  set ideal Jan, July temps to %g %g C\n", ideal[p-1][0], ideal[p-1][1]);
-    } else if (strncmp(thisarg, "tf", 2) == 0) {
-      const float janlow = atof(argv[++i]);
-      const float janhigh = atof(argv[++i]);
-      const float julylow = atof(argv[++i]);
-      const float julyhigh = atof(argv[++i]);
-      ideal[p-1][0] = ftoc(0.5*(janlow+janhigh));
-      ideal[p-1][1] = ftoc(0.5*(julylow+julyhigh));
-      temp_penalty *= weight_mult;
-      printf("  set ideal Jan, July temps to %g %g C\n", ideal[p-1][0], ideal[p-1][1]);
-    } else if (strncmp(thisarg, "mtc", 3) == 0) {
-      const float janlow = atof(argv[++i]);
-      const float janhigh = atof(argv[++i]);
-      ideal[p-1][0] = 0.5*(janlow+janhigh);
-      temp_penalty *= weight_mult;
-      printf("  set ideal temp to %g C\n", ideal[p-1][0]);
-    } else if (strncmp(thisarg, "mtf", 3) == 0) {
-      const float janlow = atof(argv[++i]);
-      const float janhigh = atof(argv[++i]);
-      ideal[p-1][0] = ftoc(0.5*(janlow+janhigh));
-      temp_penalty *= weight_mult;
-      printf("  set ideal temp to %g C\n", ideal[p-1][0]);
-    } else if (strncmp(thisarg, "mr", 2) == 0) {
-      ideal[p-1][2] = atof(argv[++i]);
-      rain_penalty *= weight_mult;
-      printf("  set ideal monthly rain to %g mm/mo\n", ideal[p-1][2]);
-    } else if (strncmp(thisarg, "ac", 2) == 0) {
-      ideal[p-1][3] = atof(argv[++i]);
-      cloud_penalty *= weight_mult;
-      printf("  set ideal annual cloud cover to %g (1=100%)\n", ideal[p-1][3]);
-    } else if (strncmp(thisarg, "wmps", 4) == 0) {
-      ideal[p-1][4] = atof(argv[++i]);
-      wind_penalty *= weight_mult;
-      printf("  set ideal wind speed to %g (m/s)\n", ideal[p-1][4]);
-    } else if (strncmp(thisarg, "wmph", 4) == 0) {
-      ideal[p-1][4] = 0.44704f*atof(argv[++i]);
-      wind_penalty *= weight_mult;
-      printf("  set ideal wind speed to %g (m/s)\n", ideal[p-1][4]);
-    } else if (strncmp(thisarg, "hdi", 3) == 0) {
-      ideal[p-1][5] = atof(argv[++i]);
-      hdi_penalty *= weight_mult;
-      printf("  set ideal Human Development Index to %g (1=most)\n", ideal[p-1][5]);
-    } else if (strncmp(thisarg, "mtn", 3) == 0) {
-      ideal[p-1][6] = atof(argv[++i]);
-      mtn_penalty *= weight_mult;
-      printf("  set ideal mountain proximity to %g (1=closest)\n", ideal[p-1][6]);
-    } else if (strncmp(thisarg, "ct", 2) == 0) {
-      ideal[p-1][7] = atof(argv[++i]);
-      ideal[p-1][8] = atof(argv[++i]);
-      check_lat_lon(ideal[p-1][7], ideal[p-1][8]);
-      dist_penalty *= weight_mult;
-      printf("  prefer close to %g N %g E\n", ideal[p-1][7], ideal[p-1][8]);
-    } else if (strncmp(thisarg, "ff", 2) == 0) {
-      ideal[p-1][9] = atof(argv[++i]);
-      ideal[p-1][10] = atof(argv[++i]);
-      check_lat_lon(ideal[p-1][9], ideal[p-1][10]);
-      dist_penalty *= weight_mult;
-      printf("  prefer far from %g N %g E\n", ideal[p-1][9], ideal[p-1][10]);
-    //} else if (strncmp(thisarg, "nw", 2) == 0) {
-      //ideal[p-1][6] = atof(argv[++i]);
-      //printf("  set ideal water proximity to %g (1=closest)\n", ideal[p-1][6]);
-    //} else if (strncmp(thisarg, "no", 2) == 0) {
-      //ideal[p-1][6] = atof(argv[++i]);
-      //printf("  set ideal ocean proximity to %g (1=closest)\n", ideal[p-1][6]);
+    } else if (strncmp(thisarg, "smooth", 3) == 0) {
+      smoothkm = atof(argv[++i]);
+      smoothpasses = 1;
+    } else if (strncmp(thisarg, "gsmooth", 3) == 0) {
+      smoothkm = atof(argv[++i]);
+      smoothpasses = 3;
+    } else if (strncmp(thisarg, "allmonths", 3) == 0) {
+      allmonths = TRUE;
+    } else if (strncmp(thisarg, "scenario", 3) == 0 || strncmp(thisarg, "period", 3) == 0) {
+      // one or more stacks of climate layers, like ssp126,ssp245,ssp585
+      const int isscen = (thisarg[0] == 's');
+      char (*names)[32] = isscen ? scen_names : period_names;
+      int *n = isscen ? &nscen : &nperiod;
+      for (char *tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+        if (*n == MAXSTACKS || strlen(tok) > 31) {
+          fprintf(stderr,"No more than %d %ss allowed, of up to 31 characters each\n", MAXSTACKS, isscen ? "scenario" : "period");
+          exit(0);
+        }
+        strcpy(names[(*n)++], tok);
+        printf("  using %s %s\n", isscen ? "scenario" : "period", tok);
+      }
+    } else if (strncmp(thisarg, "stackstore", 3) == 0) {
+      strcpy(stackdir,argv[++i]);
+    } else if (strncmp(thisarg, "robust", 3) == 0) {
+      robust = atoi(argv[++i]);
+      robustpct = atof(argv[++i]);
+      if (robust < 1 || robustpct <= 0.f || robustpct > 100.f) {
+        fprintf(stderr,"Use -robust with a number of weightings and a percentage (0..100)\n");
+        exit(0);
+      }
+    } else if (strncmp(thisarg, "sparse", 3) == 0) {
+      strcpy(sparsefile,argv[++i]);
+      sparsecut = atof(argv[++i]);
+    } else if (strncmp(thisarg, "spreadmap", 3) == 0) {
+      strcpy(spreadmap,argv[++i]);
+    } else if (strncmp(thisarg, "pareto", 3) == 0) {
+      strcpy(paretofile,argv[++i]);
+    } else if (strncmp(thisarg, "reduced", 3) == 0) {
+      reduced = TRUE;
+    } else if (strncmp(thisarg, "resample", 3) == 0) {
+      const char *how = argv[++i];
+      if (strncmp(how, "nearest", 1) == 0) linear_sampling = FALSE;
+      else if (strncmp(how, "linear", 1) == 0 || strncmp(how, "bilinear", 1) == 0) linear_sampling = TRUE;
+      else {
+        fprintf(stderr,"Resampling must be nearest or linear\n");
+        exit(0);
+      }
+    } else if (strncmp(thisarg, "stream", 3) == 0) {
+      stream = TRUE;
+    } else if (strncmp(thisarg, "pipeline", 3) == 0) {
+      // pipelining is streaming with the decoding done on other threads
+      stream = TRUE;
+      pipeline = TRUE;
+    } else if (strncmp(thisarg, "preview", 3) == 0) {
+      strcpy(previewdir,argv[++i]);
+    } else if (strncmp(thisarg, "tiles", 3) == 0) {
+      tileport = atoi(argv[++i]);
+      if (tileport < 1 || tileport > 65535) {
+        fprintf(stderr,"Port for -tiles must be 1 to 65535, not %s\n",argv[i]);
+        exit(0);
+      }
+    } else if (strncmp(thisarg, "threads", 3) == 0) {
+      nthreads = atoi(argv[++i]);
+      if (nthreads < 1) nthreads = 1;
+    } else if (strncmp(thisarg, "contour", 3) == 0) {
+      contourpct = atof(argv[++i]);
+      strcpy(contourfile,argv[++i]);
+      if (contourpct <= 0.f || contourpct >= 100.f) {
+        fprintf(stderr,"The percent for -contour must be between 0 and 100, not %s\n",argv[i-1]);
+        exit(0);
+      }
+    } else if (strncmp(thisarg, "mkplaces", 3) == 0) {
+      const int ia = ++i;
+      (void)build_places(argv[ia], argv[++i]);
+      exit(0);
+    } else if (strncmp(thisarg, "places", 3) == 0) {
+      strcpy(placefile,argv[++i]);
+    } else if (strncmp(thisarg, "mkfilter", 3) == 0) {
+      const char *type = argv[++i];
+      if (strncmp(type, "max", 2) == 0) filtertype = FILTER_MAX;
+      else if (strncmp(type, "mean", 2) == 0) filtertype = FILTER_MEAN;
+      else {
+        fprintf(stderr,"Filter must be max or mean\n");
+        exit(0);
+      }
+      filterkm = atof(argv[++i]);
+      strcpy(filterin,argv[++i]);
+      strcpy(filterout,argv[++i]);
+    } else if (strncmp(thisarg, "mkwater", 3) == 0) {
+      strcpy(watermask,argv[++i]);
+      strcpy(waterpng,argv[++i]);
+    } else if (strncmp(thisarg, "mkzones", 3) == 0) {
+      mkzones = atoi(argv[++i]);
+      strcpy(zonefile,argv[++i]);
+      if (mkzones < 2 || mkzones >= ZONE_OCEAN) {
+        fprintf(stderr,"Number of zones must be from 2 to %d\n",ZONE_OCEAN-1);
+        exit(0);
+      }
+    } else if (strncmp(thisarg, "manifest", 3) == 0) {
+      read_manifest(argv[++i]);
     } else if (strncmp(thisarg, "m", 1) == 0) {
       imonth = atoi(argv[++i]);
       printf("  setting month to %d\n", imonth);
-    } else if (strncmp(thisarg, "cl", 2) == 0) {
-      ideal[p-1][11] = atof(argv[++i]);
-      ideal[p-1][12] = atof(argv[++i]);
-      check_lat_lon(ideal[p-1][11], ideal[p-1][12]);
-      printf("  prefer climate like %g N %g E\n", ideal[p-1][11], ideal[p-1][12]);
-    } else if (strncmp(thisarg, "el", 2) == 0) {
-      ideal[p-1][13] = atof(argv[++i]);
-      ideal[p-1][14] = atof(argv[++i]);
-      check_lat_lon(ideal[p-1][13], ideal[p-1][14]);
-      printf("  prefer everything like %g N %g E\n", ideal[p-1][13], ideal[p-1][14]);
+    } else if (strncmp(thisarg, "zonecut", 5) == 0) {
+      zonecut = atof(argv[++i]);
+    } else if (strncmp(thisarg, "zonemap", 5) == 0) {
+      strcpy(zonemap,argv[++i]);
+    } else if (strncmp(thisarg, "zones", 5) == 0) {
+      strcpy(zonefile,argv[++i]);
     } else if (strncmp(thisarg, "o", 1) == 0) {
       strcpy(outpng,argv[++i]);
     } else if (strncmp(thisarg, "h", 1) == 0) {
@@ -1073,330 +7249,872 @@ int main (int argc, char **argv) {
       (void) Usage(progname,0);
     }
   }
+  // -new grows these, so only now do they stay put
+  float (*ideal)[15] = q.ideal;
+  float (*extra_ideal)[MAXEXTRA] = q.extra_ideal;
+  float (*penalty)[NCOSTS] = q.penalty;
+  float *weight = q.weight;
+  likeset **likes = q.likes;
+  route **routes = q.routes;
+  const int p = q.p;
+  const int aggmode = q.aggmode;
+  const int topk = q.topk;
+  constraints cons = q.cons;
+
+  // every scenario with every period, and the first is the one that's
+  // used unless they're compared
+  int nstacks = 0;
+  const char *stack_scen[MAXSTACKS], *stack_period[MAXSTACKS];
+  for (int is=0; is<(nscen ? nscen : 1); ++is) {
+    for (int ipd=0; ipd<(nperiod ? nperiod : 1); ++ipd) {
+      if (nstacks == MAXSTACKS) {
+        fprintf(stderr,"No more than %d scenarios times periods allowed\n", MAXSTACKS);
+        exit(0);
+      }
+      stack_scen[nstacks] = nscen ? scen_names[is] : "";
+      stack_period[nstacks] = nperiod ? period_names[ipd] : "";
+      ++nstacks;
+    }
+  }
 
-  // interrogate the header for resolution
+#ifdef USE_MPI
+  // each process streams its own band of latitudes, which leaves out
+  // anything that needs the whole grid at once
+  if (mpi_size > 1) {
+    if (pipeline || reduced || allmonths || nstacks > 1 || mkzones > 0 || zonefile[0] || robust || paretofile[0] ||
+        tileport || contourfile[0] || sparsefile[0] || output_format(outpng) != OUT_PNG ||
+        watermask[0] || filtertype >= 0 || previewdir[0]) {
+      fprintf(stderr,"Under mpirun each process scores its own band of latitudes, so it cannot be used with\n");
+      fprintf(stderr,"  -pipeline, -reduced, -allmonths, lists of scenarios or periods, -zones, -mkzones, -robust,\n");
+      fprintf(stderr,"  -pareto, -tiles, -contour, -sparse, a raw -o file, -preview, -mkwater, or -mkfilter\n");
+      exit(0);
+    }
+    stream = TRUE;
+  }
+#endif
+
+  // interrogate the header for resolution, the temperature layer sets
+  // the scoring grid and any other layer may be coarser or finer
+  char tempfile[255];
+  layer_file(L_TEMPW, imonth, tempfile, sizeof(tempfile));
   int xres = -1000;
   int yres = -1000;
-  (void)read_png_res("airtemp_m1.png", &yres, &xres);
+  (void)read_png_res(tempfile, &yres, &xres);
+
+  // make the distance-to-water layer and stop
+  if (watermask[0]) {
+    float** water = allocate_2d_array_f(yres,xres);
+    if (strcmp(watermask, "ocean") == 0) {
+      // the ocean is wherever there's no temperature
+      (void)read_png(tempfile,xres,yres,FALSE,FALSE,1.0,FALSE,water,layer_min[L_TEMPW],layer_range[L_TEMPW],NULL,0.0,1.0,NULL,0.0,1.0);
+      for (int row=0; row<yres; ++row) {
+        for (int col=0; col<xres; ++col) water[row][col] = (water[row][col] > -29.9f) ? 0.f : 1.f;
+      }
+    } else {
+      int wyres, wxres;
+      (void)read_png_res(watermask, &wyres, &wxres);
+      if (wxres != xres || wyres != yres) {
+        fprintf(stderr,"Water mask %s is %d x %d, but the layers are %d x %d\n",watermask,wxres,wyres,xres,yres);
+        exit(0);
+      }
+      (void)read_png(watermask,xres,yres,FALSE,FALSE,1.0,FALSE,water,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
+    }
+    printf("Finding distance to water from %s\n", watermask);
+    water_distance(water, xres, yres);
+    (void)write_png(waterpng,xres,yres,FALSE,TRUE, water,0.f,WATER_RANGE, NULL,0.0,1.0, NULL,0.0,1.0);
+    printf("Wrote distance to water (0 to %g km) to %s\n", WATER_RANGE, waterpng);
+    exit(0);
+  }
 
-  // allocate and read temperature, full range is -30 to 40 C
-  float** temps = allocate_2d_array_f(xres,yres);
-  (void)read_png("airtemp_m7.png",xres,yres,FALSE,FALSE,1.0,FALSE,temps,-30.0,70.0,NULL,0.0,1.0,NULL,0.0,1.0);
-  float** tempw = allocate_2d_array_f(xres,yres);
-  if (imonth == 0) {
-    (void)read_png("airtemp_m1.png",xres,yres,FALSE,FALSE,1.0,FALSE,tempw,-30.0,70.0,NULL,0.0,1.0,NULL,0.0,1.0);
-  } else {
-    // load the specific month's data files over the jan/winter space
-    char airtemp[16];
-    sprintf(airtemp,"airtemp_m%d.png",imonth);
-    (void)read_png(airtemp,xres,yres,FALSE,FALSE,1.0,FALSE,tempw,-30.0,70.0,NULL,0.0,1.0,NULL,0.0,1.0);
+  // filter a layer and stop
+  if (filtertype >= 0) {
+    int fyres, fxres;
+    (void)read_png_res(filterin, &fyres, &fxres);
+    float** grid = allocate_2d_array_f(fyres,fxres);
+    (void)read_png(filterin,fxres,fyres,FALSE,FALSE,1.0,FALSE,grid,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
+    printf("Finding %s of %s within %g km\n", (filtertype == FILTER_MAX) ? "max" : "mean", filterin, filterkm);
+    neighborhood_filter(grid, fxres, fyres, 0, fyres, filtertype, filterkm);
+    // same 0..1 scale as the input
+    (void)write_png(filterout,fxres,fyres,FALSE,TRUE, grid,0.f,1.f, NULL,0.0,1.0, NULL,0.0,1.0);
+    exit(0);
   }
 
-  // allocate and read precipitation, full range is 0 to 1000mm per month
-  float** rain = allocate_2d_array_f(xres,yres);
-  if (imonth == 0) {
-    // load the annual file
-    (void)read_png("precip_avg.png",xres,yres,FALSE,FALSE,1.0,FALSE,rain,0.0,1000.0,NULL,0.0,1.0,NULL,0.0,1.0);
-  } else {
-    // load the specific month's data file instead
-    char precipf[16];
-    sprintf(precipf,"precip_m%d.png",imonth);
-    (void)read_png(precipf,xres,yres,FALSE,FALSE,1.0,FALSE,rain,0.0,1000.0,NULL,0.0,1.0,NULL,0.0,1.0);
+  char infile[255];
+  float** layer[MAXLAYERS];
+  resampler* rs[MAXLAYERS];
+  for (int l=0; l<MAXLAYERS; ++l) {
+    layer[l] = NULL;
+    rs[l] = NULL;
+  }
+
+  if (allmonths) {
+    int any_like = FALSE;
+    for (int ip=0; ip<p; ++ip) {
+      if (likes[ip] || ideal[ip][11] > -500.f || ideal[ip][13] > -500.f) any_like = TRUE;
+    }
+    if (imonth != 0 || stream || pipeline || reduced || mkzones > 0 || zonefile[0] || robust || paretofile[0] ||
+        smoothkm > 0.f || aggmode == AGG_MAX || any_like) {
+      fprintf(stderr,"-allmonths adds each month's costs to those of the other layers in memory, so it cannot be\n");
+      fprintf(stderr,"  used with -m, -stream, -pipeline, -reduced, -zones, -robust, -pareto, -smooth, -agg max,\n");
+      fprintf(stderr,"  or any of the -like options\n");
+      exit(0);
+    }
+  }
+
+  // more than one stack compares them, the same way
+  const int compare = (nstacks > 1);
+  if (compare) {
+    int any_like = FALSE;
+    for (int ip=0; ip<p; ++ip) {
+      if (likes[ip] || ideal[ip][11] > -500.f || ideal[ip][13] > -500.f) any_like = TRUE;
+    }
+    if (allmonths || stream || pipeline || reduced || mkzones > 0 || zonefile[0] || robust || paretofile[0] ||
+        smoothkm > 0.f || aggmode == AGG_MAX || any_like || tileport || contourfile[0] || sparsefile[0] ||
+        output_format(outpng) != OUT_PNG) {
+      fprintf(stderr,"Comparing scenarios or periods adds each one's costs to those of the other layers in memory\n");
+      fprintf(stderr,"  and writes a png of each, so it cannot be used with -allmonths, -stream, -pipeline, -reduced,\n");
+      fprintf(stderr,"  -zones, -robust, -pareto, -smooth, -agg max, -tiles, -contour, -sparse, a raw -o file,\n");
+      fprintf(stderr,"  or any of the -like options\n");
+      exit(0);
+    }
+  }
+
+  if (previewdir[0]) {
+    int any_like = FALSE;
+    for (int ip=0; ip<p; ++ip) {
+      if (likes[ip] || ideal[ip][11] > -500.f || ideal[ip][13] > -500.f) any_like = TRUE;
+    }
+    if (allmonths || compare || robust || paretofile[0] || any_like) {
+      fprintf(stderr,"-preview scores one query's costs before any layer is read, so it cannot be used with\n");
+      fprintf(stderr,"  -allmonths, lists of scenarios or periods, -robust, -pareto, or any of the -like options\n");
+      exit(0);
+    }
+  }
+
+  if ((output_format(outpng) != OUT_PNG || sparsefile[0]) && (pipeline || allmonths)) {
+    fprintf(stderr,"Raw and sparse outputs are written from the whole image in memory, drop -pipeline and -allmonths\n");
+    exit(0);
+  }
+
+  if (contourfile[0] && (pipeline || allmonths || robust || paretofile[0])) {
+    fprintf(stderr,"-contour outlines the best of the costs in memory, drop -pipeline, -allmonths, -robust, and -pareto\n");
+    exit(0);
   }
 
-  // and clouds (0=sunny, 1=cloudy)
-  float** clouds = allocate_2d_array_f(xres,yres);
-  (void)read_png("clouds.png",xres,yres,FALSE,FALSE,1.0,FALSE,clouds,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
+  if (tileport && (pipeline || allmonths)) {
+    fprintf(stderr,"-tiles serves the finished image from memory, so it cannot be used with -pipeline or -allmonths\n");
+    exit(0);
+  }
+
+  if (mkzones > 0 && (stream || reduced || imonth != 0)) {
+    fprintf(stderr,"Zones are built from the full annual layers in memory, drop -m, -stream, and -reduced\n");
+    exit(0);
+  }
+
+  // store and score about cos(latitude) of each row
+  reduced_grid *rg = NULL;
+  if (reduced) {
+    rg = make_reduced_grid(xres, yres);
+    printf("Using a reduced grid of %ld pixels, %.1f%% of the full grid\n", rg->npix, 100.0*rg->npix/((long)xres*yres));
+  }
 
-  // wind (0 to 25 m/s average at 10m above ground)
-  float** wind = allocate_2d_array_f(xres,yres);
-  (void)read_png("windspeed.png",xres,yres,FALSE,FALSE,1.0,FALSE,wind,0.0,25.0,NULL,0.0,1.0,NULL,0.0,1.0);
+  // the layers that change from slice to slice: the month's temperature
+  // and rain, or any whose file differs from one stack to the next
+  int changing[MAXLAYERS];
+  for (int l=0; l<NLAYERS+nextra; ++l) {
+    changing[l] = allmonths && (l == L_TEMPW || l == L_RAIN);
+    char f0[255], f[255];
+    stack_layer_file(l, imonth, stack_scen[0], stack_period[0], f0, sizeof(f0));
+    for (int s=1; s<nstacks && compare; ++s) {
+      stack_layer_file(l, imonth, stack_scen[s], stack_period[s], f, sizeof(f));
+      if (strcmp(f, f0) != 0) changing[l] = TRUE;
+    }
+  }
 
-  // human development index (0..1)
-  float** hdi = allocate_2d_array_f(xres,yres);
-  (void)read_png("hdi.png",xres,yres,FALSE,FALSE,1.0,FALSE,hdi,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
+  // a quick look on coarser grids first
+  if (previewdir[0]) {
+    write_previews(previewdir, outpng, p, aggmode, ideal, extra_ideal, penalty, weight, routes, &cons, imonth, xres, drawbdry);
+  }
 
-  // proximity to mountains (0..1)
-  float** mtn = allocate_2d_array_f(xres,yres);
-  (void)read_png("dem_variance_area.png",xres,yres,FALSE,FALSE,1.0,FALSE,mtn,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
+  if (!stream) {
+    // allocate and read every layer that this query uses, though matching
+    // another place or making zones looks at all of them
+    // temperature full range is -30 to 40 C, precipitation is 0 to 1000mm per month,
+    // clouds (0=sunny, 1=cloudy), wind (0 to 25 m/s average at 10m above ground),
+    // human development index (0..1), proximity to mountains (0..1)
+    // each at its own resolution
+    int every = (mkzones > 0);
+    for (int ip=0; ip<p; ++ip) {
+      if (likes[ip] || ideal[ip][11] > -500.f || ideal[ip][13] > -500.f) every = TRUE;
+    }
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (!every && l < NLAYERS && !layer_is_used(ideal, p, l) && !constraint_uses(&cons, l)) continue;
+      // every slice reads its own
+      if (changing[l]) continue;
+      layer_file(l, imonth, infile, sizeof(infile));
+      rs[l] = layer_resampler(infile, xres, yres);
+      if (rg && !rs[l]) {
+        layer[l] = allocate_reduced_f(rg);
+        (void)read_png_reduced(infile,rg,layer_min[l],layer_range[l],layer[l]);
+        continue;
+      }
+      const int nx = rs[l] ? rs[l]->nx : xres;
+      const int ny = rs[l] ? rs[l]->ny : yres;
+      layer[l] = allocate_2d_array_f(ny,nx);
+      (void)read_png(infile,nx,ny,FALSE,FALSE,1.0,FALSE,layer[l],layer_min[l],layer_range[l],NULL,0.0,1.0,NULL,0.0,1.0);
+    }
+  }
 
   // now that we've loaded everything in, we can apply
   // -cl  "climate like" and
   // -el  "everything like"
-
-  // first: check, set, and report "everything like" parameters
-  for (int ip=0; ip<p; ++ip) {
-    if (ideal[ip][13] > -500.f) {
-      printf("Person %d requested 'everything like' %g N %g S, so:\n", ip+1, ideal[ip][13], ideal[ip][14]);
-      int like_px = 0.5f + xres * (180.f + ideal[ip][14]) / 360.f;
-      int like_py = 0.5f + yres * ( 90.f + ideal[ip][13]) / 180.f;
-      // replace ideals for current person to those values
-      ideal[ip][0] = tempw[like_px][like_py];
-      if (imonth == 0) {
-        // imonth is unset
-        // tempw is January and temps is July
-        printf("  set ideal Jan temp to %g C\n", ideal[ip][0]);
-        ideal[ip][1] = temps[like_px][like_py];
-        printf("  set ideal July temp to %g C\n", ideal[ip][1]);
-      } else {
-        // tempw is given month
-        printf("  set ideal temp in month %d to %g C\n", imonth, ideal[ip][0]);
+  // first "everything like", then "climate like"
+  for (int pass=0; pass<2; ++pass) {
+    const int islot = (pass==0) ? 13 : 11;
+    for (int ip=0; ip<p; ++ip) {
+      if (ideal[ip][islot] > -500.f) {
+        printf("Person %d requested '%s like' %g N %g S, so:\n", ip+1, (pass==0) ? "everything" : "climate", ideal[ip][islot], ideal[ip][islot+1]);
+        float vals[NLAYERS];
+        for (int l=0; l<NLAYERS; ++l) {
+          // each layer's nearest pixel at its own resolution
+          int nx = xres;
+          int ny = yres;
+          int like_px, like_py;
+          // the reduced grid only keeps the middle of each span, which can
+          // be water next to a coastal place, so read the place's own pixel
+          const int decode = stream || (rg && !rs[l]);
+          layer_file(l, imonth, infile, sizeof(infile));
+          if (decode) (void)read_png_res(infile, &ny, &nx);
+          else if (rs[l]) { nx = rs[l]->nx; ny = rs[l]->ny; }
+          latlon_to_px(ideal[ip][islot], ideal[ip][islot+1], nx, ny, &like_px, &like_py);
+          if (decode) {
+            // only decode as far as we need to
+            vals[l] = sample_png(infile,nx,ny,layer_min[l],layer_range[l],like_px,like_py);
+          } else {
+            vals[l] = layer[l][like_py][like_px];
+          }
+        }
+        // replace ideals for current person to those values
+        set_ideals_like(ideal[ip], vals, imonth, pass==0);
       }
-      ideal[ip][2] = rain[like_px][like_py];
-      printf("  set ideal monthly rain to %g mm/mo\n", ideal[ip][2]);
-      ideal[ip][3] = clouds[like_px][like_py];
-      printf("  set ideal annual cloud cover to %g (1=100%)\n", ideal[ip][3]);
-      ideal[ip][4] = wind[like_px][like_py];
-      printf("  set ideal wind speed to %g (m/s)\n", ideal[ip][4]);
-      ideal[ip][5] = hdi[like_px][like_py];
-      printf("  set ideal Human Development Index to %g (1=most)\n", ideal[ip][5]);
-      ideal[ip][6] = mtn[like_px][like_py];
-      printf("  set ideal mountain proximity to %g (1=closest)\n", ideal[ip][6]);
     }
   }
 
-  // then: check, set, and report "climate like" parameters
+  // and look up every "like any of these" location
+  int any_likes = FALSE;
   for (int ip=0; ip<p; ++ip) {
-    if (ideal[ip][11] > -500.f) {
-      printf("Person %d requested 'climate like' %g N %g S, so:\n", ip+1, ideal[ip][11], ideal[ip][12]);
-      int like_px = 0.5f + xres * (180.f + ideal[ip][12]) / 360.f;
-      int like_py = 0.5f + yres * ( 90.f + ideal[ip][11]) / 180.f;
-      // replace ideals for current person to those values
-      ideal[ip][0] = tempw[like_px][like_py];
-      if (imonth == 0) {
-        // imonth is unset
-        // tempw is January and temps is July
-        printf("  set ideal Jan temp to %g C\n", ideal[ip][0]);
-        ideal[ip][1] = temps[like_px][like_py];
-        printf("  set ideal July temp to %g C\n", ideal[ip][1]);
+    likeset *ls = likes[ip];
+    if (ls == NULL) continue;
+    any_likes = TRUE;
+    float (*tvals)[NLAYERS] = malloc(ls->n * sizeof(*tvals));
+    for (int i=0; i<ls->n; ++i) {
+      latlon_to_px(ls->loc[i][0], ls->loc[i][1], xres, yres, &ls->px[i], &ls->py[i]);
+    }
+    int *npx = malloc(ls->n * sizeof(int));
+    int *npy = malloc(ls->n * sizeof(int));
+    float *lv = malloc(ls->n * sizeof(float));
+    for (int l=0; l<NLAYERS; ++l) {
+      // the targets' pixels at this layer's resolution
+      int nx = xres;
+      int ny = yres;
+      // as for -el, the reduced grid could put a coastal target in the water
+      const int decode = stream || (rg && !rs[l]);
+      layer_file(l, imonth, infile, sizeof(infile));
+      if (decode) (void)read_png_res(infile, &ny, &nx);
+      else if (rs[l]) { nx = rs[l]->nx; ny = rs[l]->ny; }
+      for (int i=0; i<ls->n; ++i) {
+        latlon_to_px(ls->loc[i][0], ls->loc[i][1], nx, ny, &npx[i], &npy[i]);
+      }
+      if (decode) {
+        // one partial decode per layer gets all of the targets
+        (void)sample_png_many(infile,nx,ny,layer_min[l],layer_range[l],ls->n,npx,npy,lv);
+        for (int i=0; i<ls->n; ++i) tvals[i][l] = lv[i];
       } else {
-        // tempw is given month
-        printf("  set ideal temp in month %d to %g C\n", imonth, ideal[ip][0]);
+        for (int i=0; i<ls->n; ++i) tvals[i][l] = layer[l][npy[i]][npx[i]];
       }
-      ideal[ip][2] = rain[like_px][like_py];
-      printf("  set ideal monthly rain to %g mm/mo\n", ideal[ip][2]);
-      ideal[ip][3] = clouds[like_px][like_py];
-      printf("  set ideal annual cloud cover to %g (1=100%)\n", ideal[ip][3]);
-      ideal[ip][4] = wind[like_px][like_py];
-      printf("  set ideal wind speed to %g (m/s)\n", ideal[ip][4]);
     }
+    free(npx);
+    free(npy);
+    free(lv);
+    build_likeset(ls, tvals, penalty[ip], imonth, topk);
+    printf("Person %d requested 'everything like' any of %d places on land\n", ip+1, ls->n);
+    free(tvals);
   }
 
-  // allocate space for the output and set to 0
-  float** outval = allocate_2d_array_f(xres,yres);
-  for (int row=0; row<yres; ++row) {
-    for (int col=0; col<xres; ++col) {
-      outval[col][row] = 0.0f;
+  // make the climate zones once, offline
+  if (mkzones > 0) {
+    // the zones are per scoring pixel, so bring every layer onto that grid
+    for (int l=0; l<NLAYERS; ++l) {
+      if (rs[l] == NULL) continue;
+      float** grid = resample_grid(rs[l], layer[l], xres, yres);
+      free_2d_array_f(layer[l]);
+      layer[l] = grid;
     }
+    zoneset *zs = build_zones(mkzones, layer, penalty[0], xres, yres);
+    (void)write_zones(zs, zonefile);
+    if (zonemap[0]) (void)write_zone_map(zs, zonemap);
+    exit(0);
   }
 
-  // running sums
-  float total_temp = 0.f;
-  float total_rain = 0.f;
-  float total_cloud = 0.f;
-  float total_wind = 0.f;
-  float total_hdi = 0.f;
-  float total_mtn = 0.f;
-  float total_dist = 0.f;
-
-  // accumulate penalties
-
-  for (int ip=0; ip<p; ++ip) {
-
-  // all preferences are now optional
+  // everything that score_row needs, per person
+  scorer sc;
+  init_scorer(&sc, p, aggmode, ideal, extra_ideal, penalty, weight, likes, routes, xres, yres);
 
-  float ideal_tempw = ideal[ip][0];
-  if (ideal_tempw > -500.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float tempcost = temp_penalty * fabs(tempw[col][row]-ideal_tempw);
-          outval[col][row] += tempcost;
-          total_temp += tempcost;
-        }
-      }
+  // keep the criteria apart to re-weigh them later
+  critset *crits = NULL;
+  if (robust) {
+    if (aggmode == AGG_MAX || smoothkm > 0.f) {
+      fprintf(stderr,"-robust needs criteria that add up, so it cannot be used with -agg max or -smooth\n");
+      exit(0);
+    }
+    keep_criteria(&sc);
+    crits = new_critset(&sc);
+    if (crits->nk == 0) {
+      fprintf(stderr,"-robust needs at least one criterion to re-weigh\n");
+      exit(0);
     }
   }
-
-  float ideal_temps = ideal[ip][1];
-  if (ideal_temps > -500.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float tempcost = temp_penalty * fabs(temps[col][row]-ideal_temps);
-          outval[col][row] += tempcost;
-          total_temp += tempcost;
-        }
-      }
+  if (paretofile[0]) {
+    if (robust || smoothkm > 0.f) {
+      fprintf(stderr,"-pareto draws its own image, so it cannot be used with -robust or -smooth\n");
+      exit(0);
+    }
+    keep_criteria(&sc);
+    crits = new_critset(&sc);
+    if (crits->nk < 2) {
+      fprintf(stderr,"-pareto needs at least two criteria to trade off\n");
+      exit(0);
     }
   }
 
-  float ideal_rain = ideal[ip][2];
-  if (ideal_rain >= 0.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float raincost = rain_penalty * fabs(logf((0.1f+rain[col][row])/(0.1f+ideal_rain)));
-          outval[col][row] += raincost;
-          total_rain += raincost;
-        }
-      }
+  // and use the zones to skip those that can't hold a good place
+  zoneset *zs = NULL;
+  if (zonefile[0]) {
+    zs = read_zones(zonefile);
+    if (zs->xres != xres || zs->yres != yres) {
+      fprintf(stderr,"Zone file %s is %d x %d, but the layers are %d x %d\n",zonefile,zs->xres,zs->yres,xres,yres);
+      exit(0);
     }
+    printf("Using %d climate zones from %s\n", zs->nzones, zonefile);
+    prune_zones(zs, &sc, &cons, imonth, zonecut);
+    if (zonemap[0]) (void)write_zone_map(zs, zonemap);
   }
 
-  float ideal_cloud = ideal[ip][3];
-  if (ideal_cloud >= 0.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float cloudcost = cloud_penalty * fabs(clouds[col][row]-ideal_cloud);
-          outval[col][row] += cloudcost;
-          total_cloud += cloudcost;
-        }
+  // score everything but the changing layers once, then add each month's,
+  // or each stack's
+  if (allmonths || compare) {
+    float (*sideal)[15] = malloc(p*sizeof(*sideal));
+    float (*mideal)[15] = malloc(p*sizeof(*mideal));
+    float (*sextra)[MAXEXTRA] = malloc(p*sizeof(*sextra));
+    float (*mextra)[MAXEXTRA] = malloc(p*sizeof(*mextra));
+    likeset **mlikes = (likeset**)calloc(p, sizeof(likeset*));
+    const int slot_layer[3] = { L_TEMPW, L_TEMPS, L_RAIN };
+    for (int ip=0; ip<p; ++ip) {
+      for (int j=0; j<15; ++j) {
+        const int slice = (j < 3 && changing[slot_layer[j]]);
+        sideal[ip][j] = slice ? -999.f : ideal[ip][j];
+        mideal[ip][j] = slice ? ideal[ip][j] : -999.f;
+      }
+      for (int k=0; k<MAXEXTRA; ++k) {
+        const int slice = (k < nextra && changing[NLAYERS+k]);
+        sextra[ip][k] = slice ? -999.f : extra_ideal[ip][k];
+        mextra[ip][k] = slice ? extra_ideal[ip][k] : -999.f;
       }
     }
-  }
+    scorer ssc;
+    init_scorer(&ssc, p, aggmode, sideal, sextra, penalty, weight, likes, routes, xres, yres);
+    memcpy(ssc.mult, sc.mult, p*sizeof(float));
+
+    // the constraints on the changing layers are checked in every slice
+    constraints scons, mcons;
+    scons.n = mcons.n = 0;
+    for (int i=0; i<cons.n; ++i) {
+      if (changing[cons.c[i].layer]) mcons.c[mcons.n++] = cons.c[i];
+      else scons.c[scons.n++] = cons.c[i];
+    }
 
-  float ideal_wind = ideal[ip][4];
-  if (ideal_wind >= 0.f) {
+    // the land can change with the slice, so score every pixel here
+    printf("Scoring the layers that do not change with the %s\n", allmonths ? "month" : "scenario or period");
+    float** fixed = allocate_2d_array_f(yres,xres);
+    int* cand = (int*)malloc(xres*sizeof(int));
+    float* vals[MAXLAYERS] = { NULL };
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (rs[l]) vals[l] = (float*)malloc(xres*sizeof(float));
+    }
     for (int row=0; row<yres; ++row) {
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (layer[l] && !rs[l]) vals[l] = layer[l][row];
+      }
+      int ncand = xres;
       for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float windcost = wind_penalty * fabs(wind[col][row]-ideal_wind);
-          outval[col][row] += windcost;
-          total_wind += windcost;
-        }
+        fixed[row][col] = 0.f;
+        cand[col] = col;
+      }
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (rs[l]) resample_row(rs[l], row, layer[l][rs[l]->r0[row]], layer[l][rs[l]->r1[row]], cand, ncand, vals[l]);
       }
+      if (scons.n) ncand = constrain_row(&scons, vals, cand, ncand, fixed[row]);
+      score_row(&ssc, row, vals, cand, ncand, fixed[row]);
     }
-  }
-
-  float ideal_hdi = ideal[ip][5];
-  if (ideal_hdi >= 0.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float hdicost = hdi_penalty * fabs(hdi[col][row]-ideal_hdi);
-          outval[col][row] += hdicost;
-          total_hdi += hdicost;
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      // the temperature is still the land if it doesn't change
+      if (layer[l] && l != L_TEMPW) free_2d_array_f(layer[l]);
+      if (rs[l]) free(vals[l]);
+    }
+    free(cand);
+
+    slice_job mj;
+    mj.xres = xres;
+    mj.yres = yres;
+    mj.n = allmonths ? 12 : nstacks;
+    mj.p = p;
+    mj.aggmode = aggmode;
+    mj.ideal = mideal;
+    mj.extra_ideal = mextra;
+    mj.penalty = penalty;
+    mj.weight = weight;
+    mj.likes = mlikes;
+    mj.mult = sc.mult;
+    mj.cons = &mcons;
+    for (int l=0; l<MAXLAYERS; ++l) {
+      mj.used[l] = (l < NLAYERS+nextra) && changing[l] &&
+                   (l >= NLAYERS || layer_is_used(mideal, p, l) || constraint_uses(&mcons, l));
+    }
+    mj.fixed = fixed;
+    mj.temp = changing[L_TEMPW] ? NULL : layer[L_TEMPW];
+    for (int k=0; k<mj.n; ++k) {
+      const int s = allmonths ? 0 : k;
+      mj.imonth[k] = allmonths ? k+1 : imonth;
+      mj.scen[k] = stack_scen[s];
+      mj.period[k] = stack_period[s];
+      char label[80];
+      stack_label(stack_scen[s], stack_period[s], label);
+      strcpy(mj.label[k], allmonths ? month_names[k] : label);
+      mj.store[k] = NULL;
+      if (stackdir[0] && (k == 0 || !allmonths)) {
+        // each stack's layers in one file, built the first time
+        char storefile[255];
+        if (snprintf(storefile, sizeof(storefile), "%s/%s.stack", stackdir, label[0] ? label : "default") >= (int)sizeof(storefile)) {
+          fprintf(stderr,"Stack store directory name %s is too long\n",stackdir);
+          exit(0);
         }
+        mj.store[k] = open_stack_store(storefile, changing, stack_scen[s], stack_period[s], xres, yres);
+      } else if (stackdir[0]) {
+        mj.store[k] = mj.store[0];
       }
     }
+    if (allmonths) printf("Adding the temperature%s of every month\n", mj.used[L_RAIN] ? " and rain" : "");
+    else printf("Adding the costs of each of %d stacks\n", mj.n);
+    parallel_for(nthreads, mj.n, slice_costs, &mj);
+
+    // one range for all of them
+    mj.lo = 9.9e+9;
+    mj.hi = -9.9e+9;
+    for (int k=0; k<mj.n; ++k) {
+      if (mj.sr[k].hi < mj.sr[k].lo) continue;
+      mj.lo = fminf(mj.lo, mj.sr[k].lo);
+      mj.hi = fmaxf(mj.hi, mj.sr[k].hi);
+      char how[96];
+      sprintf(how, " in %s", mj.label[k]);
+      print_best_place(&mj.sr[k], xres, yres, how);
+    }
+    if (mj.hi < mj.lo) {
+      printf("No place on Earth meets all of the requirements in any %s\n", allmonths ? "month" : "scenario or period");
+      exit(0);
+    }
+    printf("min and max range of all %s: %g %g\n", allmonths ? "months" : "stacks", mj.lo, mj.hi);
+
+    // and the worst of every stack
+    int nframes = mj.n;
+    if (compare) {
+      robust_slice(&mj);
+      strcpy(mj.label[mj.n], "robust");
+      if (mj.sr[mj.n].hi < mj.sr[mj.n].lo) printf("No place on Earth meets all of the requirements in every stack\n");
+      else print_best_place(&mj.sr[mj.n], xres, yres, " in every stack");
+      ++nframes;
+    }
+
+    mj.bdry = NULL;
+    if (drawbdry) {
+      mj.bdry = allocate_2d_array_f(yres,xres);
+      (void)read_png("natl_bdry.png",xres,yres,FALSE,FALSE,1.0,FALSE,mj.bdry,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
+    }
+    for (int k=0; k<nframes; ++k) {
+      char suffix[96];
+      if (allmonths) sprintf(suffix, "m%d", k+1);
+      else strcpy(suffix, mj.label[k]);
+      slice_file(outpng, suffix, mj.frame[k]);
+    }
+    parallel_for(nthreads, nframes, slice_frames, &mj);
+    printf("Wrote %s to %s\n", mj.frame[0], mj.frame[nframes-1]);
+    if (compare) {
+      char deltafile[255];
+      slice_file(outpng, "delta", deltafile);
+      slice_delta(&mj, 0, mj.n-1, deltafile);
+    }
+    exit(0);
   }
 
-  float ideal_mtn = ideal[ip][6];
-  if (ideal_mtn >= 0.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float mtncost = mtn_penalty * fabs(mtn[col][row]-ideal_mtn);
-          outval[col][row] += mtncost;
-          total_mtn += mtncost;
+  // the rows that this process reports, and the rows around them that it
+  // scores only to smooth them; all of them unless it's one of several
+  int clo = 0, chi = yres, blo = 0, bhi = yres;
+#ifdef USE_MPI
+  if (mpi_size > 1) {
+    band_rows(yres, &clo, &chi);
+    const int halo = (smoothkm > 0.f) ? smoothpasses*filter_hrow(yres, smoothkm) : 0;
+    blo = (clo-halo > 0) ? clo-halo : 0;
+    bhi = (chi+halo < yres) ? chi+halo : yres;
+    printf("Scoring %d bands of about %d rows", mpi_size, chi-clo);
+    if (halo) printf(", with %d more on each side to smooth", halo);
+    printf("\n");
+  }
+#endif
+
+  // allocate space for the output
+  float** outval = allocate_band_f(yres,xres,blo,bhi);
+
+  // the pixels of the current row that still need to be scored
+  int* cand = (int*)malloc(xres*sizeof(int));
+
+  // accumulate penalties, one row at a time, tracking the range as we go
+  float* vals[MAXLAYERS];
+  score_range sr;
+  init_score_range(&sr);
+  if (pipeline) {
+    // decode every used layer on its own thread while we score
+    row_queue rq[MAXLAYERS];
+    int used[MAXLAYERS];
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      used[l] = l >= NLAYERS || any_likes || layer_is_used(ideal, p, l) || constraint_uses(&cons, l);
+      vals[l] = NULL;
+      if (used[l]) {
+        layer_file(l, imonth, infile, sizeof(infile));
+        rs[l] = layer_resampler(infile, xres, yres);
+        const int nx = rs[l] ? rs[l]->nx : xres;
+        const int ny = rs[l] ? rs[l]->ny : yres;
+        (void)start_row_queue(infile,nx,ny,layer_min[l],layer_range[l],64,&rq[l]);
+        if (rs[l]) vals[l] = (float*)malloc(xres*sizeof(float));
+      }
+    }
+    for (int row=yres-1; row>=0; --row) {
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (used[l] && !rs[l]) vals[l] = next_queued_row(&rq[l]);
+      }
+      int ncand = rg ? reduced_land_row(rg, row, vals[L_TEMPW], outval[row], cand)
+                     : land_row(vals[L_TEMPW], xres, outval[row], cand);
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (rs[l]) resample_stream_row(rs[l], row, NULL, &rq[l], cand, ncand, vals[l]);
+      }
+      if (cons.n) ncand = constrain_row(&cons, vals, cand, ncand, outval[row]);
+      if (zs) ncand = zone_row(zs, row, cand, ncand, outval[row]);
+      score_row(&sc, row, vals, cand, ncand, outval[row]);
+      if (crits) critset_add_row(crits, &sc, row, cand, ncand);
+      if (rg) reduced_fill_row(rg, row, outval[row]);
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (used[l] && !rs[l]) release_queued_row(&rq[l]);
+      }
+      track_score_range(outval[row], xres, row, &sr);
+    }
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (used[l]) (void)finish_row_queue(&rq[l]);
+      if (rs[l]) free(vals[l]);
+    }
+  } else if (stream) {
+    // decode each input row and score it right away, holding only the output grid
+    png_rows pr[MAXLAYERS];
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      vals[l] = NULL;
+      if (l >= NLAYERS || any_likes || layer_is_used(ideal, p, l) || constraint_uses(&cons, l)) {
+        layer_file(l, imonth, infile, sizeof(infile));
+        rs[l] = layer_resampler(infile, xres, yres);
+        const int nx = rs[l] ? rs[l]->nx : xres;
+        const int ny = rs[l] ? rs[l]->ny : yres;
+        (void)open_png_rows(infile,nx,ny,layer_min[l],layer_range[l],&pr[l]);
+        vals[l] = (float*)malloc(xres*sizeof(float));
+      }
+    }
+    for (int row=yres-1; row>=blo; --row) {
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (vals[l] && !rs[l]) (void)read_png_row(&pr[l], vals[l]);
+      }
+      if (row >= bhi) {
+        // north of this process's rows, only move the inputs along
+        for (int l=0; l<NLAYERS+nextra; ++l) {
+          if (rs[l]) resample_stream_row(rs[l], row, &pr[l], NULL, cand, 0, vals[l]);
         }
+        continue;
+      }
+      // rows scored only for the smoothing count towards nothing else
+      const int halo = (row < clo || row >= chi);
+      scorer hsc;
+      constraints hcons;
+      if (halo) {
+        hsc = sc;
+        hcons = cons;
+      }
+      int ncand = rg ? reduced_land_row(rg, row, vals[L_TEMPW], outval[row], cand)
+                     : land_row(vals[L_TEMPW], xres, outval[row], cand);
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (rs[l]) resample_stream_row(rs[l], row, &pr[l], NULL, cand, ncand, vals[l]);
+      }
+      if (cons.n) ncand = constrain_row(&cons, vals, cand, ncand, outval[row]);
+      if (zs) ncand = zone_row(zs, row, cand, ncand, outval[row]);
+      score_row(&sc, row, vals, cand, ncand, outval[row]);
+      if (crits) critset_add_row(crits, &sc, row, cand, ncand);
+      if (rg) reduced_fill_row(rg, row, outval[row]);
+      if (halo) {
+        sc = hsc;
+        cons = hcons;
+      } else {
+        track_score_range(outval[row], xres, row, &sr);
       }
     }
-  }
-
-  // want close to, so penalize far from
-  int ideal_px = 0.5f + xres * (180.f + ideal[ip][8]) / 360.f;
-  int ideal_py = 0.5f + yres * ( 90.f + ideal[ip][7]) / 180.f;
-  if (ideal[ip][7] > -500.f) {
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (vals[l]) {
+        (void)close_png_rows(&pr[l]);
+        free(vals[l]);
+      }
+    }
+#ifdef USE_MPI
+    // every process gets the range, and the first one the rest
+    if (mpi_size > 1) {
+      reduce_score_range(&sr, xres);
+      reduce_totals(&sc, &cons);
+      for (int ip=0; ip<p; ++ip) {
+        if (likes[ip] && likes[ip]->k > 0) reduce_like_matches(likes[ip], clo, chi);
+      }
+    }
+#endif
+  } else {
+    // coarse, fine, or reduced layers are unpacked into a row of their own
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      vals[l] = (layer[l] && (rs[l] || rg)) ? (float*)malloc(xres*sizeof(float)) : NULL;
+    }
     for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float distcost = dist_penalty * gcr_dist_px(ideal_px, ideal_py, col, row, xres, yres);
-          outval[col][row] += distcost;
-          total_dist += distcost;
-        }
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (!layer[l] || rs[l]) continue;
+        if (rg) reduced_scatter(rg, row, layer[l][row], vals[l]);
+        else vals[l] = layer[l][row];
+      }
+      int ncand = rg ? reduced_land_row(rg, row, vals[L_TEMPW], outval[row], cand)
+                     : land_row(vals[L_TEMPW], xres, outval[row], cand);
+      for (int l=0; l<NLAYERS+nextra; ++l) {
+        if (rs[l]) resample_row(rs[l], row, layer[l][rs[l]->r0[row]], layer[l][rs[l]->r1[row]], cand, ncand, vals[l]);
       }
+      if (cons.n) ncand = constrain_row(&cons, vals, cand, ncand, outval[row]);
+      if (zs) ncand = zone_row(zs, row, cand, ncand, outval[row]);
+      score_row(&sc, row, vals, cand, ncand, outval[row]);
+      if (crits) critset_add_row(crits, &sc, row, cand, ncand);
+      if (rg) reduced_fill_row(rg, row, outval[row]);
+      track_score_range(outval[row], xres, row, &sr);
+    }
+    for (int l=0; l<NLAYERS+nextra; ++l) {
+      if (!layer[l]) continue;
+      free_2d_array_f(layer[l]);
+      if (rs[l] || rg) free(vals[l]);
     }
   }
 
-  // want far from given point, so penalize close to
-  ideal_px = 0.5f + xres * (180.f + ideal[ip][10]) / 360.f;
-  ideal_py = 0.5f + yres * ( 90.f + ideal[ip][9]) / 180.f;
-  if (ideal[ip][9] > -500.f) {
-    for (int row=0; row<yres; ++row) {
-      for (int col=0; col<xres; ++col) {
-        if (tempw[col][row] > -29.9f) {
-          const float distcost = dist_penalty * (3.1416f-gcr_dist_px(ideal_px, ideal_py, col, row, xres, yres));
-          outval[col][row] += distcost;
-          total_dist += distcost;
-        }
-      }
+  // the best of a reduced pixel's span is its middle column
+  if (rg && sr.bestrow >= 0) sr.bestcol = reduced_middle(rg, sr.bestrow, reduced_col(rg, sr.bestrow, sr.bestcol));
+
+  const float *totals = sc.totals;
+  printf("total costs: temp %g, rain %g, cloud %g, wind %g, hdi %g, mtn %g\n", totals[C_TEMP], totals[C_RAIN], totals[C_CLOUD], totals[C_WIND], totals[C_HDI], totals[C_MTN]);
+  if (nextra) printf("total extra layer cost: %g\n", totals[C_EXTRA]);
+  if (any_likes) printf("total similarity cost: %g\n", sc.total_like);
+  if (cons.n) print_constraints(&cons);
+
+  if (sr.hi < sr.lo) {
+    printf("No place on Earth meets all of the requirements\n");
+    exit(0);
+  }
+
+  printf("min and max range: %g %g\n", sr.lo, sr.hi);
+
+  // the "best" place is the lowest cost, the flip below is monotonic
+  print_best_place(&sr, xres, yres, "");
+
+  // then how that holds up when the criteria are re-weighed, and draw that
+  if (robust) {
+    printf("Re-weighing the %d criteria of %d places %d ways\n", crits->nk, crits->n, robust);
+    float *hits = (float*)malloc(crits->n*sizeof(float));
+    float *rmean = (float*)malloc(crits->n*sizeof(float));
+    float *spread = (float*)malloc(crits->n*sizeof(float));
+    robust_weights(crits, robust, robustpct, hits, rmean, spread);
+
+    const int ib = critset_find(crits, sr.bestrow, sr.bestcol);
+    if (ib >= 0) printf("  it is in the best %g%% in %.1f%% of them, at percentile %.3g +- %.3g\n", robustpct, 100.f*hits[ib], rmean[ib], spread[ib]);
+
+    // most often in the best, and then highest ranked on average
+    int im = 0;
+    for (int i=1; i<crits->n; ++i) {
+      if (hits[i] > hits[im] || (hits[i] == hits[im] && rmean[i] < rmean[im])) im = i;
+    }
+    score_range rr = sr;
+    rr.bestrow = crits->row[im];
+    rr.bestcol = crits->col[im];
+    print_best_place(&rr, xres, yres, " for most weightings");
+    printf("  it is in the best %g%% in %.1f%% of them, at percentile %.3g +- %.3g\n", robustpct, 100.f*hits[im], rmean[im], spread[im]);
+
+    // the image is the fraction of weightings that each place is in the best of
+    for (int row=0; row<yres; ++row) memset(outval[row], 0, xres*sizeof(float));
+    for (int i=0; i<crits->n; ++i) outval[crits->row[i]][crits->col[i]] = hits[i];
+    if (rg) for (int row=0; row<yres; ++row) reduced_fill_row(rg, row, outval[row]);
+    if (spreadmap[0]) {
+      float** sp = allocate_2d_array_f(yres,xres);
+      memset(sp[0], 0, (long)xres*yres*sizeof(float));
+      for (int i=0; i<crits->n; ++i) sp[crits->row[i]][crits->col[i]] = spread[i];
+      if (rg) for (int row=0; row<yres; ++row) reduced_fill_row(rg, row, sp[row]);
+      (void)write_png(spreadmap,xres,yres,FALSE,TRUE, sp,0.f,50.f, NULL,0.0,1.0, NULL,0.0,1.0);
+      printf("Wrote the spread of percentile ranks (0 to 50) to %s\n", spreadmap);
+      free_2d_array_f(sp);
     }
+    free(hits);
+    free(rmean);
+    free(spread);
   }
 
+  // or which places no other beats in every criterion, and draw those
+  if (paretofile[0]) {
+    int *front = (int*)malloc(crits->n*sizeof(int));
+    const int nfront = pareto_front(crits, front);
+    printf("The Pareto front of the %d criteria holds %d of %d places\n", crits->nk, nfront, crits->n);
+
+    // list them as they come, by the sum of their criteria
+    FILE *fp = fopen(paretofile,"w");
+    if (fp==NULL) {
+      fprintf(stderr,"Could not open output file %s\n",paretofile);
+      fflush(stderr);
+      exit(0);
+    }
+    fprintf(fp,"# rank lat lon cost");
+    for (int kk=0; kk<crits->nk; ++kk) fprintf(fp," %s", crit_names[crits->k[kk]]);
+    fprintf(fp,"\n");
+    for (int j=0; j<nfront; ++j) {
+      const int i = front[j];
+      const float nlat = -90.f + 180.f*(0.5f+crits->row[i])/(float)yres;
+      const float elong = -180.f + 360.f*(0.5f+crits->col[i])/(float)xres;
+      fprintf(fp,"%d %g %g %g", j+1, nlat, elong, outval[crits->row[i]][crits->col[i]]);
+      for (int kk=0; kk<crits->nk; ++kk) fprintf(fp," %g", crits->cost[crits->k[kk]][i]);
+      fprintf(fp,"\n");
+    }
+    fclose(fp);
+    printf("Wrote the front, lowest total first, to %s\n", paretofile);
+
+    for (int row=0; row<yres; ++row) memset(outval[row], 0, xres*sizeof(float));
+    for (int j=0; j<nfront; ++j) outval[crits->row[front[j]]][crits->col[front[j]]] = 1.f;
+    if (rg) for (int row=0; row<yres; ++row) reduced_fill_row(rg, row, outval[row]);
+    free(front);
+  }
 
+  // then report and draw the smoothed costs too
+  if (smoothkm > 0.f) {
+    printf("Smoothing over %g km\n", smoothkm);
+    smooth_costs(outval+blo, xres, bhi-blo, blo, yres, smoothkm, smoothpasses);
+    find_score_range(outval, xres, clo, chi, &sr);
+#ifdef USE_MPI
+    if (mpi_size > 1) reduce_score_range(&sr, xres);
+#endif
+    printf("smoothed min and max range: %g %g\n", sr.lo, sr.hi);
+    print_best_place(&sr, xres, yres, " when smoothed");
   }
+  const float loval = sr.lo;
+  const float hival = sr.hi;
 
-  printf("total costs: temp %g, rain %g, cloud %g, wind %g, hdi %g, mtn %g\n", total_temp, total_rain, total_cloud, total_wind, total_hdi, total_mtn);
+  for (int ip=0; ip<p; ++ip) {
+    if (likes[ip] && likes[ip]->k > 0) print_like_matches(likes[ip], xres, yres);
+  }
 
-  // find the min and max values
-  float loval = 9.9e+9;
-  float hival = -9.9e+9;
-  int npix = 0;
-  for (int row=0; row<yres; ++row) {
-    for (int col=0; col<xres; ++col) {
-      if (tempw[col][row] > -29.9f) {
-        if (outval[col][row] < loval) loval = outval[col][row];
-        if (outval[col][row] > hival) hival = outval[col][row];
-        ++npix;
+#ifdef USE_MPI
+  // every process deflates its own rows, and the first writes them all
+  if (mpi_size > 1) {
+    write_png_band(outpng, outval, xres, yres, clo, chi, drawbdry, loval, hival);
+    exit(0);
+  }
+#endif
+
+  if (pipeline) {
+    // the bounds are known, so finalize, overlay, and encode rows top-down
+    // while the boundary image decodes in the background
+    row_queue bq;
+    if (drawbdry) (void)start_row_queue("natl_bdry.png",xres,yres,0.0,1.0,64,&bq);
+    png_out po;
+    (void)open_png_out(outpng, xres, yres, &po);
+    float outlo = 9.9e+9;
+    float outhi = -9.9e+9;
+    for (int row=yres-1; row>=0; --row) {
+      if (!robust && !paretofile[0]) finalize_row(outval[row], xres, loval, hival);
+      if (drawbdry) {
+        const float *bdry = next_queued_row(&bq);
+        for (int col=0; col<xres; ++col) {
+          if (bdry[col] > outval[row][col]) outval[row][col] = bdry[col];
+        }
+        release_queued_row(&bq);
       }
+      for (int col=0; col<xres; ++col) {
+        if (outval[row][col] < outlo) outlo = outval[row][col];
+        if (outval[row][col] > outhi) outhi = outval[row][col];
+      }
+      (void)write_png_row(&po, outval[row], 0.f, 1.f);
     }
+    (void)close_png_out(&po);
+    if (drawbdry) (void)finish_row_queue(&bq);
+    printf("  output range %g %g\n",outlo,outhi);
+    exit(0);
+  }
+
+  // the final value at the edge of the best places, found from the costs
+  const float contourlevel = contourfile[0] ? best_level(outval, xres, yres, loval, hival, contourpct) : 0.f;
+
+  // or write the values themselves, without the png's rounding
+  const int format = output_format(outpng);
+  if (format != OUT_PNG) {
+    (void)write_raw(outpng, format, outval, xres, yres, !robust && !paretofile[0], loval, hival);
+    if (!sparsefile[0] && !contourfile[0] && !tileport) exit(0);
   }
-  //printf("%g percent tallied\n", 100.f*npix/(xres*yres));
-  printf("min and max range: %g %g\n", loval, hival);
 
   // flip, to positive is better
   // and zero out the ocean
-  for (int row=0; row<yres; ++row) {
-    for (int col=0; col<xres; ++col) {
-      if (tempw[col][row] < -29.9f) {
-        // zero out the ocean
-        outval[col][row] = 0.0f;
-      } else {
-        // flip to 0=bad, 1=best
-        outval[col][row] = 1.0f - (outval[col][row]-loval)/(hival-loval);
-        // apply power to accentuate the best
-        outval[col][row] = powf(outval[col][row], 8.f);
-      }
-    }
+  if (!robust && !paretofile[0]) {
+    for (int row=0; row<yres; ++row) finalize_row(outval[row], xres, loval, hival);
   }
 
-  // find the "best" place
-  float bestval = 0.f;
-  int bestrow = -1;
-  int bestcol = -1;
-  for (int row=0; row<yres; ++row) {
-    for (int col=0; col<xres; ++col) {
-      if (tempw[col][row] > -29.9f) {
-        if (outval[col][row] > bestval) {
-          bestval = outval[col][row];
-          bestrow = row;
-          bestcol = col;
-        }
-      }
+  // outline the best places
+  if (contourfile[0]) (void)write_contours(contourfile, outval, xres, yres, contourlevel, contourpct);
+
+  // list only the places above a cutoff
+  if (sparsefile[0]) {
+    const long n = write_sparse(sparsefile, outval, xres, yres, sparsecut);
+    printf("Wrote the %ld places above %g to %s\n", n, sparsecut, sparsefile);
+  }
+
+  // or keep it in memory and serve it as map tiles, with the boundaries
+  // drawn onto each tile so that they stay sharp in the overviews
+  if (tileport) {
+    float** bdry = NULL;
+    if (drawbdry) {
+      bdry = allocate_2d_array_f(yres,xres);
+      (void)read_png("natl_bdry.png",xres,yres,FALSE,FALSE,1.0,FALSE,bdry,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
     }
+    serve_tiles(outval, bdry, xres, yres, tileport);
+    exit(0);
   }
-  //printf("Best pixel is %d %d\n", bestcol, bestrow);
-  printf("Best place on Earth is");
-  const float nlat = 0.1f*(0.5f+bestrow-900.f);
-  const float elong = 0.1f*(0.5f+bestcol-1800.f);
-  if (nlat>0.f) printf(" %g N", nlat);
-  else printf(" %g S", -nlat);
-  if (elong>0.f) printf(" %g E", elong);
-  else printf(" %g W", -elong);
-  printf("\n");
+  if (format != OUT_PNG) exit(0);
 
-  // optionally add national boundary lines (overwrite the mountain map)
+  // optionally add national boundary lines
   if (drawbdry) {
-    (void)read_png("natl_bdry.png",xres,yres,FALSE,FALSE,1.0,FALSE,mtn,0.0,1.0,NULL,0.0,1.0,NULL,0.0,1.0);
-    // and include only where it makes the pixel brighter
-    for (int row=0; row<yres; ++row) {
+    png_rows pr;
+    float* bdry = (float*)malloc(xres*sizeof(float));
+    (void)open_png_rows("natl_bdry.png",xres,yres,0.0,1.0,&pr);
+    for (int n=0; n<yres; ++n) {
+      const int row = read_png_row(&pr, bdry);
+      // and include only where it makes the pixel brighter
       for (int col=0; col<xres; ++col) {
-        if (mtn[col][row] > outval[col][row]) outval[col][row] = mtn[col][row];
+        if (bdry[col] > outval[row][col]) outval[row][col] = bdry[col];
       }
     }
+    (void)close_png_rows(&pr);
+    free(bdry);
   }
 
   // write the image
@@ -1404,4 +8122,4 @@ int main (int argc, char **argv) {
 
   exit(0);
 }
-
+#endif
@@ -0,0 +1,513 @@
+/*
+ * pyidealplace.c
+ *
+ * a Python module over the scoring engine in idealplace.c: the layers
+ * are loaded once into a Context, and each query is a dict of the same
+ * options as the command line, scored without the GIL into grids that
+ * numpy (or a memoryview) reads in place
+ *
+ *    import idealplace, numpy
+ *    ctx = idealplace.Context(month=0)
+ *    r = ctx.score({"tc": (0, 10, 20, 30), "+hdi": 0.9, "ct": "Boston"})
+ *    score = numpy.asarray(r["score"])
+ *
+ * the manifest and the extra layers are shared by every Context in the
+ * process, and the first one to load sets them
+ *
+ * Compile with
+ *    make python
+ */
+
+#include <Python.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+// the engine's progress messages are for the command line, and its
+// error messages become the exception's
+#define IDEALPLACE_LIB
+static _Thread_local char lib_msg[1024];
+static _Thread_local size_t lib_msglen = 0;
+
+static int lib_fprintf (FILE *fp, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n;
+  if (fp == stderr) {
+    n = vsnprintf(lib_msg+lib_msglen, sizeof(lib_msg)-lib_msglen, fmt, ap);
+    if (n > 0) lib_msglen += n;
+    if (lib_msglen >= sizeof(lib_msg)) lib_msglen = sizeof(lib_msg)-1;
+  } else {
+    n = vfprintf(fp, fmt, ap);
+  }
+  va_end(ap);
+  return n;
+}
+
+// swallowed, but its arguments still count as used
+static inline int lib_printf (const char *fmt, ...) {
+  (void)fmt;
+  return 0;
+}
+
+#define printf lib_printf
+#define fprintf lib_fprintf
+
+#include "idealplace.c"
+
+// run one of the engine's calls, returning FALSE with an exception set
+// if it failed
+#define GUARDED(call) \
+  do { \
+    jmp_buf jb; \
+    lib_msglen = 0; \
+    lib_msg[0] = '\0'; \
+    fail_jmp = &jb; \
+    if (setjmp(jb)) { \
+      fail_jmp = NULL; \
+      while (lib_msglen > 0 && lib_msg[lib_msglen-1] == '\n') lib_msg[--lib_msglen] = '\0'; \
+      PyErr_SetString(PyExc_ValueError, lib_msglen ? lib_msg : "idealplace failed"); \
+      return FALSE; \
+    } \
+    call; \
+    fail_jmp = NULL; \
+  } while (0)
+
+
+/*
+ * a grid of float32, [row][col] with row 0 the south as in the engine,
+ * seen through the buffer protocol north row first without a copy
+ */
+typedef struct {
+  PyObject_HEAD
+  float **rows;
+  Py_ssize_t shape[2], strides[2];
+} Grid;
+
+static void grid_dealloc (Grid *g) {
+  if (g->rows) free_2d_array_f(g->rows);
+  Py_TYPE(g)->tp_free((PyObject *)g);
+}
+
+static int grid_getbuffer (Grid *g, Py_buffer *view, int flags) {
+  if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES) {
+    PyErr_SetString(PyExc_BufferError, "a Grid is north row first, which needs strides");
+    view->obj = NULL;
+    return -1;
+  }
+  view->obj = (PyObject *)g;
+  Py_INCREF(g);
+  // the last row in memory is the first one north
+  view->buf = g->rows[g->shape[0]-1];
+  view->len = g->shape[0] * g->shape[1] * sizeof(float);
+  view->readonly = 0;
+  view->itemsize = sizeof(float);
+  view->format = (flags & PyBUF_FORMAT) ? "f" : NULL;
+  view->ndim = 2;
+  view->shape = g->shape;
+  view->strides = g->strides;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static PyBufferProcs grid_as_buffer = {
+  (getbufferproc)grid_getbuffer,
+  NULL,
+};
+
+static PyObject* grid_get_shape (Grid *g, void *closure) {
+  return Py_BuildValue("(nn)", g->shape[0], g->shape[1]);
+}
+
+static PyGetSetDef grid_getset[] = {
+  { "shape", (getter)grid_get_shape, NULL, "(rows, columns), north row first", NULL },
+  { NULL }
+};
+
+static PyTypeObject GridType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "idealplace.Grid",
+  .tp_doc = "A grid of float32 from the engine, for numpy.asarray or memoryview",
+  .tp_basicsize = sizeof(Grid),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc = (destructor)grid_dealloc,
+  .tp_as_buffer = &grid_as_buffer,
+  .tp_getset = grid_getset,
+};
+
+// a Grid that owns these rows
+static PyObject* new_grid (float **rows, const int nx, const int ny) {
+  Grid *g = PyObject_New(Grid, &GridType);
+  if (g == NULL) {
+    free_2d_array_f(rows);
+    return NULL;
+  }
+  g->rows = rows;
+  g->shape[0] = ny;
+  g->shape[1] = nx;
+  g->strides[0] = -(Py_ssize_t)nx * (Py_ssize_t)sizeof(float);
+  g->strides[1] = sizeof(float);
+  return (PyObject *)g;
+}
+
+
+/*
+ * the layers, loaded once
+ */
+typedef struct {
+  PyObject_HEAD
+  engine *en;
+} Context;
+
+static void context_dealloc (Context *c) {
+  if (c->en) free_engine(c->en);
+  Py_TYPE(c)->tp_free((PyObject *)c);
+}
+
+static int load_layers (engine *en, const int month, const char *manifest, char **names, const int n) {
+  GUARDED(
+    if (manifest) read_manifest(manifest);
+    for (int i=0; i<n; ++i) (void)add_extra_layer(names[i]);
+    load_engine(en, month)
+  );
+  return TRUE;
+}
+
+// the layer registry is the whole process's, so a load that fails puts
+// it back as it was, and frees what it had read
+static int load_context (Context *c, const int month, const char *manifest, char **names, const int n) {
+  const int ndefs0 = ndefs;
+  const int nextra0 = nextra;
+  layer_def *defs0 = (layer_def *)malloc(sizeof(layer_defs));
+  float min0[MAXLAYERS], range0[MAXLAYERS];
+  memcpy(defs0, layer_defs, sizeof(layer_defs));
+  memcpy(min0, layer_min, sizeof(layer_min));
+  memcpy(range0, layer_range, sizeof(layer_range));
+  engine *en = (engine *)calloc(1, sizeof(engine));
+  const int ok = load_layers(en, month, manifest, names, n);
+  if (ok) {
+    c->en = en;
+  } else {
+    free_engine(en);
+    ndefs = ndefs0;
+    nextra = nextra0;
+    memcpy(layer_defs, defs0, sizeof(layer_defs));
+    memcpy(layer_min, min0, sizeof(layer_min));
+    memcpy(layer_range, range0, sizeof(layer_range));
+  }
+  free(defs0);
+  return ok;
+}
+
+// whether the first Context loaded this extra layer
+static int extra_loaded (const char *name) {
+  const int d = find_layer_def(name);
+  for (int k=0; k<nextra; ++k) if (d >= 0 && extra_def[k] == d) return TRUE;
+  return FALSE;
+}
+
+static int context_init (Context *c, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "month", "manifest", "layers", NULL };
+  int month = 0;
+  const char *manifest = NULL;
+  PyObject *layers = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|izO", kwlist, &month, &manifest, &layers)) return -1;
+  if (c->en) {
+    PyErr_SetString(PyExc_RuntimeError, "this Context is already loaded");
+    return -1;
+  }
+  if (month < 0 || month > 12) {
+    PyErr_SetString(PyExc_ValueError, "month must be 1 to 12, or 0 for the whole year");
+    return -1;
+  }
+  // the registry is shared, so it's set up by the first Context
+  if (manifest && extras_fixed) {
+    PyErr_SetString(PyExc_ValueError, "a manifest can only be read before the first Context is loaded, as every Context shares its layers");
+    return -1;
+  }
+  PyObject *seq = (layers && layers != Py_None) ? PySequence_Fast(layers, "layers must be a sequence of names") : PyTuple_New(0);
+  if (seq == NULL) return -1;
+  const int n = (int)PySequence_Fast_GET_SIZE(seq);
+  char *names[MAXEXTRA];
+  if (n > MAXEXTRA) {
+    Py_DECREF(seq);
+    PyErr_Format(PyExc_ValueError, "No more than %d extra layers allowed", MAXEXTRA);
+    return -1;
+  }
+  for (int i=0; i<n; ++i) {
+    names[i] = (char *)PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+    if (names[i] == NULL) {
+      Py_DECREF(seq);
+      return -1;
+    }
+    // and so are the extra layers, so a later Context can only name those
+    if (extras_fixed && !extra_loaded(names[i])) {
+      PyErr_Format(PyExc_ValueError, "layer %s was not loaded by the first Context; the extra layers "
+                   "are shared by every Context, so give them all to the first one", names[i]);
+      Py_DECREF(seq);
+      return -1;
+    }
+  }
+  const int ok = load_context(c, month, manifest, names, n);
+  Py_DECREF(seq);
+  return ok ? 0 : -1;
+}
+
+/*
+ * a query's options as command-line arguments: each key is an option,
+ * with a - in front unless it has its own + or -, and each value its
+ * arguments, none for True, and the option is left out for False or
+ * None; a list of dicts is one set of preferences each
+ */
+static int add_option (PyObject *argl, PyObject *key, PyObject *value) {
+  if (!PyUnicode_Check(key)) {
+    PyErr_SetString(PyExc_TypeError, "preference names must be strings");
+    return FALSE;
+  }
+  if (value == Py_None || value == Py_False) return TRUE;
+  const char *k = PyUnicode_AsUTF8(key);
+  PyObject *opt = (k[0] == '+' || k[0] == '-') ? Py_NewRef(key) : PyUnicode_FromFormat("-%U", key);
+  if (opt == NULL || PyList_Append(argl, opt) < 0) {
+    Py_XDECREF(opt);
+    return FALSE;
+  }
+  Py_DECREF(opt);
+  if (value == Py_True) return TRUE;
+  int ok = TRUE;
+  if (PyUnicode_Check(value) || !PySequence_Check(value)) {
+    PyObject *s = PyObject_Str(value);
+    ok = (s != NULL && PyList_Append(argl, s) == 0);
+    Py_XDECREF(s);
+  } else {
+    PyObject *seq = PySequence_Fast(value, "");
+    if (seq == NULL) return FALSE;
+    for (Py_ssize_t i=0; i<PySequence_Fast_GET_SIZE(seq) && ok; ++i) {
+      PyObject *s = PyObject_Str(PySequence_Fast_GET_ITEM(seq, i));
+      ok = (s != NULL && PyList_Append(argl, s) == 0);
+      Py_XDECREF(s);
+    }
+    Py_DECREF(seq);
+  }
+  return ok;
+}
+
+static PyObject* query_args (PyObject *query) {
+  PyObject *argl = PyList_New(0);
+  if (argl == NULL) return NULL;
+  PyObject *people = PyDict_Check(query) ? PyTuple_Pack(1, query) : PySequence_Tuple(query);
+  if (people == NULL) {
+    Py_DECREF(argl);
+    return NULL;
+  }
+  for (Py_ssize_t ip=0; ip<PyTuple_GET_SIZE(people); ++ip) {
+    PyObject *d = PyTuple_GET_ITEM(people, ip);
+    if (!PyDict_Check(d)) {
+      PyErr_SetString(PyExc_TypeError, "preferences must be a dict, or a list of dicts");
+      goto error;
+    }
+    if (ip > 0) {
+      PyObject *s = PyUnicode_FromString("-new");
+      const int r = PyList_Append(argl, s);
+      Py_DECREF(s);
+      if (r < 0) goto error;
+    }
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(d, &pos, &key, &value)) {
+      if (!add_option(argl, key, value)) goto error;
+    }
+  }
+  Py_DECREF(people);
+  return argl;
+error:
+  Py_DECREF(people);
+  Py_DECREF(argl);
+  return NULL;
+}
+
+static int parse_query (const engine *en, prefs *q, const int argc, char **argv) {
+  GUARDED(
+    for (int i=0; i<argc; ++i) {
+      float weight_mult = 1.f;
+      const char *thisarg = option_word(argv[i], &weight_mult);
+      const int used = parse_pref(q, argc, argv, i, thisarg, weight_mult);
+      if (!used) {
+        fprintf(stderr,"%s is not a preference\n", argv[i]);
+        fail(0);
+      }
+      if (i+used > argc) {
+        fprintf(stderr,"%s needs more values\n", argv[i]);
+        fail(0);
+      }
+      i += used-1;
+    }
+    prepare_query(en, q)
+  );
+  return TRUE;
+}
+
+static PyObject* context_score (Context *c, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = { "prefs", "criteria", NULL };
+  PyObject *query;
+  int want_crit = FALSE;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", kwlist, &query, &want_crit)) return NULL;
+  const engine *en = c->en;
+  if (en == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "this Context is not loaded");
+    return NULL;
+  }
+
+  PyObject *argl = query_args(query);
+  if (argl == NULL) return NULL;
+  const int argc = (int)PyList_GET_SIZE(argl);
+  // with room for an option to read past the end, to be caught after
+  char **argv = (char **)malloc((argc+8)*sizeof(char *));
+  for (int i=0; i<argc; ++i) argv[i] = (char *)PyUnicode_AsUTF8(PyList_GET_ITEM(argl, i));
+  for (int i=argc; i<argc+8; ++i) argv[i] = "";
+  prefs *q = (prefs *)malloc(sizeof(prefs));
+  init_prefs(q);
+  const int ok = parse_query(en, q, argc, argv);
+  free(argv);
+  Py_DECREF(argl);
+  if (!ok) {
+    free_prefs(q);
+    free(q);
+    return NULL;
+  }
+
+  // a grid for the costs, and one for each criterion in use
+  const int xres = en->xres;
+  const int yres = en->yres;
+  int used[NCRIT];
+  used_criteria(q->p, q->ideal, q->extra_ideal, q->likes, q->routes, used);
+  float **out = allocate_2d_array_f(yres,xres);
+  float **crit[NCRIT];
+  for (int k=0; k<NCRIT; ++k) crit[k] = (want_crit && used[k]) ? allocate_2d_array_f(yres,xres) : NULL;
+  score_range sr;
+  float totals[NCRIT];
+  Py_BEGIN_ALLOW_THREADS
+  score_query(en, q, out, crit, &sr, totals);
+  Py_END_ALLOW_THREADS
+  free_prefs(q);
+  free(q);
+
+  // and the scores, as in the image
+  float **score = allocate_2d_array_f(yres,xres);
+  memcpy(score[0], out[0], (size_t)xres*yres*sizeof(float));
+  const int found = (sr.hi >= sr.lo);
+  for (int row=0; row<yres; ++row) {
+    if (found) finalize_row(score[row], xres, sr.lo, sr.hi);
+    else memset(score[row], 0, xres*sizeof(float));
+  }
+
+  PyObject *r = PyDict_New();
+  PyObject *crits = PyDict_New();
+  PyObject *tot = PyDict_New();
+  PyObject *o = NULL;
+  if (r == NULL || crits == NULL || tot == NULL) goto error;
+  o = new_grid(out, xres, yres);
+  out = NULL;
+  if (o == NULL || PyDict_SetItemString(r, "cost", o) < 0) goto error;
+  Py_DECREF(o);
+  o = new_grid(score, xres, yres);
+  score = NULL;
+  if (o == NULL || PyDict_SetItemString(r, "score", o) < 0) goto error;
+  Py_DECREF(o);
+  for (int k=0; k<NCRIT; ++k) {
+    if (crit[k]) {
+      o = new_grid(crit[k], xres, yres);
+      crit[k] = NULL;
+      if (o == NULL || PyDict_SetItemString(crits, crit_names[k], o) < 0) goto error;
+      Py_DECREF(o);
+    }
+    if (!used[k]) continue;
+    o = PyFloat_FromDouble(totals[k]);
+    if (o == NULL || PyDict_SetItemString(tot, crit_names[k], o) < 0) goto error;
+    Py_DECREF(o);
+  }
+  o = NULL;
+  if (want_crit && PyDict_SetItemString(r, "criteria", crits) < 0) goto error;
+  if (PyDict_SetItemString(r, "totals", tot) < 0) goto error;
+  Py_CLEAR(crits);
+  Py_CLEAR(tot);
+  if (found) {
+    const float nlat = -90.f + 180.f*(0.5f+sr.bestrow)/(float)yres;
+    const float elong = -180.f + 360.f*(0.5f+sr.bestcol)/(float)xres;
+    o = Py_BuildValue("(dd)", nlat, elong);
+    if (o == NULL || PyDict_SetItemString(r, "best", o) < 0) goto error;
+    Py_DECREF(o);
+    o = Py_BuildValue("(dd)", sr.lo, sr.hi);
+    if (o == NULL || PyDict_SetItemString(r, "range", o) < 0) goto error;
+    Py_DECREF(o);
+  } else {
+    if (PyDict_SetItemString(r, "best", Py_None) < 0 || PyDict_SetItemString(r, "range", Py_None) < 0) goto error;
+  }
+  return r;
+
+error:
+  Py_XDECREF(o);
+  Py_XDECREF(r);
+  Py_XDECREF(crits);
+  Py_XDECREF(tot);
+  if (out) free_2d_array_f(out);
+  if (score) free_2d_array_f(score);
+  for (int k=0; k<NCRIT; ++k) if (crit[k]) free_2d_array_f(crit[k]);
+  return NULL;
+}
+
+static PyObject* context_get_shape (Context *c, void *closure) {
+  if (c->en == NULL) Py_RETURN_NONE;
+  return Py_BuildValue("(ii)", c->en->yres, c->en->xres);
+}
+
+static PyMethodDef context_methods[] = {
+  { "score", (PyCFunction)(void(*)(void))context_score, METH_VARARGS | METH_KEYWORDS,
+    "score(prefs, criteria=False)\n\n"
+    "Score a dict of preferences, or a list of them for several people, with\n"
+    "the command line's options as keys: {\"tc\": (0, 10, 20, 30), \"+hdi\": 0.9}.\n"
+    "Returns a dict of the \"cost\" and \"score\" grids, the \"best\" place as\n"
+    "(lat, lon), the \"range\" of costs, the \"totals\" of each criterion, and\n"
+    "with criteria=True a grid of each criterion's cost under \"criteria\".\n"
+    "The GIL is released while scoring, so threads can score at once." },
+  { NULL }
+};
+
+static PyGetSetDef context_getset[] = {
+  { "shape", (getter)context_get_shape, NULL, "(rows, columns) of the scoring grid", NULL },
+  { NULL }
+};
+
+static PyTypeObject ContextType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "idealplace.Context",
+  .tp_doc = "Context(month=0, manifest=None, layers=())\n\n"
+            "Every layer held in memory for scoring one query after another, for the\n"
+            "given month or the whole year, with the extra layers named in the\n"
+            "manifest (read only before the first Context) or given as png files.",
+  .tp_basicsize = sizeof(Context),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = PyType_GenericNew,
+  .tp_init = (initproc)context_init,
+  .tp_dealloc = (destructor)context_dealloc,
+  .tp_methods = context_methods,
+  .tp_getset = context_getset,
+};
+
+static PyModuleDef idealplace_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "idealplace",
+  .m_doc = "Find the ideal place on Earth, from Python.",
+  .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_idealplace (void) {
+  if (PyType_Ready(&GridType) < 0 || PyType_Ready(&ContextType) < 0) return NULL;
+  PyObject *m = PyModule_Create(&idealplace_module);
+  if (m == NULL) return NULL;
+  if (PyModule_AddObjectRef(m, "Grid", (PyObject *)&GridType) < 0 ||
+      PyModule_AddObjectRef(m, "Context", (PyObject *)&ContextType) < 0) {
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
+}